@@ -0,0 +1,75 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "memcache.h"
+
+/*
+ * Measures the cost of assembling the reply of a get hit for small values,
+ * comparing a header formatted per hit ("VALUE", key, flags and bytes
+ * converted with to_string and copied) with the header rendered when the
+ * entry was stored, which the reply only references
+ * Usage: bench_get_hit [value size] [iterations]
+ */
+
+#define NUM_KEYS 1000
+
+int main(int argc, char *argv[]) {
+  size_t value_size = argc > 1 ? strtoul(argv[1], nullptr, 10) : 32;
+  int iterations = argc > 2 ? atoi(argv[2]) : 2000000;
+
+  Cache cache(NUM_KEYS);
+  std::vector<std::vector<std::string>> keys(NUM_KEYS);
+  for (int i = 0; i < NUM_KEYS; i++) {
+    CacheNode *node = new CacheNode();
+    node->key = "user:session:" + std::to_string(i);
+    node->flags = 1234;
+    node->bytes = value_size;
+    node->data = new char[value_size];
+    memset(node->data, 'x', value_size);
+    keys[i].push_back(node->key);
+    cache.addNewEntry(node);
+  }
+  std::vector<ItemHandle> items;
+  std::vector<ItemHandle> hits;
+  for (int i = 0; i < NUM_KEYS; i++) {
+    cache.getEntries(keys[i], &items);
+    hits.push_back(items[0]);
+  }
+
+  size_t bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    const ItemHandle& item = hits[i % NUM_KEYS];
+    Response response;
+    string header = "VALUE ";
+    header.append(item->key);
+    header.append(" ").append(to_string(item->flags));
+    header.append(" ").append(to_string(item->bytes));
+    header.append("\r\n");
+    response.append(header);
+    response.appendRef(item->data, item->bytes, item);
+    response.append("\r\n", 2);
+    bytes += response.length();
+  }
+  auto formatted = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    const ItemHandle& item = hits[i % NUM_KEYS];
+    Response response;
+    response.appendRef(item->header.data(), item->header.length(), item);
+    response.appendRef(item->data, item->bytes, item);
+    response.appendRef("\r\n", 2, nullptr);
+    bytes += response.length();
+  }
+  auto rendered = std::chrono::steady_clock::now() - start;
+
+  auto ns_per_hit = [iterations](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / (double) iterations;
+  };
+  printf("get hit, %zu byte values, %d iterations (%zu)\n", value_size, iterations, bytes);
+  printf("header formatted per hit: %8.1f ns/hit\n", ns_per_hit(formatted));
+  printf("header rendered at set:   %8.1f ns/hit\n", ns_per_hit(rendered));
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memcache.h"
+
+/*
+ * Measures many threads incrementing a handful of hot counters, comparing
+ * the 'incr' command, which updates the counter in place in one critical
+ * section, with what clients did before it existed: a get, parsing the
+ * value, and a set of the new value (which also loses updates under
+ * contention)
+ * Usage: bench_incr [threads] [counters] [increments per thread]
+ */
+
+static void IncrCommand(Cache *cache, int counters, int count) {
+  std::vector<std::string> commands;
+  for (int i = 0; i < counters; i++) {
+    commands.push_back("incr counter:" + std::to_string(i) + " 1\r\n");
+  }
+  for (int i = 0; i < count; i++) {
+    ParseArithmeticCmd(commands[i % counters], cache);
+  }
+}
+
+static void GetParseSet(Cache *cache, int counters, int count) {
+  std::vector<std::string> keys;
+  for (int i = 0; i < counters; i++) {
+    keys.push_back("counter:" + std::to_string(i));
+  }
+  for (int i = 0; i < count; i++) {
+    const std::string& key = keys[i % counters];
+    CacheNode *node = cache->getEntry(key);
+    if (node == nullptr) {
+      continue;
+    }
+    std::string value = std::to_string(strtoull(std::string(node->data, node->bytes).c_str(), nullptr, 10) + 1);
+    delete node;
+    std::string cmd_str = "set " + key + " 0 0 " + std::to_string(value.length()) + "\r\n" + value + "\r\n";
+    ParseStorageCmd(cmd_str, cache, cmd_str.length());
+  }
+}
+
+static double Run(void (*func)(Cache *, int, int), int threads, int counters, int count) {
+  Cache cache(CAPACITY);
+  for (int i = 0; i < counters; i++) {
+    std::string cmd_str = "set counter:" + std::to_string(i) + " 0 0 1\r\n0\r\n";
+    ParseStorageCmd(cmd_str, &cache, cmd_str.length());
+  }
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < threads; i++) {
+    workers.push_back(std::thread(func, &cache, counters, count));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return threads * (double) count / std::chrono::duration<double>(elapsed).count();
+}
+
+int main(int argc, char *argv[]) {
+  int threads = argc > 1 ? atoi(argv[1]) : 16;
+  int counters = argc > 2 ? atoi(argv[2]) : 4;
+  int count = argc > 3 ? atoi(argv[3]) : 100000;
+
+  printf("%d threads, %d counters, %d increments per thread\n", threads, counters, count);
+  printf("incr:          %12.0f ops/s\n", Run(IncrCommand, threads, counters, count));
+  printf("get+parse+set: %12.0f ops/s\n", Run(GetParseSet, threads, counters, count));
+  return 0;
+}
@@ -0,0 +1,166 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memserver.h"
+
+/*
+ * Measures the round trip of requests run inline on the event loop thread
+ * against requests handed to the threadpool. Clients on several
+ * connections send a 'get' of a 40 byte value, which runs inline with the
+ * default limit and on the threadpool with a limit of 0, and a 'set' of a
+ * 100KB value, which is above the limit and always runs on the threadpool.
+ * The benchmark reports the requests per second and the p50 and p99
+ * latencies
+ * Usage: bench_inline [connections] [requests per connection]
+ */
+
+#define BENCH_PORT 11341
+#define SMALL_VALUE_SIZE 40
+#define LARGE_VALUE_SIZE (100 * 1024)
+
+static pid_t StartServer(int port, size_t inline_limit) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  freopen("/dev/null", "w", stdout);
+  ThreadPool *pool = new ThreadPool(4);
+  pool->init();
+  Cache *cache = new Cache();
+  CacheServer *server = new CacheServer(std::to_string(port), pool, cache, LoopEpoll);
+  server->SetInlineLimit(inline_limit);
+  if (server->init() < 0) {
+    _exit(1);
+  }
+  server->WaitForClientRequests();
+  _exit(0);
+}
+
+static int Connect(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+      perror("socket");
+      exit(1);
+    }
+    if (connect(sd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+      int yes = 1;
+      setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+      return sd;
+    }
+    close(sd);
+    usleep(10000);
+  }
+  perror("connect");
+  exit(1);
+}
+
+static bool Request(int sd, const std::string& request, size_t reply_length) {
+  size_t written = 0;
+  while (written < request.length()) {
+    ssize_t n = write(sd, request.data() + written, request.length() - written);
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  char reply[1024];
+  size_t received = 0;
+  while (received < reply_length) {
+    ssize_t n = read(sd, reply, sizeof reply);
+    if (n <= 0) {
+      return false;
+    }
+    received += n;
+  }
+  return true;
+}
+
+static void Run(const char *name, size_t inline_limit, const std::string& request,
+                size_t reply_length, int connections, int requests, int port) {
+  pid_t pid = StartServer(port, inline_limit);
+
+  std::string set = "set small 0 0 " + std::to_string(SMALL_VALUE_SIZE) + "\r\n";
+  set.append(SMALL_VALUE_SIZE, 'x').append("\r\n");
+  int sd = Connect(port);
+  if (!Request(sd, set, strlen("STORED\r\n"))) {
+    perror("set");
+    exit(1);
+  }
+  close(sd);
+
+  std::vector<int> sds;
+  for (int i = 0; i < connections; i++) {
+    sds.push_back(Connect(port));
+  }
+  std::vector<std::vector<double>> latencies(connections);
+  std::vector<std::thread> clients;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < connections; i++) {
+    clients.push_back(std::thread([&, i]() {
+      for (int r = 0; r < requests; r++) {
+        auto begin = std::chrono::steady_clock::now();
+        if (!Request(sds[i], request, reply_length)) {
+          perror("request");
+          exit(1);
+        }
+        auto end = std::chrono::steady_clock::now();
+        latencies[i].push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+      }
+    }));
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> all;
+  for (auto& l : latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  std::sort(all.begin(), all.end());
+  printf("%-22s %8.0f requests/s  p50 %7.1f us  p99 %7.1f us\n", name, all.size() / elapsed,
+         all[all.size() / 2], all[all.size() * 99 / 100]);
+
+  for (int s : sds) {
+    close(s);
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char *argv[]) {
+  int connections = argc > 1 ? atoi(argv[1]) : 16;
+  int requests = argc > 2 ? atoi(argv[2]) : 5000;
+
+  printf("%d connections, %d requests each, inline limit %d bytes\n",
+         connections, requests, INLINE_LIMIT);
+  std::string get = "get small\r\n";
+  size_t get_reply = strlen("VALUE small 0 40\r\n") + SMALL_VALUE_SIZE + 2;
+  std::string set = "set large 0 0 " + std::to_string(LARGE_VALUE_SIZE) + "\r\n";
+  set.append(LARGE_VALUE_SIZE, 'x').append("\r\n");
+  size_t set_reply = strlen("STORED\r\n");
+
+  int port = BENCH_PORT;
+  Run("get 40B, inline", INLINE_LIMIT, get, get_reply, connections, requests, port++);
+  Run("get 40B, threadpool", 0, get, get_reply, connections, requests, port++);
+  Run("set 100KB, threadpool", INLINE_LIMIT, set, set_reply, connections, requests / 10, port++);
+  return 0;
+}
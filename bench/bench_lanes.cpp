@@ -0,0 +1,173 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memserver.h"
+
+/*
+ * Measures the latency of small gets during a burst of 128KB sets, with
+ * every batch in one lane of the threadpool and with the sets in the bulk
+ * lane. Clients on several connections send 'get' requests for a 100 byte
+ * value and report the p50, p99 and p99.9 latencies, first alone and then
+ * while other clients send sets as fast as they can. The gets are not run
+ * inline (-i 0), so that both kinds of requests go through the threadpool
+ * Usage: bench_lanes [get connections] [set connections] [seconds]
+ */
+
+#define BENCH_PORT 11381
+#define SMALL_VALUE_SIZE 100
+#define LARGE_VALUE_SIZE MAX_DATA_LEN
+
+static pid_t StartServer(int port, size_t bulk_threshold) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  freopen("/dev/null", "w", stdout);
+  ThreadPool *pool = new ThreadPool(4);
+  pool->init();
+  Cache *cache = new Cache();
+  CacheServer *server = new CacheServer(std::to_string(port), pool, cache, LoopEpoll);
+  server->SetInlineLimit(0);
+  server->SetBulkThreshold(bulk_threshold);
+  if (server->init() < 0) {
+    _exit(1);
+  }
+  server->WaitForClientRequests();
+  _exit(0);
+}
+
+static int Connect(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+      perror("socket");
+      exit(1);
+    }
+    if (connect(sd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+      int yes = 1;
+      setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+      return sd;
+    }
+    close(sd);
+    usleep(10000);
+  }
+  perror("connect");
+  exit(1);
+}
+
+static bool Request(int sd, const std::string& request, size_t reply_length) {
+  size_t written = 0;
+  while (written < request.length()) {
+    ssize_t n = write(sd, request.data() + written, request.length() - written);
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  char reply[1024];
+  size_t received = 0;
+  while (received < reply_length) {
+    ssize_t n = read(sd, reply, sizeof reply);
+    if (n <= 0) {
+      return false;
+    }
+    received += n;
+  }
+  return true;
+}
+
+static std::string SetRequest(const std::string& key, size_t size) {
+  std::string set = "set " + key + " 0 0 " + std::to_string(size) + "\r\n";
+  return set.append(size, 'x').append("\r\n");
+}
+
+static void Run(const char *name, size_t bulk_threshold, int getters, int setters, int seconds,
+                int port) {
+  pid_t pid = StartServer(port, bulk_threshold);
+  int sd = Connect(port);
+  if (!Request(sd, SetRequest("small", SMALL_VALUE_SIZE), strlen("STORED\r\n"))) {
+    perror("set");
+    exit(1);
+  }
+  close(sd);
+
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> sets(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < setters; i++) {
+    threads.push_back(std::thread([&, i]() {
+      int sd = Connect(port);
+      std::string set = SetRequest("large" + std::to_string(i), LARGE_VALUE_SIZE);
+      uint64_t count = 0;
+      while (!stop && Request(sd, set, strlen("STORED\r\n"))) {
+        count++;
+      }
+      sets += count;
+      close(sd);
+    }));
+  }
+  std::string get = "get small\r\n";
+  size_t reply_length = strlen("VALUE small 0 100\r\n") + SMALL_VALUE_SIZE + 2;
+  std::vector<std::vector<double>> latencies(getters);
+  for (int i = 0; i < getters; i++) {
+    threads.push_back(std::thread([&, i]() {
+      int sd = Connect(port);
+      while (!stop) {
+        auto begin = std::chrono::steady_clock::now();
+        if (!Request(sd, get, reply_length)) {
+          perror("get");
+          exit(1);
+        }
+        auto end = std::chrono::steady_clock::now();
+        latencies[i].push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+      }
+      close(sd);
+    }));
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  stop = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<double> all;
+  for (auto& l : latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  std::sort(all.begin(), all.end());
+  printf("%-22s %8.0f gets/s  p50 %7.1f us  p99 %8.1f us  p99.9 %8.1f us  %6.0f sets/s\n", name,
+         all.size() / (double) seconds, all[all.size() / 2], all[all.size() * 99 / 100],
+         all[all.size() * 999 / 1000], sets / (double) seconds);
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char *argv[]) {
+  int getters = argc > 1 ? atoi(argv[1]) : 4;
+  int setters = argc > 2 ? atoi(argv[2]) : 8;
+  int seconds = argc > 3 ? atoi(argv[3]) : 3;
+
+  printf("'get' of a %d byte value on %d connections, 'set' of a %d byte value on %d, %d s\n",
+         SMALL_VALUE_SIZE, getters, LARGE_VALUE_SIZE, setters, seconds);
+  Run("gets alone", BULK_THRESHOLD, getters, 0, seconds, BENCH_PORT);
+  Run("with sets, one lane", 0, getters, setters, seconds, BENCH_PORT + 1);
+  Run("with sets, bulk lane", BULK_THRESHOLD, getters, setters, seconds, BENCH_PORT + 2);
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include "memcache.h"
+
+/*
+ * Measures a 100 key multi-get against a full cache, comparing a lookup
+ * per key with getEntry() (one lock acquisition and one copy per key)
+ * with the batched getEntries() lookup, and the cost of the whole 'get'
+ * command including parsing and building the reply
+ * Usage: bench_multiget [value size] [iterations]
+ */
+
+#define KEYS_PER_GET 100
+
+int main(int argc, char *argv[]) {
+  size_t value_size = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100;
+  int iterations = argc > 2 ? atoi(argv[2]) : 20000;
+
+  Cache cache(CAPACITY);
+  for (int i = 0; i < CAPACITY; i++) {
+    CacheNode *node = new CacheNode();
+    node->key = "key:" + std::to_string(i);
+    node->bytes = value_size;
+    node->data = new char[value_size];
+    memset(node->data, 'x', value_size);
+    cache.addNewEntry(node);
+  }
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> dist(0, CAPACITY - 1);
+  std::vector<std::vector<std::string>> batches(64);
+  std::vector<std::string> commands(batches.size());
+  for (size_t b = 0; b < batches.size(); b++) {
+    commands[b] = "get";
+    for (int k = 0; k < KEYS_PER_GET; k++) {
+      std::string key = "key:" + std::to_string(dist(rng));
+      batches[b].push_back(key);
+      commands[b].append(" ").append(key);
+    }
+    commands[b].append("\r\n");
+  }
+
+  size_t hits = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    for (auto& key : batches[i % batches.size()]) {
+      CacheNode *node = cache.getEntry(key);
+      if (node != nullptr) {
+        hits++;
+        delete node;
+      }
+    }
+  }
+  auto per_key = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  std::vector<ItemHandle> items;
+  for (int i = 0; i < iterations; i++) {
+    cache.getEntries(batches[i % batches.size()], &items);
+    hits += items.size();
+  }
+  auto batched = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    hits += ParseGetCmd(commands[i % commands.size()], &cache).length();
+  }
+  auto command = std::chrono::steady_clock::now() - start;
+
+  auto ns_per_get = [iterations](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / (double) iterations;
+  };
+  printf("%d key get, %zu byte values, %d iterations (%zu)\n",
+         KEYS_PER_GET, value_size, iterations, hits);
+  printf("getEntry per key:   %10.0f ns/get\n", ns_per_get(per_key));
+  printf("getEntries batched: %10.0f ns/get\n", ns_per_get(batched));
+  printf("get command:        %10.0f ns/get\n", ns_per_get(command));
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "Threadpool.h"
+
+/*
+ * Compares the threadpool with work stealing and with every task going
+ * through the shared queue, at high task rates. In the first test one
+ * thread outside the pool submits small tasks as fast as it can, as the
+ * network thread does; in the second the tasks run on the pool submit
+ * two more each, down a tree. The benchmark reports the tasks per second
+ * and the p50 and p99 latencies from the submit to the start of a task.
+ * With the shared queue a tree of more tasks than the queue holds stops:
+ * every worker waits for room to submit its children
+ * Usage: bench_pool [threads] [tree depth]
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+struct Stats {
+  std::vector<float> latencies; // in us
+  std::atomic<int> count;
+
+  explicit Stats(int tasks) : latencies(tasks), count(0) {
+  }
+
+  void record(Clock::time_point submitted) {
+    int i = count++;
+    latencies[i] = std::chrono::duration<float, std::micro>(Clock::now() - submitted).count();
+  }
+
+  void wait(int tasks) {
+    while (count.load(std::memory_order_acquire) < tasks) {
+      std::this_thread::yield();
+    }
+  }
+};
+
+static void Spawn(ThreadPool * pool, Stats * stats, int depth, Clock::time_point submitted) {
+  stats->record(submitted);
+  // a little work, like parsing a command
+  volatile int sum = 0;
+  for (int i = 0; i < 100; i++) {
+    sum = sum + i;
+  }
+  if (depth > 0) {
+    pool->submit(Spawn, pool, stats, depth - 1, Clock::now());
+    pool->submit(Spawn, pool, stats, depth - 1, Clock::now());
+  }
+}
+
+static void Report(const char *name, bool work_stealing, Stats& stats, double elapsed) {
+  std::sort(stats.latencies.begin(), stats.latencies.end());
+  size_t n = stats.latencies.size();
+  printf("%-10s %-14s %10.0f tasks/s  p50 %8.1f us  p99 %8.1f us\n", name,
+         work_stealing ? "work stealing" : "shared queue", n / elapsed, stats.latencies[n / 2],
+         stats.latencies[n * 99 / 100]);
+}
+
+static void RunExternal(bool work_stealing, int threads, int tasks) {
+  ThreadPool pool(threads, work_stealing);
+  pool.init();
+  Stats stats(tasks);
+  auto start = Clock::now();
+  for (int i = 0; i < tasks; i++) {
+    pool.submit([&stats](Clock::time_point submitted) { stats.record(submitted); }, Clock::now());
+  }
+  stats.wait(tasks);
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  pool.shutdown();
+  Report("external", work_stealing, stats, elapsed);
+}
+
+static void RunSpawn(bool work_stealing, int threads, int depth) {
+  int tasks = (2 << depth) - 1;
+  ThreadPool pool(threads, work_stealing);
+  pool.init();
+  Stats stats(tasks);
+  auto start = Clock::now();
+  pool.submit(Spawn, &pool, &stats, depth, Clock::now());
+  stats.wait(tasks);
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  pool.shutdown();
+  Report("spawned", work_stealing, stats, elapsed);
+}
+
+int main(int argc, char *argv[]) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  int depth = argc > 2 ? atoi(argv[2]) : 15;
+  int tasks = (2 << depth) - 1;
+
+  printf("%u cores, %d threads, %d tasks per test\n", std::thread::hardware_concurrency(), threads,
+         tasks);
+  RunExternal(false, threads, tasks);
+  RunExternal(true, threads, tasks);
+  RunSpawn(false, threads, depth);
+  RunSpawn(true, threads, depth);
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "MpmcQueue.h"
+#include "SafeQueue.h"
+
+/*
+ * Compares the lock-free queue of the threadpool with the mutex based
+ * SafeQueue it replaced: the same number of producers and consumers pass
+ * tasks, std::function objects as the threadpool does, through one queue,
+ * and the benchmark reports the operations (an enqueue and a dequeue)
+ * per second
+ * Usage: bench_queue [operations per producer]
+ */
+
+#define QUEUE_SIZE 65536
+
+template <typename Queue, typename Enqueue>
+static double Run(Queue& queue, Enqueue enqueue, int threads, int operations) {
+  std::atomic<int> consumed(0);
+  int total = threads * operations;
+  std::vector<std::thread> workers;
+  auto start = std::chrono::steady_clock::now();
+  for (int p = 0; p < threads; p++) {
+    workers.push_back(std::thread([&]() {
+      for (int i = 0; i < operations; i++) {
+        std::function<void()> task = []() {};
+        enqueue(queue, task);
+      }
+    }));
+  }
+  for (int c = 0; c < threads; c++) {
+    workers.push_back(std::thread([&]() {
+      std::function<void()> task;
+      while (consumed.load(std::memory_order_relaxed) < total) {
+        if (queue.dequeue(task)) {
+          task();
+          consumed++;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    }));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return total / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  int operations = argc > 1 ? atoi(argv[1]) : 200000;
+
+  printf("%u cores, %d operations per producer\n", std::thread::hardware_concurrency(), operations);
+  printf("%-20s %14s %14s\n", "producers/consumers", "SafeQueue", "MpmcQueue");
+  for (int threads = 1; threads <= 16; threads *= 2) {
+    SafeQueue<std::function<void()>> safe;
+    double safe_ops = Run(safe, [](SafeQueue<std::function<void()>>& q, std::function<void()>& t) {
+      q.enqueue(t);
+    }, threads, operations);
+    MpmcQueue<std::function<void()>> mpmc(QUEUE_SIZE);
+    double mpmc_ops = Run(mpmc, [](MpmcQueue<std::function<void()>>& q, std::function<void()>& t) {
+      while (!q.enqueue(t)) {
+        std::this_thread::yield();
+      }
+    }, threads, operations);
+    printf("%-20d %10.0f op/s %10.0f op/s\n", threads, safe_ops, mpmc_ops);
+  }
+  return 0;
+}
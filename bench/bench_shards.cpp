@@ -0,0 +1,186 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memserver.h"
+#include "shard.h"
+
+/*
+ * Compares the default mode, reactors that hand the commands to a shared
+ * threadpool and a shared cache, with the thread-per-core mode, shards
+ * that own their connections and a partition of the cache, at 1 to 16
+ * threads. Clients on several connections send 'get' requests for random
+ * keys for a few seconds, so with more than one shard most requests are
+ * forwarded to another shard. The benchmark reports the requests per second
+ * Usage: bench_shards [connections] [seconds]
+ */
+
+#define BENCH_PORT 11331
+#define KEYS 1000
+#define VALUE_SIZE 100
+
+static std::string Key(int i) {
+  char key[16];
+  snprintf(key, sizeof key, "key%05d", i);
+  return key;
+}
+
+/* Starts the server in a child process
+ * @param sharded: true for the thread-per-core mode
+ * @param threads: the number of reactors or shards
+ */
+static pid_t StartServer(int port, bool sharded, int threads) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  freopen("/dev/null", "w", stdout);
+  std::vector<std::thread> loops;
+  if (sharded) {
+    std::vector<Shard *> shards;
+    for (int i = 0; i < threads; i++) {
+      shards.push_back(new Shard(i, threads, std::to_string(port), CAPACITY / threads));
+      if (shards.back()->init() < 0) {
+        _exit(1);
+      }
+    }
+    for (Shard *shard : shards) {
+      shard->connect(shards);
+    }
+    for (Shard *shard : shards) {
+      loops.push_back(std::thread(&Shard::run, shard));
+    }
+  } else {
+    ThreadPool *pool = new ThreadPool(threads);
+    pool->init();
+    Cache *cache = new Cache();
+    for (int i = 0; i < threads; i++) {
+      CacheServer *server = new CacheServer(std::to_string(port), pool, cache, LoopEpoll);
+      server->SetReusePort(threads > 1);
+      if (server->init() < 0) {
+        _exit(1);
+      }
+      loops.push_back(std::thread(&CacheServer::WaitForClientRequests, server));
+    }
+  }
+  for (auto& loop : loops) {
+    loop.join();
+  }
+  _exit(0);
+}
+
+static int Connect(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+      perror("socket");
+      exit(1);
+    }
+    if (connect(sd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+      int yes = 1;
+      setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+      return sd;
+    }
+    close(sd);
+    usleep(10000);
+  }
+  perror("connect");
+  exit(1);
+}
+
+static bool Request(int sd, const std::string& request, size_t reply_length) {
+  if (write(sd, request.data(), request.length()) != (ssize_t) request.length()) {
+    return false;
+  }
+  char reply[1024];
+  size_t received = 0;
+  while (received < reply_length) {
+    ssize_t n = read(sd, reply, sizeof reply);
+    if (n <= 0) {
+      return false;
+    }
+    received += n;
+  }
+  return true;
+}
+
+static double Run(bool sharded, int threads, int connections, int seconds, int port) {
+  pid_t pid = StartServer(port, sharded, threads);
+
+  int sd = Connect(port);
+  std::string value(VALUE_SIZE, 'x');
+  for (int i = 0; i < KEYS; i++) {
+    std::string set = "set " + Key(i) + " 0 0 " + std::to_string(VALUE_SIZE) + "\r\n" + value + "\r\n";
+    if (!Request(sd, set, strlen("STORED\r\n"))) {
+      perror("set");
+      exit(1);
+    }
+  }
+  close(sd);
+
+  size_t reply_length = strlen("VALUE ") + Key(0).length() + strlen(" 0 100\r\n") + VALUE_SIZE + 2;
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> requests(0);
+  std::vector<std::thread> clients;
+  std::vector<int> sds;
+  for (int i = 0; i < connections; i++) {
+    sds.push_back(Connect(port));
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < connections; i++) {
+    clients.push_back(std::thread([&, i]() {
+      std::mt19937 random(i);
+      uint64_t count = 0;
+      while (!stop && Request(sds[i], "get " + Key(random() % KEYS) + "\r\n", reply_length)) {
+        count++;
+      }
+      requests += count;
+    }));
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  stop = true;
+  for (auto& client : clients) {
+    client.join();
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  for (int s : sds) {
+    close(s);
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  return requests / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  int connections = argc > 1 ? atoi(argv[1]) : 32;
+  int seconds = argc > 2 ? atoi(argv[2]) : 3;
+
+  printf("'get' of random keys on %d connections for %d s, %u cores\n",
+         connections, seconds, std::thread::hardware_concurrency());
+  printf("%-8s %14s %14s\n", "threads", "default", "per-core");
+  int port = BENCH_PORT;
+  for (int threads = 1; threads <= 16; threads *= 2) {
+    double shared = Run(false, threads, connections, seconds, port++);
+    double sharded = Run(true, threads, connections, seconds, port++);
+    printf("%-8d %10.0f r/s %10.0f r/s\n", threads, shared, sharded);
+  }
+  return 0;
+}
@@ -0,0 +1,228 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memserver.h"
+#include "udpserver.h"
+
+/*
+ * Compares 'get' requests over TCP and over UDP. Clients send gets of a
+ * 100 byte value for a few seconds: once on open connections, and once
+ * the way a high fan-out reader does, with a new TCP connection for every
+ * request against a new UDP socket. The benchmark also reports the memory
+ * the server holds for idle TCP connections, which UDP clients do not cost
+ * Usage: bench_udp [clients] [seconds] [idle connections]
+ */
+
+#define BENCH_PORT 11351
+#define VALUE_SIZE 100
+
+static pid_t StartServer(int port) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  freopen("/dev/null", "w", stdout);
+  ThreadPool *pool = new ThreadPool(4);
+  pool->init();
+  Cache *cache = new Cache();
+  CacheServer *server = new CacheServer(std::to_string(port), pool, cache, LoopEpoll);
+  UdpServer *udpserver = new UdpServer(std::to_string(port), cache);
+  if (server->init() < 0 || udpserver->init() < 0) {
+    _exit(1);
+  }
+  std::thread udp(&UdpServer::run, udpserver);
+  server->WaitForClientRequests();
+  _exit(0);
+}
+
+static long ResidentKb(pid_t pid) {
+  std::string path = "/proc/" + std::to_string(pid) + "/status";
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == nullptr) {
+    return -1;
+  }
+  char line[256];
+  long kb = -1;
+  while (fgets(line, sizeof line, f) != nullptr) {
+    if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(f);
+  return kb;
+}
+
+static struct sockaddr_in Address(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return addr;
+}
+
+static int Connect(int port) {
+  struct sockaddr_in addr = Address(port);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+      perror("socket");
+      exit(1);
+    }
+    if (connect(sd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+      int yes = 1;
+      setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+      return sd;
+    }
+    close(sd);
+    usleep(10000);
+  }
+  perror("connect");
+  exit(1);
+}
+
+static bool TcpGet(int sd, size_t reply_length) {
+  const char request[] = "get bench\r\n";
+  if (write(sd, request, sizeof request - 1) != sizeof request - 1) {
+    return false;
+  }
+  char reply[1024];
+  size_t received = 0;
+  while (received < reply_length) {
+    ssize_t n = read(sd, reply, sizeof reply);
+    if (n <= 0) {
+      return false;
+    }
+    received += n;
+  }
+  return true;
+}
+
+static bool UdpGet(int sd, uint16_t request_id, size_t reply_length) {
+  char request[UDP_HEADER_SIZE + 16] = {0};
+  uint16_t fields[3] = {htons(request_id), 0, htons(1)};
+  memcpy(request, fields, sizeof fields);
+  memcpy(request + UDP_HEADER_SIZE, "get bench\r\n", 11);
+  if (send(sd, request, UDP_HEADER_SIZE + 11, 0) < 0) {
+    return false;
+  }
+  char reply[UDP_MAX_DATAGRAM];
+  ssize_t n = recv(sd, reply, sizeof reply, 0);
+  return n == (ssize_t) (UDP_HEADER_SIZE + reply_length);
+}
+
+static int UdpSocket(int port) {
+  int sd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = Address(port);
+  // a lost datagram is retried after the timeout
+  struct timeval timeout = {0, 100000};
+  setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  if (sd < 0 || connect(sd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+    perror("udp socket");
+    exit(1);
+  }
+  return sd;
+}
+
+enum Mode { TcpOpen, TcpPerRequest, UdpOpen, UdpPerRequest };
+
+static void Run(const char *name, Mode mode, int port, int clients, int seconds, size_t reply_length) {
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> requests(0);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < clients; i++) {
+    threads.push_back(std::thread([&, i]() {
+      uint64_t count = 0;
+      uint16_t request_id = 0;
+      int sd = -1;
+      if (mode == TcpOpen) {
+        sd = Connect(port);
+      } else if (mode == UdpOpen) {
+        sd = UdpSocket(port);
+      }
+      while (!stop) {
+        bool ok;
+        if (mode == TcpOpen) {
+          ok = TcpGet(sd, reply_length);
+        } else if (mode == UdpOpen) {
+          ok = UdpGet(sd, request_id++, reply_length);
+        } else if (mode == TcpPerRequest) {
+          sd = Connect(port);
+          ok = TcpGet(sd, reply_length);
+          close(sd);
+        } else {
+          sd = UdpSocket(port);
+          ok = UdpGet(sd, request_id++, reply_length);
+          close(sd);
+        }
+        count += ok;
+      }
+      if (mode == TcpOpen || mode == UdpOpen) {
+        close(sd);
+      }
+      requests += count;
+    }));
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  stop = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%-22s %8.0f requests/s\n", name, requests / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+  int clients = argc > 1 ? atoi(argv[1]) : 16;
+  int seconds = argc > 2 ? atoi(argv[2]) : 3;
+  int idle = argc > 3 ? atoi(argv[3]) : 5000;
+
+  pid_t pid = StartServer(BENCH_PORT);
+  std::string set = "set bench 0 0 " + std::to_string(VALUE_SIZE) + "\r\n";
+  set.append(VALUE_SIZE, 'x').append("\r\n");
+  int sd = Connect(BENCH_PORT);
+  char reply[16];
+  if (write(sd, set.data(), set.length()) != (ssize_t) set.length() || read(sd, reply, 8) != 8) {
+    perror("set");
+    exit(1);
+  }
+  close(sd);
+  size_t reply_length = strlen("VALUE bench 0 100\r\n") + VALUE_SIZE + 2;
+
+  printf("'get' of a %d byte value from %d clients for %d s\n", VALUE_SIZE, clients, seconds);
+  Run("tcp, open connection", TcpOpen, BENCH_PORT, clients, seconds, reply_length);
+  Run("udp, open socket", UdpOpen, BENCH_PORT, clients, seconds, reply_length);
+  Run("tcp, per request", TcpPerRequest, BENCH_PORT, clients, seconds, reply_length);
+  Run("udp, per request", UdpPerRequest, BENCH_PORT, clients, seconds, reply_length);
+
+  long before = ResidentKb(pid);
+  std::vector<int> sds;
+  for (int i = 0; i < idle; i++) {
+    sds.push_back(Connect(BENCH_PORT));
+  }
+  // lets the server accept them all
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  long after = ResidentKb(pid);
+  printf("server memory for %d idle tcp connections: %ld kB (%.1f kB each)\n", idle,
+         after - before, (double) (after - before) / idle);
+
+  for (int s : sds) {
+    close(s);
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  return 0;
+}
@@ -0,0 +1,167 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memserver.h"
+
+/*
+ * Compares the clients on the same host connected over loopback TCP and
+ * over the unix domain socket. Clients on several connections send 'get'
+ * requests for a 100 byte value, and the benchmark reports the requests
+ * per second and the p50 and p99 latencies
+ * Usage: bench_unix [connections] [requests per connection]
+ */
+
+#define BENCH_PORT 11361
+#define BENCH_SOCKET "/tmp/bench_unix.sock"
+#define VALUE_SIZE 100
+
+static pid_t StartServer(int port) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  freopen("/dev/null", "w", stdout);
+  ThreadPool *pool = new ThreadPool(4);
+  pool->init();
+  Cache *cache = new Cache();
+  CacheServer *server = new CacheServer(std::to_string(port), pool, cache, LoopEpoll);
+  server->SetUnixSocket(BENCH_SOCKET, 0700);
+  if (server->init() < 0) {
+    _exit(1);
+  }
+  server->WaitForClientRequests();
+  _exit(0);
+}
+
+static int Connect(bool unix_socket, int port) {
+  struct sockaddr_in in;
+  struct sockaddr_un un;
+  struct sockaddr *addr;
+  socklen_t addrlen;
+  if (unix_socket) {
+    memset(&un, 0, sizeof un);
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, BENCH_SOCKET);
+    addr = (struct sockaddr *) &un;
+    addrlen = sizeof un;
+  } else {
+    memset(&in, 0, sizeof in);
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr = (struct sockaddr *) &in;
+    addrlen = sizeof in;
+  }
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int sd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (sd < 0) {
+      perror("socket");
+      exit(1);
+    }
+    if (connect(sd, addr, addrlen) == 0) {
+      if (!unix_socket) {
+        int yes = 1;
+        setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+      }
+      return sd;
+    }
+    close(sd);
+    usleep(10000);
+  }
+  perror("connect");
+  exit(1);
+}
+
+static bool Request(int sd, const std::string& request, size_t reply_length) {
+  if (write(sd, request.data(), request.length()) != (ssize_t) request.length()) {
+    return false;
+  }
+  char reply[1024];
+  size_t received = 0;
+  while (received < reply_length) {
+    ssize_t n = read(sd, reply, sizeof reply);
+    if (n <= 0) {
+      return false;
+    }
+    received += n;
+  }
+  return true;
+}
+
+static void Run(const char *name, bool unix_socket, int connections, int requests, int port) {
+  std::string get = "get bench\r\n";
+  size_t reply_length = strlen("VALUE bench 0 100\r\n") + VALUE_SIZE + 2;
+  std::vector<int> sds;
+  for (int i = 0; i < connections; i++) {
+    sds.push_back(Connect(unix_socket, port));
+  }
+  std::vector<std::vector<double>> latencies(connections);
+  std::vector<std::thread> clients;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < connections; i++) {
+    clients.push_back(std::thread([&, i]() {
+      for (int r = 0; r < requests; r++) {
+        auto begin = std::chrono::steady_clock::now();
+        if (!Request(sds[i], get, reply_length)) {
+          perror("request");
+          exit(1);
+        }
+        auto end = std::chrono::steady_clock::now();
+        latencies[i].push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+      }
+    }));
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> all;
+  for (auto& l : latencies) {
+    all.insert(all.end(), l.begin(), l.end());
+  }
+  std::sort(all.begin(), all.end());
+  printf("%-6s %3d connections %8.0f requests/s  p50 %6.1f us  p99 %6.1f us\n", name, connections,
+         all.size() / elapsed, all[all.size() / 2], all[all.size() * 99 / 100]);
+  for (int s : sds) {
+    close(s);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int connections = argc > 1 ? atoi(argv[1]) : 16;
+  int requests = argc > 2 ? atoi(argv[2]) : 10000;
+
+  pid_t pid = StartServer(BENCH_PORT);
+  std::string set = "set bench 0 0 " + std::to_string(VALUE_SIZE) + "\r\n";
+  set.append(VALUE_SIZE, 'x').append("\r\n");
+  int sd = Connect(false, BENCH_PORT);
+  if (!Request(sd, set, strlen("STORED\r\n"))) {
+    perror("set");
+    exit(1);
+  }
+  close(sd);
+
+  printf("'get' of a %d byte value, %d requests per connection\n", VALUE_SIZE, requests);
+  Run("tcp", false, 1, requests, BENCH_PORT);
+  Run("unix", true, 1, requests, BENCH_PORT);
+  Run("tcp", false, connections, requests, BENCH_PORT);
+  Run("unix", true, connections, requests, BENCH_PORT);
+
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  unlink(BENCH_SOCKET);
+  return 0;
+}
@@ -0,0 +1,220 @@
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memserver.h"
+
+/*
+ * Compares the epoll and the io_uring event loops: clients on several
+ * connections send 'get' requests for a 100 byte value for a few
+ * seconds, and the benchmark reports the requests per second and the
+ * system calls made by the server per request. The system calls are
+ * counted with the raw_syscalls:sys_enter tracepoint, which needs tracefs
+ * to be mounted and permission to use perf events; without them only the
+ * throughput is reported
+ * Usage: bench_uring [connections] [seconds]
+ */
+
+#define BENCH_PORT 11321
+#define VALUE_SIZE 100
+
+static int TracepointId() {
+  const char *paths[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+  };
+  for (const char *path : paths) {
+    FILE *f = fopen(path, "r");
+    if (f != nullptr) {
+      int id = -1;
+      if (fscanf(f, "%d", &id) != 1) {
+        id = -1;
+      }
+      fclose(f);
+      return id;
+    }
+  }
+  return -1;
+}
+
+/* Opens a counter of the system calls of a process and of the threads it
+ * creates afterwards
+ */
+static int CountSyscalls(pid_t pid) {
+  int id = TracepointId();
+  if (id < 0) {
+    return -1;
+  }
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof attr);
+  attr.type = PERF_TYPE_TRACEPOINT;
+  attr.size = sizeof attr;
+  attr.config = id;
+  attr.inherit = 1;
+  attr.disabled = 1;
+  return (int) syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+/* Starts the server in a child process, which waits until the parent has
+ * attached the system call counter before it creates its threads
+ */
+static pid_t StartServer(int port, ServerLoop loop, int *counter) {
+  int ready[2];
+  if (pipe(ready) < 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    *counter = CountSyscalls(pid);
+    close(ready[0]);
+    close(ready[1]);
+    return pid;
+  }
+  close(ready[1]);
+  char c;
+  if (read(ready[0], &c, 1) < 0) {
+    _exit(1);
+  }
+  freopen("/dev/null", "w", stdout);
+  ThreadPool *pool = new ThreadPool(4);
+  pool->init();
+  Cache *cache = new Cache();
+  CacheServer *server = new CacheServer(std::to_string(port), pool, cache, loop);
+  if (server->init() < 0) {
+    _exit(1);
+  }
+  server->WaitForClientRequests();
+  _exit(0);
+}
+
+static int Connect(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+      perror("socket");
+      exit(1);
+    }
+    if (connect(sd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+      int yes = 1;
+      setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+      return sd;
+    }
+    close(sd);
+    usleep(10000);
+  }
+  perror("connect");
+  exit(1);
+}
+
+static bool Request(int sd, const std::string& request, size_t reply_length) {
+  if (write(sd, request.data(), request.length()) != (ssize_t) request.length()) {
+    return false;
+  }
+  char reply[1024];
+  size_t received = 0;
+  while (received < reply_length) {
+    ssize_t n = read(sd, reply, sizeof reply);
+    if (n <= 0) {
+      return false;
+    }
+    received += n;
+  }
+  return true;
+}
+
+static void Run(const char *name, ServerLoop loop, int connections, int seconds, int port) {
+  int counter;
+  pid_t pid = StartServer(port, loop, &counter);
+
+  std::string set = "set bench 0 0 " + std::to_string(VALUE_SIZE) + "\r\n";
+  set.append(VALUE_SIZE, 'x').append("\r\n");
+  int sd = Connect(port);
+  if (!Request(sd, set, strlen("STORED\r\n"))) {
+    perror("set");
+    exit(1);
+  }
+  close(sd);
+
+  std::string get = "get bench\r\n";
+  size_t reply_length = strlen("VALUE bench 0 100\r\n") + VALUE_SIZE + 2;
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> requests(0);
+  std::vector<std::thread> clients;
+  std::vector<int> sds;
+  for (int i = 0; i < connections; i++) {
+    sds.push_back(Connect(port));
+  }
+
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < connections; i++) {
+    clients.push_back(std::thread([&, i]() {
+      uint64_t count = 0;
+      while (!stop && Request(sds[i], get, reply_length)) {
+        count++;
+      }
+      requests += count;
+    }));
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  stop = true;
+  for (auto& client : clients) {
+    client.join();
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  uint64_t syscalls = 0;
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter, &syscalls, sizeof syscalls) != sizeof syscalls) {
+      syscalls = 0;
+    }
+    close(counter);
+  }
+
+  printf("%-9s %8.0f requests/s", name, requests / elapsed);
+  if (counter >= 0) {
+    printf("  %5.2f syscalls/request", (double) syscalls / requests);
+  }
+  printf("\n");
+
+  for (int s : sds) {
+    close(s);
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char *argv[]) {
+  int connections = argc > 1 ? atoi(argv[1]) : 16;
+  int seconds = argc > 2 ? atoi(argv[2]) : 3;
+
+  printf("'get' of a %d byte value on %d connections for %d s\n", VALUE_SIZE, connections, seconds);
+  if (TracepointId() < 0) {
+    printf("tracefs is not mounted, system calls are not counted\n");
+  }
+  Run("epoll", LoopEpoll, connections, seconds, BENCH_PORT);
+  Run("io_uring", LoopIoUring, connections, seconds, BENCH_PORT + 1);
+  return 0;
+}
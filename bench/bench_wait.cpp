@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "Threadpool.h"
+
+/*
+ * Measures the latency from the submit of a task to its start at fixed
+ * task rates, with the workers going to sleep as soon as they run out of
+ * tasks, with the workers spinning first, and with the tasks submitted in
+ * batches of 16 with submit_batch (the latency of a batched task counts
+ * from the submit of its batch). One thread outside the pool submits the
+ * tasks on schedule for a second per rate, and the benchmark reports the
+ * p50, p99 and p99.9 latencies. On a single core spinning only keeps
+ * the submitting thread from running, and is off by default
+ * Usage: bench_wait [threads] [seconds per rate]
+ */
+
+#define BATCH 16
+
+typedef std::chrono::steady_clock Clock;
+
+struct Stats {
+  std::vector<float> latencies; // in us
+  std::atomic<int> count;
+
+  explicit Stats(int tasks) : latencies(tasks), count(0) {
+  }
+
+  void record(Clock::time_point submitted) {
+    int i = count++;
+    latencies[i] = std::chrono::duration<float, std::micro>(Clock::now() - submitted).count();
+  }
+};
+
+static void Run(const char *name, int spin_rounds, bool batch, int threads, int rate,
+                double seconds) {
+  ThreadPool pool(threads);
+  pool.setSpinRounds(spin_rounds);
+  pool.init();
+  int tasks = (int) (rate * seconds) / BATCH * BATCH;
+  Stats stats(tasks);
+  auto interval = std::chrono::nanoseconds(1000000000LL / rate);
+  auto due = Clock::now();
+  std::vector<std::function<void()>> funcs;
+  for (int i = 0; i < tasks; i++) {
+    due += interval;
+    while (Clock::now() < due) {
+      std::this_thread::yield();
+    }
+    auto submitted = Clock::now();
+    if (!batch) {
+      pool.submit([&stats, submitted]() { stats.record(submitted); });
+    } else if (i % BATCH == BATCH - 1) {
+      // the tasks due since the last batch
+      for (int j = 0; j < BATCH; j++) {
+        funcs.push_back([&stats, submitted]() { stats.record(submitted); });
+      }
+      pool.submit_batch(funcs.begin(), funcs.end());
+      funcs.clear();
+    }
+  }
+  while (stats.count < tasks) {
+    std::this_thread::yield();
+  }
+  pool.shutdown();
+
+  std::sort(stats.latencies.begin(), stats.latencies.end());
+  printf("%-16s %7d tasks/s  p50 %7.1f us  p99 %8.1f us  p99.9 %8.1f us\n",
+         name, rate, stats.latencies[tasks / 2], stats.latencies[tasks * 99 / 100],
+         stats.latencies[tasks * 999 / 1000]);
+}
+
+int main(int argc, char *argv[]) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  double seconds = argc > 2 ? atof(argv[2]) : 1;
+
+  printf("%u cores, %d threads\n", std::thread::hardware_concurrency(), threads);
+  for (int rate : {10000, 50000, 100000, 200000, 500000}) {
+    Run("sleep", 0, false, threads, rate, seconds);
+    Run("sleep, batch", 0, true, threads, rate, seconds);
+    Run("spin, sleep", POOL_SPIN_ROUNDS, false, threads, rate, seconds);
+    Run("spin, batch", POOL_SPIN_ROUNDS, true, threads, rate, seconds);
+  }
+  return 0;
+}
@@ -0,0 +1,128 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "memserver.h"
+
+/*
+ * Measures the round trip of a request on one of 100 active connections
+ * while many idle connections are open, for the select and the epoll
+ * event loops. select scans every file descriptor on each wakeup, so its
+ * latency grows with the idle connections, and it cannot go beyond
+ * FD_SETSIZE connections at all. The server runs in a child process so
+ * that each process stays below the open file limit
+ * Usage: bench_wakeup [idle connections] [rounds]
+ */
+
+#define ACTIVE_CONNECTIONS 100
+#define SELECT_IDLE_CONNECTIONS 900 // stays below FD_SETSIZE
+#define BENCH_PORT 11311
+
+static pid_t StartServer(int port, ServerLoop loop) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  // the server prints every connection
+  freopen("/dev/null", "w", stdout);
+  ThreadPool *pool = new ThreadPool(4);
+  pool->init();
+  Cache *cache = new Cache();
+  CacheServer *server = new CacheServer(std::to_string(port), pool, cache, loop);
+  if (server->init() < 0) {
+    _exit(1);
+  }
+  server->WaitForClientRequests();
+  _exit(0);
+}
+
+static int Connect(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+      perror("socket");
+      exit(1);
+    }
+    if (connect(sd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+      int yes = 1;
+      setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+      return sd;
+    }
+    close(sd);
+    usleep(10000);
+  }
+  perror("connect");
+  exit(1);
+}
+
+static void Run(const char *name, ServerLoop loop, int idle, int rounds, int port) {
+  pid_t pid = StartServer(port, loop);
+  std::vector<int> idle_sds, active_sds;
+  for (int i = 0; i < idle; i++) {
+    idle_sds.push_back(Connect(port));
+  }
+  for (int i = 0; i < ACTIVE_CONNECTIONS; i++) {
+    active_sds.push_back(Connect(port));
+  }
+
+  const char request[] = "mn\r\n";
+  char reply[16];
+  std::vector<double> latencies;
+  for (int round = 0; round < rounds + 1; round++) {
+    for (int sd : active_sds) {
+      auto start = std::chrono::steady_clock::now();
+      if (write(sd, request, 4) != 4 || read(sd, reply, sizeof reply) != 4) {
+        perror("request");
+        exit(1);
+      }
+      auto end = std::chrono::steady_clock::now();
+      // the first round warms up the connections
+      if (round > 0) {
+        latencies.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+      }
+    }
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  double sum = 0;
+  for (double l : latencies) {
+    sum += l;
+  }
+  printf("%-7s %6d idle: mean %7.1f us  p50 %7.1f us  p99 %7.1f us\n", name, idle,
+         sum / latencies.size(), latencies[latencies.size() / 2],
+         latencies[latencies.size() * 99 / 100]);
+
+  for (int sd : active_sds) {
+    close(sd);
+  }
+  for (int sd : idle_sds) {
+    close(sd);
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char *argv[]) {
+  int idle = argc > 1 ? atoi(argv[1]) : 10000;
+  int rounds = argc > 2 ? atoi(argv[2]) : 100;
+
+  printf("round trip of 'mn' on %d active connections, %d rounds\n", ACTIVE_CONNECTIONS, rounds);
+  Run("select", LoopSelect, SELECT_IDLE_CONNECTIONS, rounds, BENCH_PORT);
+  Run("epoll", LoopEpoll, SELECT_IDLE_CONNECTIONS, rounds, BENCH_PORT + 1);
+  Run("epoll", LoopEpoll, idle, rounds, BENCH_PORT + 2);
+  return 0;
+}
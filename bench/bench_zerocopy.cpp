@@ -0,0 +1,169 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memserver.h"
+
+/*
+ * Measures the CPU time the server spends per GB of large values served,
+ * with the replies copied into the socket and with MSG_ZEROCOPY. Clients
+ * on several connections send 'get' requests for a value for a few
+ * seconds. The server CPU time is read from /proc. Over loopback the
+ * kernel copies the data of MSG_ZEROCOPY sends anyway, and the server
+ * goes back to copying after the first completion says so; the saving
+ * only shows with a real network interface, with the server and the
+ * clients on different hosts
+ * Usage: bench_zerocopy [connections] [seconds] [value size]
+ */
+
+#define BENCH_PORT 11371
+
+static pid_t StartServer(int port, size_t zerocopy_threshold) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  freopen("/dev/null", "w", stdout);
+  ThreadPool *pool = new ThreadPool(4);
+  pool->init();
+  Cache *cache = new Cache();
+  CacheServer *server = new CacheServer(std::to_string(port), pool, cache, LoopEpoll);
+  server->SetZeroCopyThreshold(zerocopy_threshold);
+  if (server->init() < 0) {
+    _exit(1);
+  }
+  server->WaitForClientRequests();
+  _exit(0);
+}
+
+// user and system CPU time of a process, in seconds
+static double CpuSeconds(pid_t pid) {
+  std::string path = "/proc/" + std::to_string(pid) + "/stat";
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == nullptr) {
+    return 0;
+  }
+  unsigned long utime = 0, stime = 0;
+  if (fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+             &utime, &stime) != 2) {
+    utime = stime = 0;
+  }
+  fclose(f);
+  return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int Connect(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0) {
+      perror("socket");
+      exit(1);
+    }
+    if (connect(sd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+      int yes = 1;
+      setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+      return sd;
+    }
+    close(sd);
+    usleep(10000);
+  }
+  perror("connect");
+  exit(1);
+}
+
+static bool Request(int sd, const std::string& request, size_t reply_length) {
+  size_t written = 0;
+  while (written < request.length()) {
+    ssize_t n = write(sd, request.data() + written, request.length() - written);
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  static thread_local char reply[256 * 1024];
+  size_t received = 0;
+  while (received < reply_length) {
+    ssize_t n = read(sd, reply, sizeof reply);
+    if (n <= 0) {
+      return false;
+    }
+    received += n;
+  }
+  return true;
+}
+
+static void Run(const char *name, size_t zerocopy_threshold, int connections, int seconds,
+                int value_size, int port) {
+  pid_t pid = StartServer(port, zerocopy_threshold);
+  std::string set = "set bench 0 0 " + std::to_string(value_size) + "\r\n";
+  set.append(value_size, 'x').append("\r\n");
+  int sd = Connect(port);
+  if (!Request(sd, set, strlen("STORED\r\n"))) {
+    perror("set");
+    exit(1);
+  }
+  close(sd);
+
+  std::string get = "get bench\r\n";
+  size_t reply_length = strlen("VALUE bench 0 \r\n") + std::to_string(value_size).length() +
+                        value_size + 2;
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> requests(0);
+  std::vector<int> sds;
+  for (int i = 0; i < connections; i++) {
+    sds.push_back(Connect(port));
+  }
+  double cpu_start = CpuSeconds(pid);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> clients;
+  for (int i = 0; i < connections; i++) {
+    clients.push_back(std::thread([&, i]() {
+      uint64_t count = 0;
+      while (!stop && Request(sds[i], get, reply_length)) {
+        count++;
+      }
+      requests += count;
+    }));
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  stop = true;
+  for (auto& client : clients) {
+    client.join();
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double cpu = CpuSeconds(pid) - cpu_start;
+  double gb = (double) requests * reply_length / 1e9;
+  printf("%-10s %6.2f GB/s  server cpu %5.2f s per GB\n", name, gb / elapsed, cpu / gb);
+
+  for (int s : sds) {
+    close(s);
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char *argv[]) {
+  int connections = argc > 1 ? atoi(argv[1]) : 4;
+  int seconds = argc > 2 ? atoi(argv[2]) : 3;
+  int value_size = argc > 3 ? atoi(argv[3]) : MAX_DATA_LEN;
+
+  printf("'get' of a %d byte value on %d connections for %d s\n", value_size, connections, seconds);
+  Run("copy", 0, connections, seconds, value_size, BENCH_PORT);
+  Run("zerocopy", ZEROCOPY_THRESHOLD, connections, seconds, value_size, BENCH_PORT + 1);
+  return 0;
+}
@@ -0,0 +1,129 @@
+/************bulk_load.cpp************************/
+/* Bulk loads keys into the server with pipelined 'set' commands and  */
+/* reports the throughput, with and without noreply. With noreply the */
+/* server sends nothing back, so the client only waits for the reply  */
+/* of the 'mn' command that ends the load.                            */
+/* Usage: bulk_load [keys] [noreply|reply] [server]                   */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+/* Default host name of server system. */
+#define SERVER "127.0.0.1"
+
+/* Server's port number */
+#define SERVPORT 11211
+
+/* Number of commands written with one write() */
+#define BATCH 100
+
+/* Size of the values */
+#define VALUE_SIZE 32
+
+/* Reads replies until the expected number of bytes was received, or
+ * until the reply ends with the given suffix when expected is 0 */
+static bool read_replies(int sd, size_t expected, const char *suffix) {
+  char buffer[64 * 1024];
+  size_t total = 0;
+  std::string tail;
+  for (;;) {
+    ssize_t n = read(sd, buffer, sizeof(buffer));
+    if (n <= 0) {
+      perror("Client-read() error");
+      return false;
+    }
+    total += n;
+    if (expected > 0 && total >= expected) {
+      return true;
+    }
+    if (expected == 0) {
+      tail.append(buffer, n);
+      if (tail.length() > 64) {
+        tail.erase(0, tail.length() - 64);
+      }
+      size_t len = strlen(suffix);
+      if (tail.length() >= len && tail.compare(tail.length() - len, len, suffix) == 0) {
+        return true;
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  long keys = argc > 1 ? atol(argv[1]) : 1000000;
+  bool noreply = argc > 2 ? strcmp(argv[2], "reply") != 0 : true;
+  const char *server = argc > 3 ? argv[3] : SERVER;
+
+  int sd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sd < 0) {
+    perror("Client-socket() error");
+    exit(-1);
+  }
+  struct sockaddr_in serveraddr;
+  memset(&serveraddr, 0x00, sizeof(struct sockaddr_in));
+  serveraddr.sin_family = AF_INET;
+  serveraddr.sin_port = htons(SERVPORT);
+  serveraddr.sin_addr.s_addr = inet_addr(server);
+  if (connect(sd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
+    perror("Client-connect() error");
+    close(sd);
+    exit(-1);
+  }
+
+  std::string value(VALUE_SIZE, 'x');
+  const char *suffix = noreply ? " noreply\r\n" : "\r\n";
+  auto start = std::chrono::steady_clock::now();
+
+  // without noreply the replies are read while the sets are written, so
+  // that neither side blocks on a full socket buffer
+  std::thread reader;
+  bool reader_ok = true;
+  if (!noreply) {
+    reader = std::thread([&]() {
+      reader_ok = read_replies(sd, keys * strlen("STORED\r\n"), nullptr);
+    });
+  }
+
+  std::string batch;
+  for (long i = 0; i < keys; i++) {
+    batch.append("set key:").append(std::to_string(i)).append(" 0 0 ");
+    batch.append(std::to_string(VALUE_SIZE)).append(suffix);
+    batch.append(value).append("\r\n");
+    if ((i + 1) % BATCH == 0 || i + 1 == keys) {
+      if (write(sd, batch.data(), batch.length()) != (ssize_t) batch.length()) {
+        perror("Client-write() error");
+        close(sd);
+        exit(-1);
+      }
+      batch.clear();
+    }
+  }
+
+  if (noreply) {
+    const char noop[] = "mn\r\n";
+    if (write(sd, noop, strlen(noop)) < 0 || !read_replies(sd, 0, "MN\r\n")) {
+      close(sd);
+      exit(-1);
+    }
+  } else {
+    reader.join();
+    if (!reader_ok) {
+      close(sd);
+      exit(-1);
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%ld sets%s: %.2f s, %.0f sets/s\n", keys, noreply ? " with noreply" : "",
+         seconds, keys / seconds);
+  close(sd);
+  return 0;
+}
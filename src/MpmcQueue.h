@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+// Bounded lock-free queue for many producers and many consumers, after
+// Dmitry Vyukov's MPMC ring. Every cell carries a sequence number that
+// tells whether it is free for the producer of a given position or full
+// for its consumer, so producers and consumers only compete on the
+// position counters, each on its own cache line, and claim a cell with
+// one compare-and-swap
+template <typename T>
+class MpmcQueue {
+private:
+  static const size_t CACHE_LINE = 64;
+
+  struct alignas(CACHE_LINE) Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  // padded rather than aligned, so that the queue can be a member of a
+  // class created with new
+  char m_pad0[CACHE_LINE];
+  Cell * m_cells;
+  size_t m_mask;
+  char m_pad1[CACHE_LINE];
+  std::atomic<size_t> m_enqueue_pos;
+  char m_pad2[CACHE_LINE];
+  std::atomic<size_t> m_dequeue_pos;
+  char m_pad3[CACHE_LINE];
+
+public:
+  // size must be a power of 2
+  explicit MpmcQueue(size_t size) : m_mask(size - 1), m_enqueue_pos(0), m_dequeue_pos(0) {
+    // C++14 new does not honor the alignment of the cells
+    void * memory = nullptr;
+    if (posix_memalign(&memory, CACHE_LINE, sizeof(Cell) * size) != 0) {
+      throw std::bad_alloc();
+    }
+    m_cells = static_cast<Cell *>(memory);
+    for (size_t i = 0; i < size; i++) {
+      new (&m_cells[i]) Cell();
+      m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpmcQueue(const MpmcQueue &) = delete;
+  MpmcQueue & operator=(const MpmcQueue &) = delete;
+
+  ~MpmcQueue() {
+    for (size_t i = 0; i <= m_mask; i++) {
+      m_cells[i].~Cell();
+    }
+    free(m_cells);
+  }
+
+  // Returns false if the queue is full
+  bool enqueue(T& t) {
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell * cell = &m_cells[pos & m_mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+      if (diff == 0) {
+        if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell->data = std::move(t);
+          cell->sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        // the consumer of the previous lap did not free the cell yet
+        return false;
+      } else {
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Returns false if the queue is empty
+  bool dequeue(T& t) {
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell * cell = &m_cells[pos & m_mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+      if (diff == 0) {
+        if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          t = std::move(cell->data);
+          cell->data = T();
+          cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = m_dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Both are only a snapshot while other threads use the queue
+  bool empty() {
+    return size() == 0;
+  }
+
+  size_t size() {
+    size_t dequeue_pos = m_dequeue_pos.load(std::memory_order_acquire);
+    size_t enqueue_pos = m_enqueue_pos.load(std::memory_order_acquire);
+    return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+  }
+};
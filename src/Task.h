@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#define TASK_INLINE_SIZE 56 // bytes of captures a task holds, a task is one cache line
+
+// A move-only void() callable kept in storage inside the task itself, so
+// that creating, queueing and running a task allocates nothing. The type
+// of the callable is erased behind a table of three functions, one per
+// callable type; a callable whose captures do not fit does not compile,
+// rather than falling back to the heap as std::function does
+class Task {
+private:
+  struct Ops {
+    void (*invoke)(void * callable);
+    // move-constructs the callable at to, and destroys the one at from
+    void (*relocate)(void * from, void * to);
+    void (*destroy)(void * callable);
+  };
+
+  template <typename F>
+  struct OpsFor {
+    static void invoke(void * callable) {
+      (*static_cast<F *>(callable))();
+    }
+
+    static void relocate(void * from, void * to) {
+      new (to) F(std::move(*static_cast<F *>(from)));
+      static_cast<F *>(from)->~F();
+    }
+
+    static void destroy(void * callable) {
+      static_cast<F *>(callable)->~F();
+    }
+
+    static const Ops ops;
+  };
+
+  const Ops * m_ops;
+  typename std::aligned_storage<TASK_INLINE_SIZE, alignof(void *)>::type m_storage;
+
+public:
+  Task() : m_ops(nullptr) {
+  }
+
+  template <typename F, typename Callable = typename std::decay<F>::type,
+            typename = typename std::enable_if<!std::is_same<Callable, Task>::value>::type>
+  Task(F&& f) : m_ops(&OpsFor<Callable>::ops) {
+    static_assert(sizeof(Callable) <= TASK_INLINE_SIZE,
+                  "the captures of a task must fit in TASK_INLINE_SIZE bytes");
+    static_assert(alignof(Callable) <= alignof(void *),
+                  "the captures of a task cannot be over-aligned");
+    static_assert(std::is_nothrow_move_constructible<Callable>::value,
+                  "the captures of a task must be nothrow movable, the queues move it");
+    new (&m_storage) Callable(std::forward<F>(f));
+  }
+
+  Task(Task&& other) noexcept : m_ops(other.m_ops) {
+    if (m_ops != nullptr) {
+      m_ops->relocate(&other.m_storage, &m_storage);
+      other.m_ops = nullptr;
+    }
+  }
+
+  Task & operator=(Task&& other) noexcept {
+    if (this != &other) {
+      reset();
+      m_ops = other.m_ops;
+      if (m_ops != nullptr) {
+        m_ops->relocate(&other.m_storage, &m_storage);
+        other.m_ops = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  Task(const Task &) = delete;
+  Task & operator=(const Task &) = delete;
+
+  ~Task() {
+    reset();
+  }
+
+  // Destroys the callable and its captures
+  void reset() {
+    if (m_ops != nullptr) {
+      m_ops->destroy(&m_storage);
+      m_ops = nullptr;
+    }
+  }
+
+  explicit operator bool() const {
+    return m_ops != nullptr;
+  }
+
+  void operator()() {
+    m_ops->invoke(&m_storage);
+  }
+};
+
+template <typename F>
+const Task::Ops Task::OpsFor<F>::ops = {&Task::OpsFor<F>::invoke, &Task::OpsFor<F>::relocate,
+                                        &Task::OpsFor<F>::destroy};
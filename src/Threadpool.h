@@ -1,16 +1,37 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <future>
 #include <mutex>
-#include <queue>
 #include <thread>
 #include <utility>
 #include <vector>
 
-#include "SafeQueue.h"
+#include "MpmcQueue.h"
+#include "Task.h"
+#include "WorkStealingDeque.h"
+#include "threads.h"
+
+#define POOL_QUEUE_SIZE 65536 // tasks waiting for a worker, a power of 2
+#define POOL_DEQUE_SIZE 4096 // tasks a worker spawned for itself, a power of 2
+#define POOL_SPIN_ROUNDS 2000 // looks for a task an idle worker takes before it sleeps
+#define POOL_BULK_QUEUE_SIZE 4096 // bulk tasks waiting for a worker, a power of 2
 
 class ThreadPool {
+public:
+  // The lanes tasks are queued in by their cost. Any worker runs fast
+  // tasks, and the workers prefer them; only a share of the workers runs
+  // bulk tasks at a time, so that a burst of expensive work cannot hold
+  // every worker while cheap requests wait behind it
+  enum Lane {
+    LaneFast,
+    LaneBulk
+  };
+
 private:
   class ThreadWorker {
   private:
@@ -22,31 +43,296 @@ private:
     }
 
     void operator()() {
-      std::function<void()> func;
-      bool dequeued;
+      Current & current = ThreadPool::current();
+      current.pool = m_pool;
+      current.id = m_id;
+      Task task;
       while (!m_pool->m_shutdown) {
-        {
-          std::unique_lock<std::mutex> lock(m_pool->m_conditional_mutex);
-          if (m_pool->m_queue.empty()) {
-            m_pool->m_conditional_lock.wait(lock);
+        bool bulk = false;
+        if (m_pool->next(m_id, task, bulk) || m_pool->spin(m_id, task, bulk)) {
+          task();
+          task.reset();
+          if (bulk) {
+            m_pool->doneBulk();
           }
-          dequeued = m_pool->m_queue.dequeue(func);
-        }
-        if (dequeued) {
-          func();
+          continue;
         }
+        // the queues take no lock, the mutex only guards going to sleep
+        std::unique_lock<std::mutex> lock(m_pool->m_conditional_mutex);
+        m_pool->m_sleepers++;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_pool->m_conditional_lock.wait(lock, [this]() {
+          return m_pool->hasWork() || m_pool->m_shutdown;
+        });
+        m_pool->m_sleepers--;
       }
     }
   };
 
-  SafeQueue<std::function<void()>> m_queue;
-  std::vector<std::thread> m_threads;
+  // The worker of a pool the calling thread is, if any
+  struct Current {
+    ThreadPool * pool;
+    int id;
+  };
+
+  static Current & current() {
+    static thread_local Current current = {nullptr, -1};
+    return current;
+  }
+
+  // Tasks from other threads, the network threads mostly, wait in the
+  // injection queue. A task submitted by a worker goes to the bottom of
+  // the worker's own deque, where the worker takes it back without
+  // contention while it is still in the cache; idle workers steal from
+  // the top of the others' deques
+  MpmcQueue<Task> m_queue;
+  std::vector<std::unique_ptr<WorkStealingDeque<Task>>> m_deques;
+  // The deques hold pointers to tasks. A worker keeps the tasks it took
+  // for the next ones it pushes, so that posting from a worker does not
+  // allocate once the list holds a few; only the worker uses its list
+  std::vector<std::unique_ptr<std::vector<Task *>>> m_free_tasks;
+  bool m_work_stealing;
+  // Bulk tasks only wait in their own queue, a worker does not keep them
+  // in its deque where any other worker could steal them
+  MpmcQueue<Task> m_bulk_queue;
+  // Bulk tasks that found the bulk queue full wait here instead of
+  // blocking the thread that queued them: a worker that drains a strand
+  // queues bulk tasks too, and with every bulk worker waiting for room
+  // the queue would never drain. Once tasks wait here, new ones queue
+  // behind them so that the lane stays in order
+  std::mutex m_bulk_overflow_mutex;
+  std::deque<Task> m_bulk_overflow;
+  std::atomic<size_t> m_bulk_overflow_size;
+  std::atomic<int> m_bulk_running; // workers running a bulk task
+  std::atomic<int> m_bulk_workers; // the most workers running bulk tasks
+  std::vector<pthread_t> m_threads;
+  int m_started; // threads started by init
+  size_t m_stack_size;
+  std::vector<std::vector<int>> m_cpus;
   std::mutex m_conditional_mutex;
   std::condition_variable m_conditional_lock;
-  bool m_shutdown;
+  std::atomic<int> m_sleepers; // workers waiting on m_conditional_lock
+  std::atomic<int> m_spinners; // idle workers looking for a task before they sleep
+  std::atomic<int> m_spin_rounds;
+  std::atomic<bool> m_shutdown;
+
+  // Finds the next task for worker id: its own newest task first, then
+  // the oldest external one, then the oldest task of another worker, and
+  // a bulk task last, if fewer than m_bulk_workers workers run one
+  bool next(int id, Task& task, bool& bulk) {
+    Task * local = m_deques[id]->take();
+    if (local == nullptr && m_queue.dequeue(task)) {
+      return true;
+    }
+    for (size_t i = 1; local == nullptr && i < m_deques.size(); i++) {
+      local = m_deques[(id + i) % m_deques.size()]->steal();
+    }
+    if (local == nullptr) {
+      bulk = nextBulk(task);
+      return bulk;
+    }
+    task = std::move(*local);
+    std::vector<Task *>& free_tasks = *m_free_tasks[id];
+    if (free_tasks.size() < POOL_DEQUE_SIZE) {
+      free_tasks.push_back(local);
+    } else {
+      delete local;
+    }
+    return true;
+  }
+
+  bool nextBulk(Task& task) {
+    int running = m_bulk_running.load();
+    while (!bulkEmpty() && running < m_bulk_workers.load(std::memory_order_relaxed)) {
+      if (m_bulk_running.compare_exchange_weak(running, running + 1)) {
+        if (m_bulk_queue.dequeue(task) || dequeueBulkOverflow(task)) {
+          return true;
+        }
+        m_bulk_running--;
+        return false;
+      }
+    }
+    return false;
+  }
+
+  bool bulkEmpty() {
+    return m_bulk_queue.empty() && m_bulk_overflow_size.load() == 0;
+  }
+
+  // The overflow only holds tasks queued after those in the bulk queue,
+  // so it is looked at once the queue is empty
+  bool dequeueBulkOverflow(Task& task) {
+    if (m_bulk_overflow_size.load() == 0) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(m_bulk_overflow_mutex);
+    if (m_bulk_overflow.empty()) {
+      return false;
+    }
+    task = std::move(m_bulk_overflow.front());
+    m_bulk_overflow.pop_front();
+    m_bulk_overflow_size--;
+    return true;
+  }
+
+  // Gives the share of the bulk task that finished to another, waking a
+  // worker for it in case this one goes on with fast tasks
+  void doneBulk() {
+    m_bulk_running--;
+    if (!bulkEmpty()) {
+      wake(1);
+    }
+  }
+
+  bool hasWork() {
+    if (!m_queue.empty()) {
+      return true;
+    }
+    if (!bulkEmpty() &&
+        m_bulk_running.load() < m_bulk_workers.load(std::memory_order_relaxed)) {
+      return true;
+    }
+    for (auto& deque : m_deques) {
+      if (!deque->empty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  // Looks for a task for a while before worker id goes to sleep, so that
+  // under load a task submitted soon after costs neither the submitter a
+  // futex wake nor the worker a context switch. A spinning worker does
+  // not count as a sleeper, submitters leave it to find the task
+  bool spin(int id, Task& task, bool& bulk) {
+    int rounds = m_spin_rounds.load(std::memory_order_relaxed);
+    if (rounds == 0) {
+      return false;
+    }
+    m_spinners++;
+    bool found = false;
+    for (int i = 0; i < rounds && !found && !m_shutdown; i++) {
+      cpuRelax();
+      found = hasWork() && next(id, task, bulk);
+    }
+    // before the sleepers are read, see wake()
+    m_spinners--;
+    if (found && m_sleepers.load() > 0 && hasWork()) {
+      // the submitters of the other tasks counted on this worker
+      wake(1);
+    }
+    return found;
+  }
+
+  // Queues a task, waiting while the injection queue is full; a full bulk
+  // queue overflows to the heap instead. The injection queue holds the
+  // tasks themselves; the deques hold pointers, so a task a worker queues
+  // for itself is moved to a task from its free list, or to the heap
+  void push(Task& task, Lane lane = LaneFast) {
+    if (lane == LaneBulk) {
+      if (m_bulk_overflow_size.load() == 0 && m_bulk_queue.enqueue(task)) {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(m_bulk_overflow_mutex);
+      m_bulk_overflow.push_back(std::move(task));
+      m_bulk_overflow_size++;
+      return;
+    }
+    Current & current = ThreadPool::current();
+    bool queued = false;
+    if (m_work_stealing && current.pool == this) {
+      std::vector<Task *>& free_tasks = *m_free_tasks[current.id];
+      Task * local;
+      if (free_tasks.empty()) {
+        local = new Task();
+      } else {
+        local = free_tasks.back();
+        free_tasks.pop_back();
+      }
+      *local = std::move(task);
+      queued = m_deques[current.id]->push(local);
+      if (!queued) {
+        task = std::move(*local);
+        free_tasks.push_back(local);
+      }
+    }
+    while (!queued && !m_queue.enqueue(task)) {
+      std::this_thread::yield();
+    }
+  }
+
+  // Wakes up enough sleeping workers for n new tasks, counting on the
+  // spinning workers first. A worker stops spinning before it counts
+  // itself as a sleeper and looks at the queues once more, and the fence
+  // orders this against the submitter's look at the counters, so either
+  // the worker sees the tasks or the submitter sees it asleep
+  void wake(size_t n) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int sleepers = m_sleepers.load(std::memory_order_relaxed);
+    if (sleepers == 0) {
+      return;
+    }
+    size_t spinners = m_spinners.load(std::memory_order_relaxed);
+    if (n <= spinners) {
+      return;
+    }
+    int wanted = (int) std::min(n - spinners, (size_t) sleepers);
+    // a worker between its last look at the queues and its wait holds
+    // the mutex, taking it makes sure the notify is not lost
+    std::lock_guard<std::mutex> lock(m_conditional_mutex);
+    if (wanted == sleepers) {
+      m_conditional_lock.notify_all();
+    } else {
+      for (int i = 0; i < wanted; i++) {
+        m_conditional_lock.notify_one();
+      }
+    }
+  }
+
+  void enqueue(Task& task, Lane lane = LaneFast) {
+    push(task, lane);
+    wake(1);
+  }
 public:
-  ThreadPool(const int n_threads)
-    : m_threads(std::vector<std::thread>(n_threads)), m_shutdown(false) {
+  // Without work stealing every task goes through the injection queue
+  ThreadPool(const int n_threads, bool work_stealing = true)
+    : m_queue(POOL_QUEUE_SIZE), m_work_stealing(work_stealing),
+      m_bulk_queue(POOL_BULK_QUEUE_SIZE), m_bulk_overflow_size(0), m_bulk_running(0),
+      m_bulk_workers(n_threads > 1 ? (n_threads + 1) / 2 : 1),
+      m_threads(n_threads), m_started(0), m_stack_size(0), m_sleepers(0), m_spinners(0),
+      m_spin_rounds(std::thread::hardware_concurrency() > 1 ? POOL_SPIN_ROUNDS : 0),
+      m_shutdown(false) {
+    for (int i = 0; i < n_threads; ++i) {
+      m_deques.emplace_back(new WorkStealingDeque<Task>(POOL_DEQUE_SIZE));
+      m_free_tasks.emplace_back(new std::vector<Task *>());
+      m_free_tasks.back()->reserve(POOL_DEQUE_SIZE);
+    }
+  }
+
+  // Stops and joins the workers if shutdown was not called, then frees
+  // the tasks left in the deques and the free lists
+  ~ThreadPool() {
+    if (m_started > 0) {
+      shutdown();
+    }
+    for (auto& deque : m_deques) {
+      while (Task * task = deque->steal()) {
+        delete task;
+      }
+    }
+    for (auto& free_tasks : m_free_tasks) {
+      for (Task * task : *free_tasks) {
+        delete task;
+      }
+    }
   }
 
   ThreadPool(const ThreadPool &) = delete;
@@ -55,23 +341,57 @@ public:
   ThreadPool & operator=(const ThreadPool &) = delete;
   ThreadPool & operator=(ThreadPool &&) = delete;
 
-  // Inits thread pool
-  void init() {
+  // Sets how long an idle worker looks for a task before it sleeps, 0 to
+  // sleep at once. Spinning is off by default on a single core, where it
+  // only delays the thread that would submit the task
+  void setSpinRounds(int rounds) {
+    m_spin_rounds = rounds;
+  }
+
+  // Sets how many workers may run bulk tasks at the same time, half of
+  // them by default; the others only run fast tasks
+  void setBulkWorkers(int workers) {
+    m_bulk_workers = workers > 0 ? workers : 1;
+  }
+
+  // Sets the stack size of the workers in bytes, 0 for the default of the
+  // system; call before init
+  void setStackSize(size_t stack_size) {
+    m_stack_size = stack_size;
+  }
+
+  // Pins worker i to cpus[i % cpus.size()], none if cpus is empty; call
+  // before init
+  void setAffinity(const std::vector<std::vector<int>>& cpus) {
+    m_cpus = cpus;
+  }
+
+  // Inits thread pool, returns 0 or the errno of the thread that failed
+  // to start
+  int init() {
     for (int i = 0; i < m_threads.size(); ++i) {
-      m_threads[i] = std::thread(ThreadWorker(this, i));
+      std::vector<int> cpus = m_cpus.empty() ? std::vector<int>() : m_cpus[i % m_cpus.size()];
+      int ret = StartThread(&m_threads[i], ThreadWorker(this, i), m_stack_size, cpus);
+      if (ret != 0) {
+        return ret;
+      }
+      m_started++;
     }
+    return 0;
   }
 
   // Waits until threads finish their current task and shutdowns the pool
   void shutdown() {
-    m_shutdown = true;
+    {
+      std::lock_guard<std::mutex> lock(m_conditional_mutex);
+      m_shutdown = true;
+    }
     m_conditional_lock.notify_all();
     
-    for (int i = 0; i < m_threads.size(); ++i) {
-      if(m_threads[i].joinable()) {
-        m_threads[i].join();
-      }
+    for (int i = 0; i < m_started; ++i) {
+      pthread_join(m_threads[i], nullptr);
     }
+    m_started = 0;
   }
 
   // Submit a function to be executed asynchronously by the pool
@@ -82,18 +402,165 @@ public:
     // Encapsulate it into a shared ptr in order to be able to copy construct / assign 
     auto task_ptr = std::make_shared<std::packaged_task<decltype(f(args...))()>>(func);
 
-    // Wrap packaged task into void function
-    std::function<void()> wrapper_func = [task_ptr]() {
-      (*task_ptr)(); 
-    };
-
-    // Enqueue generic wrapper function
-    m_queue.enqueue(wrapper_func);
-
-    // Wake up one thread if its waiting
-    m_conditional_lock.notify_one();
+    // Wrap packaged task into a task, and wake up one thread if its waiting
+    Task task([task_ptr]() {
+      (*task_ptr)();
+    });
+    enqueue(task);
 
     // Return future from promise
     return task_ptr->get_future();
   }
+
+  // Submit the functions from first to last, waking up the workers they
+  // need at once rather than one by one
+  template<typename Iterator>
+  auto submit_batch(Iterator first, Iterator last) -> std::vector<std::future<decltype((*first)())>> {
+    typedef decltype((*first)()) Result;
+    std::vector<std::future<Result>> futures;
+    size_t n = 0;
+    for (; first != last; ++first, ++n) {
+      auto task_ptr = std::make_shared<std::packaged_task<Result()>>(*first);
+      futures.push_back(task_ptr->get_future());
+      Task task([task_ptr]() {
+        (*task_ptr)();
+      });
+      push(task);
+    }
+    wake(n);
+    return futures;
+  }
+
+  // Run a function asynchronously, without a future. The function and its
+  // captures are kept inside the task, so nothing is allocated unless a
+  // worker posts it for itself
+  template<typename F>
+  void post(F&& f) {
+    Task task(std::forward<F>(f));
+    enqueue(task);
+  }
+
+  // Run a function asynchronously in a lane, without a future
+  template<typename F>
+  void post(Lane lane, F&& f) {
+    Task task(std::forward<F>(f));
+    enqueue(task, lane);
+  }
+
+  // Runs the tasks submitted to it one at a time, in the order they were
+  // submitted, on the threads of the pool. A strand does not hold a
+  // thread while it has no task, and different strands run in parallel,
+  // so the work of one connection stays in order without blocking a
+  // worker. The queued tasks keep the strand alive after its owner
+  // destroyed it
+  class Strand {
+  private:
+    struct Queued {
+      Task task;
+      Lane lane;
+    };
+    // The queued tasks wait in a ring that only grows when it is full, so
+    // a strand stops allocating once it held as many tasks as it does at
+    // its busiest
+    struct State {
+      ThreadPool * pool;
+      std::mutex mutex;
+      std::vector<Queued> ring; // a power of 2 in size
+      size_t head; // the next task to run
+      size_t count;
+      bool scheduled; // a worker runs the tasks, or will
+    };
+    std::shared_ptr<State> m_state;
+
+    // Called with the mutex held
+    static void enqueue(State& state, Task& task, Lane lane) {
+      if (state.count == state.ring.size()) {
+        std::vector<Queued> ring(state.ring.empty() ? STRAND_RING_SIZE : 2 * state.ring.size());
+        for (size_t i = 0; i < state.count; i++) {
+          ring[i] = std::move(state.ring[(state.head + i) & (state.ring.size() - 1)]);
+        }
+        state.ring.swap(ring);
+        state.head = 0;
+      }
+      Queued& queued = state.ring[(state.head + state.count) & (state.ring.size() - 1)];
+      queued.task = std::move(task);
+      queued.lane = lane;
+      state.count++;
+    }
+
+    // Runs the queued tasks of a lane, and hands the rest back to the pool
+    // after a few so that a busy strand does not keep a worker from the
+    // others, or when the next task belongs to the other lane
+    static void drain(std::shared_ptr<State> state, Lane lane) {
+      for (int i = 0; ; i++) {
+        Task task;
+        {
+          std::unique_lock<std::mutex> lock(state->mutex);
+          if (state->count == 0) {
+            state->scheduled = false;
+            return;
+          }
+          Queued& front = state->ring[state->head];
+          if (i == STRAND_BATCH || front.lane != lane) {
+            lane = front.lane;
+            break;
+          }
+          task = std::move(front.task);
+          state->head = (state->head + 1) & (state->ring.size() - 1);
+          state->count--;
+        }
+        task();
+      }
+      state->pool->post(lane, [state, lane]() { drain(state, lane); });
+    }
+
+    // Queues a task, and hands the strand to the pool if it was idle
+    void push(Task task, Lane lane) {
+      bool schedule;
+      {
+        std::unique_lock<std::mutex> lock(m_state->mutex);
+        enqueue(*m_state, task, lane);
+        schedule = !m_state->scheduled;
+        m_state->scheduled = true;
+      }
+      if (schedule) {
+        std::shared_ptr<State> state = m_state;
+        m_state->pool->post(lane, [state, lane]() { drain(state, lane); });
+      }
+    }
+  public:
+    static const int STRAND_BATCH = 16;
+    static const size_t STRAND_RING_SIZE = 64; // tasks a ring holds at first
+
+    Strand(ThreadPool * pool) : m_state(std::make_shared<State>()) {
+      m_state->pool = pool;
+      m_state->head = 0;
+      m_state->count = 0;
+      m_state->scheduled = false;
+    }
+
+    // Submit a function to run after the functions submitted before it
+    template<typename F, typename...Args>
+    auto submit(F&& f, Args&&... args) -> std::future<decltype(f(args...))> {
+      std::function<decltype(f(args...))()> func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+      auto task_ptr = std::make_shared<std::packaged_task<decltype(f(args...))()>>(func);
+      push(Task([task_ptr]() {
+        (*task_ptr)();
+      }), LaneFast);
+      return task_ptr->get_future();
+    }
+
+    // Run a function after the functions submitted before it, without a
+    // future
+    template<typename F>
+    void post(F&& f) {
+      push(Task(std::forward<F>(f)), LaneFast);
+    }
+
+    // The same in a lane
+    template<typename F>
+    void post(Lane lane, F&& f) {
+      push(Task(std::forward<F>(f)), lane);
+    }
+  };
 };
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Bounded Chase-Lev deque of pointers, with the memory orders of Le,
+// Pop, Cohen and Zappa Nardelli, "Correct and Efficient Work-Stealing for
+// Weak Memory Models". The owner thread pushes and takes at the bottom
+// without a compare-and-swap, except for the last item; other threads
+// steal from the top. The items are pointers, so that a thief can read a
+// slot while the owner reuses it and then drop the item if its
+// compare-and-swap fails
+template <typename T>
+class WorkStealingDeque {
+private:
+  static const size_t CACHE_LINE = 64;
+
+  std::vector<std::atomic<T *>> m_slots;
+  int64_t m_mask;
+  char m_pad1[CACHE_LINE];
+  std::atomic<int64_t> m_top; // the next item to steal
+  char m_pad2[CACHE_LINE];
+  std::atomic<int64_t> m_bottom; // the next free slot, only written by the owner
+  char m_pad3[CACHE_LINE];
+
+public:
+  // size must be a power of 2
+  explicit WorkStealingDeque(size_t size)
+    : m_slots(size), m_mask(size - 1), m_top(0), m_bottom(0) {
+  }
+
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque & operator=(const WorkStealingDeque &) = delete;
+
+  // Called by the owner, returns false if the deque is full
+  bool push(T * item) {
+    int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+    int64_t top = m_top.load(std::memory_order_acquire);
+    if (bottom - top > m_mask) {
+      return false;
+    }
+    m_slots[bottom & m_mask].store(item, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_bottom.store(bottom + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Called by the owner, takes the item pushed last, nullptr if empty
+  T * take() {
+    int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+    m_bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = m_top.load(std::memory_order_relaxed);
+    if (top > bottom) {
+      m_bottom.store(bottom + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    T * item = m_slots[bottom & m_mask].load(std::memory_order_relaxed);
+    if (top == bottom) {
+      // the last item, a thief may take it at the same time
+      if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+        item = nullptr;
+      }
+      m_bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  // Called by any thread, takes the oldest item, nullptr if empty or if
+  // another thread took it first
+  T * steal() {
+    int64_t top = m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = m_bottom.load(std::memory_order_acquire);
+    if (top >= bottom) {
+      return nullptr;
+    }
+    T * item = m_slots[top & m_mask].load(std::memory_order_relaxed);
+    if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return item;
+  }
+
+  // Only a snapshot while other threads use the deque
+  bool empty() {
+    int64_t top = m_top.load(std::memory_order_acquire);
+    int64_t bottom = m_bottom.load(std::memory_order_acquire);
+    return top >= bottom;
+  }
+};
@@ -1,28 +1,174 @@
 #include <cstdio>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
 
 #include "mylib.h"
 #include "config.h"
 #include "memcache.h"
 #include "memserver.h"
+#include "options.h"
+#include "shard.h"
+#include "udpserver.h"
+#include "threads.h"
 
-#define PORT "11211"   // port we're listening on
+/* Joins the threads the server started
+ * @param threads: the threads
+ */
+static void join(const std::vector<pthread_t>& threads) {
+  for (pthread_t thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+}
+
+/* Starts a thread of the server, with the stack size of the options
+ * @param threads: the thread is added to them
+ * @param func: what the thread runs
+ * @param options: the options
+ * @param cpus: the cpus the thread runs on, empty for any
+ * @return: 0 on success, -1 if the thread cannot be started
+ */
+static int start(std::vector<pthread_t> *threads, std::function<void()> func,
+                 const Options& options, const std::vector<int>& cpus) {
+  pthread_t thread;
+  int ret = StartThread(&thread, func, options.stack_size, cpus);
+  if (ret != 0) {
+    printf("Failed to start a thread: %s\n", strerror(ret));
+    return -1;
+  }
+  threads->push_back(thread);
+  return 0;
+}
+
+/* Finds the cpus of the NUMA node of a cpu the process may run on
+ * @param cpu: the cpu
+ * @param allowed: the cpus the process may run on
+ * @return: the allowed cpus of the node
+ */
+static std::vector<int> AllowedNodeCpus(int cpu, const std::vector<int>& allowed) {
+  std::vector<int> cpus;
+  for (int node_cpu : NodeCpus(cpu)) {
+    if (std::find(allowed.begin(), allowed.end(), node_cpu) != allowed.end()) {
+      cpus.push_back(node_cpu);
+    }
+  }
+  return cpus;
+}
 
-int main(void)
+/* Runs the thread-per-core mode, with one shard per event loop thread.
+ * Every shard runs on a cpu of its own out of the allowed ones, whatever
+ * the pinning, except that node pinning lets it run on the allowed cpus
+ * of that cpu's NUMA node
+ * @param options: the options, the number of shards is options.reactors
+ */
+static int run_shards(const Options& options) {
+  int count = options.reactors;
+  std::vector<std::unique_ptr<Shard>> shards;
+  std::vector<Shard *> peers;
+  int capacity = CAPACITY / count > 0 ? CAPACITY / count : 1;
+  for (int i = 0; i < count; i++) {
+    shards.push_back(std::make_unique<Shard>(i, count, options.port, capacity));
+    if (shards.back()->init() < 0) {
+      printf("Failed to start the listener service\n");
+      return 0;
+    }
+    peers.push_back(shards.back().get());
+  }
+  for (auto& shard : shards) {
+    shard->connect(peers);
+  }
+  printf("Starting %d shards\n", count);
+
+  std::vector<int> allowed = AllowedCpus();
+  std::vector<pthread_t> threads;
+  for (int i = 0; i < count; i++) {
+    Shard *shard = shards[i].get();
+    std::vector<int> cpus(1, allowed[i % allowed.size()]);
+    if (options.pinning == PinNode) {
+      cpus = AllowedNodeCpus(cpus[0], allowed);
+    }
+    if (start(&threads, [shard]() { shard->run(); }, options, cpus) < 0) {
+      return 0;
+    }
+  }
+  join(threads);
+  return 0;
+}
+
+int main(int argc, char *argv[])
 {
-  std::unique_ptr<ThreadPool> pool;
+  Options options;
+  int ret = ParseOptions(&options, argc, argv);
+  if (ret != 0) {
+    PrintUsage(argv[0]);
+    return ret > 0 ? 0 : 1;
+  }
+  int reactors = options.reactors;
+
+  if (options.shards) {
+    if (!options.udp_port.empty() || !options.unix_path.empty()) {
+      printf("UDP and unix domain sockets are not served in the thread-per-core mode\n");
+    }
+    return run_shards(options);
+  }
+
+  // the cpus of every reactor, and of the workers of every threadpool;
+  // with core and node pinning every reactor has a threadpool of its own
+  std::vector<int> allowed = AllowedCpus();
+  std::vector<std::vector<int>> reactor_cpus(reactors);
+  std::vector<std::vector<std::vector<int>>> pool_cpus(1);
+  if (options.pinning != PinNone) {
+    for (int i = 0; i < reactors; i++) {
+      reactor_cpus[i].push_back(allowed[i % allowed.size()]);
+    }
+  }
+  if (options.pinning == PinSpread) {
+    for (int i = 0; i < options.workers; i++) {
+      pool_cpus[0].push_back(std::vector<int>(1, allowed[(reactors + i) % allowed.size()]));
+    }
+  } else if (options.pinning == PinCore || options.pinning == PinNode) {
+    if (options.workers < reactors) {
+      printf("Every reactor gets a threadpool of its own, raising the workers from %d to %d\n",
+             options.workers, reactors);
+    }
+    pool_cpus.clear();
+    for (int i = 0; i < reactors; i++) {
+      std::vector<int> cpus = reactor_cpus[i];
+      if (options.pinning == PinNode) {
+        cpus = AllowedNodeCpus(reactor_cpus[i][0], allowed);
+      }
+      pool_cpus.push_back(std::vector<std::vector<int>>(1, cpus));
+    }
+  }
+
+  std::vector<std::unique_ptr<ThreadPool>> pools;
   std::unique_ptr<Cache> memcache;
-  std::unique_ptr<CacheServer> memserver;
+  std::vector<std::unique_ptr<CacheServer>> memservers;
   
-  // create a threadpool
-  pool = std::make_unique<ThreadPool>(12);
-  if (pool.get() == nullptr) {
-    printf("Failed to create threadpool\n");
-    return 0;
-  }  
-  printf("Creating threadpool of size 12\n");
-  pool->init();
+  // create the threadpools, the workers are shared out between them
+  for (size_t i = 0; i < pool_cpus.size(); i++) {
+    int size = options.workers / (int) pool_cpus.size() +
+               ((int) i < options.workers % (int) pool_cpus.size() ? 1 : 0);
+    pools.push_back(std::make_unique<ThreadPool>(size > 0 ? size : 1));
+    if (pools.back().get() == nullptr) {
+      printf("Failed to create threadpool\n");
+      return 0;
+    }
+    printf("Creating threadpool of size %d\n", size > 0 ? size : 1);
+    pools.back()->setStackSize(options.stack_size);
+    pools.back()->setAffinity(pool_cpus[i]);
+    if (options.bulk_workers > 0) {
+      pools.back()->setBulkWorkers(options.bulk_workers);
+    }
+    ret = pools.back()->init();
+    if (ret != 0) {
+      printf("Failed to start the threadpool: %s\n", strerror(ret));
+      return 0;
+    }
+  }
 
   // create the cache object
   memcache = std::make_unique<Cache>();
@@ -31,21 +177,61 @@ int main(void)
     return 0;
   }
   
-  // create the server
-  memserver = std::make_unique<CacheServer>(std::string(PORT), pool.get(), memcache.get());
-  if (memserver.get() == nullptr) {
-    printf("Failed to create server\n");
-    return 0;
+  // create the servers, one reactor per thread, all listening on the port
+  for (int i = 0; i < reactors; i++) {
+    ThreadPool *pool = pools[i % pools.size()].get();
+    memservers.push_back(std::make_unique<CacheServer>(options.port, pool, memcache.get(), options.loop));
+    if (memservers.back().get() == nullptr) {
+      printf("Failed to create server\n");
+      return 0;
+    }
+
+    memservers.back()->SetInlineLimit(options.inline_limit);
+    memservers.back()->SetBulkThreshold(options.bulk_threshold);
+    memservers.back()->SetZeroCopyThreshold(options.zerocopy_threshold);
+    memservers.back()->SetReusePort(reactors > 1);
+    // a unix domain socket cannot be shared with SO_REUSEPORT, the first
+    // reactor accepts its connections
+    if (i == 0 && !options.unix_path.empty()) {
+      memservers.back()->SetUnixSocket(options.unix_path, options.unix_mode);
+    }
+
+    // initialize the server
+    if (memservers.back()->init() < 0) {
+      printf("Failed to start the listener service\n");
+      return 0;
+    }
   }
-  
-  // initialize the server
-  if (memserver->init() < 0) {
-    printf("Failed to start the listener service\n");
-    return 0;
+  printf("Starting %d reactors\n", reactors);
+
+  // the UDP servers share the port like the reactors
+  std::vector<std::unique_ptr<UdpServer>> udpservers;
+  for (int i = 0; !options.udp_port.empty() && i < reactors; i++) {
+    udpservers.push_back(std::make_unique<UdpServer>(options.udp_port, memcache.get()));
+    udpservers.back()->SetReusePort(reactors > 1);
+    if (udpservers.back()->init() < 0) {
+      printf("Failed to start the UDP service\n");
+      return 0;
+    }
   }
-  
-  // wait forever for new connections and receive data from existing connections
-  memserver->WaitForClientRequests();
+
+  // wait forever for new connections and receive data from existing
+  // connections; a UDP thread runs on the cpu of its reactor
+  std::vector<pthread_t> threads;
+  for (size_t i = 0; i < udpservers.size(); i++) {
+    UdpServer *udpserver = udpservers[i].get();
+    if (start(&threads, [udpserver]() { udpserver->run(); }, options, reactor_cpus[i]) < 0) {
+      return 0;
+    }
+  }
+  for (int i = 0; i < reactors; i++) {
+    CacheServer *memserver = memservers[i].get();
+    if (start(&threads, [memserver]() { memserver->WaitForClientRequests(); }, options,
+              reactor_cpus[i]) < 0) {
+      return 0;
+    }
+  }
+  join(threads);
 
   return 0;
 }
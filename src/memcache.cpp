@@ -6,11 +6,81 @@
 #include <inttypes.h>
 #include <netinet/in.h>
 #include <ctype.h>
+#include <errno.h>
 #include <vector>
 #include "memcache.h"
 
 using namespace std;
 
+// exptime values above this many seconds are absolute unix timestamps
+#define MAX_RELATIVE_EXPTIME (60 * 60 * 24 * 30)
+
+/* Converts an expiry time as sent by a client into an absolute time.
+ * Zero means the entry never expires, values up to 30 days are relative
+ * to now, and larger values are unix timestamps. A negative value makes
+ * the entry expire immediately
+ * @param exptime: the expiry time sent by the client
+ * @param now: the current time
+ * @return: the absolute expiry time, 0 if the entry never expires
+ */
+static time_t AbsoluteExpiry(time_t exptime, time_t now) {
+  if (exptime == 0) {
+    return 0;
+  }
+  if (exptime < 0) {
+    return now - 1;
+  }
+  if (exptime > MAX_RELATIVE_EXPTIME) {
+    return exptime;
+  }
+  return now + exptime;
+}
+
+/* Removes the node from the linked list
+ */
+void Cache::Unlink(CacheNode *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->next = nullptr;
+  node->prev = nullptr;
+}
+
+/* Brings a node that is in the linked list to the head of the list,
+ * marking it as the most recently used entry
+ */
+void Cache::MoveToHead(CacheNode *node) {
+  if (node == head_->next) {
+    return;
+  }
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->next = head_->next;
+  head_->next->prev = node;
+  node->prev = head_;
+  head_->next = node;
+}
+
+/* Looks up the node for a key. An entry whose expiry time has passed
+ * is removed from the cache and reported as missing.
+ * Must be called with cache_mutex_ held
+ * @param key: key to look for
+ * @param now: the current time
+ * @return: the node stored in the cache, nullptr if there is none
+ */
+CacheNode* Cache::FindLocked(const string& key, time_t now) {
+  auto itr = cache_map_.find(key);
+  if (itr == cache_map_.end()) {
+    return nullptr;
+  }
+  CacheNode *node = itr->second.get();
+  if (node->expires_at != 0 && node->expires_at <= now) {
+    Unlink(node);
+    cache_map_.erase(itr);
+    return nullptr;
+  }
+  return node;
+}
+
 /* This method deletes the last entry in the linked list and
  * deletes the corresponding entry in the map. i.e., it evicts
  * the least recently used entry
@@ -35,12 +105,114 @@ void Cache::DeleteLastNode() {
 
   auto itr = cache_map_.find(temp->key);
   cache_map_.erase(itr);
-  delete temp;
+}
+
+// the smallest size class of data buffers, and the growth factor between
+// size classes, as a fraction
+#define MIN_DATA_CHUNK 48
+#define DATA_CHUNK_GROWTH_NUM 5
+#define DATA_CHUNK_GROWTH_DEN 4
+
+/* Allocates the data buffer of a node for exactly size bytes
+ * @param size: the number of bytes needed
+ */
+void CacheNode::AllocateData(uint64_t size) {
+  if (data) {
+    delete[] data;
+  }
+  data = new char[size];
+  capacity = size;
+}
+
+/* Allocates the data buffer of a node that was appended or prepended to.
+ * The buffer size is rounded up to the next size class, in the manner of
+ * the slab classes of memcached, so that appending or prepending to the
+ * entry again can often be done in the buffer it already has. Entries
+ * that are only set do not pay for the room
+ * @param size: the number of bytes needed
+ */
+void CacheNode::AllocateDataChunk(uint64_t size) {
+  uint64_t chunk = MIN_DATA_CHUNK;
+  while (chunk < size) {
+    chunk = (chunk * DATA_CHUNK_GROWTH_NUM / DATA_CHUNK_GROWTH_DEN + 7) & ~7ULL;
+  }
+  if (chunk > MAX_DATA_LEN) {
+    chunk = size > MAX_DATA_LEN ? size : MAX_DATA_LEN;
+  }
+  if (data) {
+    delete[] data;
+  }
+  data = new char[chunk];
+  capacity = chunk;
+}
+
+/* Links a new entry at the head of the list and adds it to the map,
+ * giving it a new cas id
+ * Must be called with cache_mutex_ held
+ */
+void Cache::LinkAtHead(CacheNode *entry, time_t now) {
+  entry->cas = next_cas_++;
+  entry->last_access = now;
+  entry->fetched = false;
+  entry->stale = false;
+  entry->win_token_sent = false;
+  entry->next = head_->next;
+  entry->prev = head_;
+  head_->next->prev = entry;
+  head_->next = entry;
+  cache_map_[entry->key] = shared_ptr<CacheNode>(entry);
+}
+
+/* Appends or prepends the data of entry to the data of the stored node,
+ * in the buffer of the node. This is only possible if the buffer has room
+ * for the combined data and no reader holds an ItemHandle to the node,
+ * since a reader may be sending the data at that moment
+ * Must be called with cache_mutex_ held
+ * @return: true if the data was combined, false otherwise
+ */
+bool Cache::CombineInPlace(CacheNode *node, const CacheNode *entry, StoreMode mode) {
+  if (cache_map_[node->key].use_count() != 1 || node->data == nullptr) {
+    return false;
+  }
+  uint64_t bytes = node->bytes + entry->bytes;
+  if (bytes > node->DataCapacity()) {
+    return false;
+  }
+  if (mode == StoreAppend) {
+    memcpy(node->data + node->bytes, entry->data, entry->bytes);
+  } else {
+    memmove(node->data + entry->bytes, node->data, node->bytes);
+    memcpy(node->data, entry->data, entry->bytes);
+  }
+  node->bytes = bytes;
+  node->RenderHeader();
+  return true;
+}
+
+/* Creates a new node holding the data of the stored node with the data of
+ * entry appended or prepended. The new node keeps the flags and the expiry
+ * time of the stored node
+ * @return: the new node
+ */
+CacheNode* Cache::CombineEntries(const CacheNode *node, const CacheNode *entry, StoreMode mode) {
+  CacheNode *combined = new CacheNode();
+  combined->key = node->key;
+  combined->flags = node->flags;
+  combined->exptime = node->exptime;
+  combined->expires_at = node->expires_at;
+  combined->bytes = node->bytes + entry->bytes;
+  combined->AllocateDataChunk(combined->bytes);
+  const CacheNode *first = mode == StoreAppend ? node : entry;
+  const CacheNode *second = mode == StoreAppend ? entry : node;
+  memcpy(combined->data, first->data, first->bytes);
+  memcpy(combined->data + first->bytes, second->data, second->bytes);
+  combined->RenderHeader();
+  return combined;
 }
 
 /* This method add a new entry if the key is not already 
- * present in the map. If the key is present it updates the 
- * data with the new data 
+ * present in the map. If the key is present the new entry
+ * replaces the old one
  * The eviction algorithm being used is LRU. Hence every new
  * addition to the map causes the associated linkedlist entry to
  * be brought to the front of the list. If the total entries
@@ -50,43 +222,88 @@ void Cache::DeleteLastNode() {
  * @return: the status of the operation
  */
 CacheStatus Cache::addNewEntry(CacheNode *entry) {
+  return storeEntry(entry, StoreSet);
+}
+
+/* This method stores an entry according to the mode of the storage
+ * command. The cache takes ownership of the entry in all cases.
+ * A stored entry replaces the old entry for the key, which is released
+ * once no ItemHandle refers to it anymore. Appending and prepending reuse
+ * the buffer of the old entry when possible, see CombineInPlace()
+ * @param entry: the CacheNode to be stored
+ * @param mode: how the entry is combined with the stored one
+ * @param cas: the cas id the stored entry must have, for StoreCas
+ * @param stored_cas: if not nullptr, set to the cas id of the stored entry
+ * @return: Stored on success, NotStored if the mode did not allow storing
+ *  the entry, NotFound or Exists if the cas check failed
+ */
+CacheStatus Cache::storeEntry(CacheNode *entry, StoreMode mode, uint64_t cas,
+                              uint64_t *stored_cas) {
   if (entry == nullptr) {
     return Error; 
   }
-  unique_lock<mutex> lock(cache_mutex_);
-  // if the entry is already present
-  if (cache_map_.find(entry->key) != cache_map_.end()) {
-    // update and bring the entry to the head of the list
-    CacheNode *node = cache_map_[entry->key];
-    node->flags = entry->flags;
-    if (node->data) {
-      delete node->data;
-      node->data = nullptr;
-    }
-    node->bytes = entry->bytes;
-    node->data = new char[entry->bytes];
-    memcpy(node->data, entry->data, entry->bytes);
-    if (node != head_->next) {
-      node->prev->next = node->next;
-      node->next->prev = node->prev;
-      node->next = head_->next;
-      head_->next->prev = node;
-      head_->next = node; 
+  entry->RenderHeader();
+  time_t now = time(nullptr);
+  unique_lock<mutex> lock = Lock();
+  CacheNode *node = FindLocked(entry->key, now);
+  CacheStatus status = Stored;
+  switch (mode) {
+    case StoreAdd:
+      if (node != nullptr) {
+        status = NotStored;
+      }
+      break;
+    case StoreReplace:
+    case StoreAppend:
+    case StorePrepend:
+      if (node == nullptr) {
+        status = NotStored;
+      } else if (mode != StoreReplace && node->bytes + entry->bytes > MAX_DATA_LEN) {
+        status = NotStored;
+      }
+      break;
+    case StoreCas:
+      if (node == nullptr) {
+        status = NotFound;
+      } else if (node->cas != cas) {
+        status = Exists;
+      }
+      break;
+    default:
+      break;
+  }
+  if (status != Stored) {
+    delete entry;
+    return status;
+  }
+
+  if (mode == StoreAppend || mode == StorePrepend) {
+    if (CombineInPlace(node, entry, mode)) {
+      node->cas = next_cas_++;
+      node->last_access = now;
+      MoveToHead(node);
+      if (stored_cas != nullptr) {
+        *stored_cas = node->cas;
+      }
+      delete entry;
+      return Stored;
     }
-    // delete the entry that was created by the caller
+    CacheNode *combined = CombineEntries(node, entry, mode);
     delete entry;
-    return Stored;    
+    entry = combined;
+  } else {
+    entry->expires_at = AbsoluteExpiry(entry->exptime, now);
   }
 
-  if (cache_map_.size() + 1 > size_) {
+  if (node != nullptr) {
+    Unlink(node);
+  } else if (cache_map_.size() + 1 > size_) {
     DeleteLastNode();
   }
-
-  entry->next = head_->next;
-  entry->prev = head_;
-  head_->next->prev = entry;
-  head_->next = entry;
-  cache_map_[entry->key] = entry;
+  LinkAtHead(entry, now);
+  if (stored_cas != nullptr) {
+    *stored_cas = entry->cas;
+  }
   return Stored;
 }
 
@@ -94,7 +311,7 @@ CacheStatus Cache::addNewEntry(CacheNode *entry) {
 /* Returns the number of entries in the map
  */
 size_t Cache::NumEntries() {
-  unique_lock<mutex> lock(cache_mutex_);
+  unique_lock<mutex> lock = Lock();
   return cache_map_.size();
 }
 
@@ -108,28 +325,243 @@ size_t Cache::NumEntries() {
  * the pointer if the data is present, nullptr otherwise
  */
 CacheNode* Cache::getEntry(string key) {
-  CacheNode* node = nullptr;
+  time_t now = time(nullptr);
+  unique_lock<mutex> lock = Lock();
+  CacheNode* dbNode = FindLocked(key, now);
+  if (dbNode == nullptr) {
+    return nullptr;
+  }
+
+  CacheNode* node = new CacheNode(dbNode);
+  dbNode->fetched = true;
+  dbNode->last_access = now;
+  MoveToHead(dbNode);
+  return node;
+}
 
-  unique_lock<mutex> lock(cache_mutex_);
-  if (cache_map_.find(key) == cache_map_.end()) {
-    return node;
+/*
+ * This method looks up all the keys of a multi-get while holding the
+ * lock once, instead of once per key. It returns handles to the stored
+ * entries, so the data is not copied. The lookup runs in two passes: the
+ * first one locates the entries, the second one updates their LRU
+ * position
+ * @param keys: keys for which the data is requested
+ * @param items: filled with a handle per key, in the order of the keys;
+ *  the handle is nullptr if there is no entry for that key
+ * @param touch: if true, the expiry time of the entries is updated
+ * @param exptime: the new expiry time, used only if touch is true
+ */
+void Cache::getEntries(const vector<string>& keys, vector<ItemHandle> *items,
+                       bool touch, time_t exptime) {
+  vector<const shared_ptr<CacheNode>*> slots(keys.size(), nullptr);
+  items->assign(keys.size(), nullptr);
+
+  time_t now = time(nullptr);
+  unique_lock<mutex> lock = Lock();
+  for (size_t i = 0; i < keys.size(); i++) {
+    auto itr = cache_map_.find(keys[i]);
+    if (itr != cache_map_.end()) {
+      slots[i] = &itr->second;
+    }
   }
 
-  CacheNode* dbNode = cache_map_[key];
-  node = new CacheNode(dbNode);
-  if (dbNode != head_->next) {
-    dbNode->prev->next = dbNode->next;
-    dbNode->next->prev = dbNode->prev;
-    
-    dbNode->next = head_->next;
-    head_->next->prev = dbNode;
-    dbNode->prev = head_;
-    head_->next = dbNode;
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (slots[i] == nullptr) {
+      continue;
+    }
+    CacheNode *node = slots[i]->get();
+    // expired entries are left for FindLocked() to remove, so that the
+    // slots of repeated keys stay valid
+    if (node->expires_at != 0 && node->expires_at <= now) {
+      continue;
+    }
+    if (touch) {
+      node->exptime = exptime;
+      node->expires_at = AbsoluteExpiry(exptime, now);
+    }
+    node->fetched = true;
+    node->last_access = now;
+    MoveToHead(node);
+    (*items)[i] = *slots[i];
+  }
+}
+
+/*
+ * This method is the lookup behind the meta get command. Like getEntry()
+ * it returns a copy of the CacheNode, taken before the lookup updated
+ * the access state of the entry, so that the caller can report whether
+ * the entry was fetched before and when it was last accessed.
+ * If the entry is stale, the first caller to see it is handed the
+ * token to recache it; the copy returned to that caller has
+ * win_token_sent set to false, every later copy has it set to true
+ * @param key: key for which the data is requested
+ * @param touch: if true, the expiry time of the entry is updated
+ * @param exptime: the new expiry time, used only if touch is true
+ * @return: a copy of the CacheNode if present, nullptr otherwise
+ */
+CacheNode* Cache::metaGetEntry(const string& key, bool touch, time_t exptime) {
+  time_t now = time(nullptr);
+  unique_lock<mutex> lock = Lock();
+  CacheNode* dbNode = FindLocked(key, now);
+  if (dbNode == nullptr) {
+    return nullptr;
+  }
+
+  if (touch) {
+    dbNode->exptime = exptime;
+    dbNode->expires_at = AbsoluteExpiry(exptime, now);
+  }
+  CacheNode* node = new CacheNode(dbNode);
+  if (dbNode->stale) {
+    dbNode->win_token_sent = true;
   }
-  
+  dbNode->fetched = true;
+  dbNode->last_access = now;
+  MoveToHead(dbNode);
   return node;
 }
 
+/*
+ * Updates the expiry time of an entry and brings it to the head of the
+ * list, without copying its data
+ * @param key: key of the entry
+ * @param exptime: the new expiry time, as sent by the client
+ * @return: Touched if the entry was present, NotFound otherwise
+ */
+CacheStatus Cache::touchEntry(const string& key, time_t exptime) {
+  time_t now = time(nullptr);
+  unique_lock<mutex> lock = Lock();
+  CacheNode* node = FindLocked(key, now);
+  if (node == nullptr) {
+    return NotFound;
+  }
+  node->exptime = exptime;
+  node->expires_at = AbsoluteExpiry(exptime, now);
+  node->last_access = now;
+  MoveToHead(node);
+  return Touched;
+}
+
+/*
+ * Increments or decrements the decimal number stored in an entry. The
+ * lookup, the arithmetic and the update happen while holding the lock
+ * once, so concurrent updates of a counter are never lost. The new value
+ * is written into the buffer of the entry unless its digits no longer fit
+ * the buffer or a reader holds an ItemHandle to the entry; only then is a
+ * new entry with the value allocated
+ * @param key: key of the counter
+ * @param delta: the amount to add or subtract
+ * @param decr: if true, subtract delta, stopping at 0; otherwise add delta,
+ *  wrapping around at 2^64
+ * @param value: set to the new value of the counter
+ * @return: Stored on success, NotFound if the key is not present,
+ *  ClientError if the entry does not hold a number
+ */
+CacheStatus Cache::incrEntry(const string& key, uint64_t delta, bool decr, uint64_t *value) {
+  time_t now = time(nullptr);
+  unique_lock<mutex> lock = Lock();
+  CacheNode* node = FindLocked(key, now);
+  if (node == nullptr) {
+    return NotFound;
+  }
+
+  // the value must be an unsigned 64 bit decimal number
+  if (node->bytes == 0 || node->bytes > 20) {
+    return ClientError;
+  }
+  uint64_t current = 0;
+  for (uint64_t i = 0; i < node->bytes; i++) {
+    char c = node->data[i];
+    if (!isdigit(c) || current > (UINT64_MAX - (c - '0')) / 10) {
+      return ClientError;
+    }
+    current = current * 10 + (c - '0');
+  }
+  if (decr) {
+    current = delta > current ? 0 : current - delta;
+  } else {
+    current += delta;
+  }
+
+  char digits[24];
+  int len = snprintf(digits, sizeof digits, "%" PRIu64, current);
+  if (cache_map_[key].use_count() == 1 && (uint64_t) len <= node->DataCapacity()) {
+    memcpy(node->data, digits, len);
+    if (node->bytes != (uint64_t) len) {
+      node->bytes = len;
+      node->RenderHeader();
+    }
+    node->cas = next_cas_++;
+    node->last_access = now;
+    MoveToHead(node);
+  } else {
+    CacheNode *entry = new CacheNode();
+    entry->key = node->key;
+    entry->flags = node->flags;
+    entry->exptime = node->exptime;
+    entry->expires_at = node->expires_at;
+    entry->bytes = len;
+    entry->AllocateData(len);
+    memcpy(entry->data, digits, len);
+    entry->RenderHeader();
+    Unlink(node);
+    LinkAtHead(entry, now);
+  }
+  *value = current;
+  return Stored;
+}
+
+/*
+ * Removes the entry for a key from the cache
+ * @param key: key of the entry to be removed
+ * @param cas: if not 0, the cas id the entry must have
+ * @return: Deleted if the entry was removed, NotFound if it was not
+ *  present, Exists if its cas id did not match
+ */
+CacheStatus Cache::deleteEntry(const string& key, uint64_t cas) {
+  time_t now = time(nullptr);
+  unique_lock<mutex> lock = Lock();
+  CacheNode* node = FindLocked(key, now);
+  if (node == nullptr) {
+    return NotFound;
+  }
+  if (cas != 0 && node->cas != cas) {
+    return Exists;
+  }
+  Unlink(node);
+  cache_map_.erase(key);
+  return Deleted;
+}
+
+/*
+ * Marks the entry for a key as stale instead of removing it, so that
+ * clients can keep serving the old data while one of them recaches it
+ * @param key: key of the entry to be invalidated
+ * @param touch: if true, the expiry time of the entry is updated
+ * @param exptime: the new expiry time, used only if touch is true
+ * @param cas: if not 0, the cas id the entry must have
+ * @return: Deleted if the entry was invalidated, NotFound if it was not
+ *  present, Exists if its cas id did not match
+ */
+CacheStatus Cache::invalidateEntry(const string& key, bool touch, time_t exptime, uint64_t cas) {
+  time_t now = time(nullptr);
+  unique_lock<mutex> lock = Lock();
+  CacheNode* node = FindLocked(key, now);
+  if (node == nullptr) {
+    return NotFound;
+  }
+  if (cas != 0 && node->cas != cas) {
+    return Exists;
+  }
+  node->stale = true;
+  node->win_token_sent = false;
+  if (touch) {
+    node->exptime = exptime;
+    node->expires_at = AbsoluteExpiry(exptime, now);
+  }
+  return Deleted;
+}
+
 /* returns a uint16_t value for the the string
  * @param: the string that needs to be converted
  * @param: the result of the conversion
@@ -149,36 +581,67 @@ str_to_uint16(const char *str, uint16_t *res)
   return true;
 }
 
-/* This function parses the 'get command from the string
+/* This function parses the 'get', 'gets', 'gat' and 'gats' commands
  * It retrieves the key(s), validates if the key(s) is(are) valid, searches
  * for the data in the map, and returns the data if the data is present
  * If the data is not present, it returns an empty string for that key
  * If the command does not follow memcache protocol specifications, it
  * returns string "wrong command format"
+ * The reply references the header rendered when the entry was stored and
+ * the data of the entry instead of formatting and copying them. For
+ * 'gets' and 'gats' the header is followed by the cas id of the entry.
+ * 'gat' and 'gats' take an expiry time before the keys, and update the
+ * expiry time of the entries they return
  * @param s: the string to be parsed
  * @param memcahe: the Cache pointer
- * @param: result as specified by the protocol specifications on success
- *  else an empty string if data is not found
+ * @param response: filled with the result as specified by the protocol
+ *  specifications on success, left empty if data is not found
  */
-string ParseGetCmd(string s, Cache* memcache) {
-  string result;
+void ParseGetCmd(const string& s, Cache* memcache, Response* response) {
   string error_string = "CLIENT_ERROR ";
   // printf("cmd string is %s\n", s.c_str());
   int len = s.length();
-  int i = 4;
+  size_t cmd_end = s.find(' ');
+  if (cmd_end == string::npos) {
+    error_string.append("wrong command format\r\n");
+    response->append(error_string);
+    return;
+  }
+  string cmd = s.substr(0, cmd_end);
+  bool with_cas = cmd == "gets" || cmd == "gats";
+  bool touch = cmd == "gat" || cmd == "gats";
+  int i = cmd_end + 1;
+  time_t exptime = 0;
+  if (touch) {
+    string exp_str;
+    while (i < len && s[i] != ' ' && s[i] != '\r') {
+      exp_str += s[i];
+      i++;
+    }
+    char *end;
+    exptime = strtol(exp_str.c_str(), &end, 10);
+    if (exp_str.length() == 0 || *end != '\0' || i == len || s[i] != ' ') {
+      error_string.append("invalid exptime argument\r\n");
+      response->append(error_string);
+      return;
+    }
+    i++;
+  }
   vector<string> keys;
   string key_str; 
   while (i < len) {
     if (i == len - 1 && s[i] != '\n') {
       error_string.append("wrong command format\r\n");
-      return error_string;
+      response->append(error_string);
+      return;
     } else if (i == len - 1 && s[i] == '\n') {
       break;
     }
     if (s[i] == '\r') {
       if (i + 2 != len) {
         error_string.append("wrong command format\r\n");
-        return error_string;
+        response->append(error_string);
+        return;
       }
       keys.push_back(key_str);
       i++;
@@ -186,13 +649,15 @@ string ParseGetCmd(string s, Cache* memcache) {
     }
     if (s[i] == '\n' || iscntrl(s[i])) {
       error_string.append("wrong command format\r\n");
-      return error_string;
+      response->append(error_string);
+      return;
     }
 
     if (s[i] == ' ') {
       if (key_str.length() == 0) {
         error_string.append("wrong command format\r\n");
-        return error_string;
+        response->append(error_string);
+        return;
       }
       keys.push_back(key_str);
       key_str.clear();
@@ -203,51 +668,107 @@ string ParseGetCmd(string s, Cache* memcache) {
     key_str += s[i];
     if (key_str.length() > 250) {
       error_string.append("key length exceeds 250 character limit\r\n");
-      return error_string;
+      response->append(error_string);
+      return;
     }
     i++;
   }
 
   if (keys.size() == 0) {
     error_string.append("wrong command format\r\n");
-    return error_string;
+    response->append(error_string);
+    return;
   }
  
-  for (auto& key : keys) {
-    CacheNode* returnedNode = memcache->getEntry(key);
-    if (returnedNode == nullptr) {
+  vector<ItemHandle> items;
+  memcache->getEntries(keys, &items, touch, exptime);
+  for (auto& item : items) {
+    if (item == nullptr) {
       continue;
     }
-    if (returnedNode->bytes == 0 || returnedNode->data == nullptr) {
-      printf("Error in returning key %s\n", key.c_str());
+    if (item->bytes == 0 || item->data == nullptr) {
+      printf("Error in returning key %s\n", item->key.c_str());
       continue;
     }
-    result.append("VALUE ").append(returnedNode->key);
-    result.append(" ").append(to_string(returnedNode->flags));
-    result.append(" ").append(to_string(returnedNode->bytes));
-    result.append("\r\n");
-    result.append(returnedNode->data, returnedNode->bytes);
-    result.append("\r\n");
-    delete returnedNode;
+    if (with_cas) {
+      response->appendRef(item->header.data(), item->header.length() - 2, item);
+      response->append(" " + to_string(item->cas) + "\r\n");
+    } else {
+      response->appendRef(item->header.data(), item->header.length(), item);
+    }
+    response->appendRef(item->data, item->bytes, item);
+    response->appendRef("\r\n", 2, nullptr);
   } 
-  return result;
 }
 
-/* This function parses the 'set' command, retrieves the key, flags, exp time, 
- * the number of bytes for the data, optional "noreply" and the data itself
- * If the format is correct, then it stores the data in the map. If the key is
- * already present, then it updates the data for the already present entry.
- * If there is no space in the map, and an eviction is required, then the least
- * recently used entry in the map is evicted to make space
+/* Runs a 'get' command, returning the reply as a string
+ * @param s: the string to be parsed
+ * @param memcahe: the Cache pointer
+ * @return: result as specified by the protocol specifications on success
+ *  else an empty string if data is not found
+ */
+string ParseGetCmd(string s, Cache* memcache) {
+  Response response;
+  ParseGetCmd(s, memcache, &response);
+  return response.str();
+}
+
+/* This function parses the 'set' command, see ParseStorageCmd()
  * @param s: the string that needs to be parsed
  * @param memcahe: the pointer to memcache
  * @return s: STORED if successful, CLIENT_ERROR on failure
  */
 string ParseSetCmd(string s, Cache* memcache, int total_bytes) {
+  return ParseStorageCmd(s, memcache, total_bytes);
+}
+
+/* This function parses the storage commands 'set', 'add', 'replace',
+ * 'append', 'prepend' and 'cas'. It retrieves the key, flags, exp time,
+ * the number of bytes for the data, the cas id for 'cas', optional
+ * "noreply" and the data itself
+ * If the format is correct, then it stores the data in the map as the
+ * command asks. 'set' stores the data whether the key is present or not,
+ * 'add' only if the key is not present, 'replace', 'append' and 'prepend'
+ * only if it is present, and 'cas' only if the entry has not been updated
+ * since the client fetched it with 'gets'. 'append' and 'prepend' ignore
+ * the flags and exp time and keep those of the stored entry.
+ * If there is no space in the map, and an eviction is required, then the least
+ * recently used entry in the map is evicted to make space
+ * @param s: the string that needs to be parsed
+ * @param memcahe: the pointer to memcache
+ * With "noreply" the reply of a well formed command is suppressed, only
+ * errors in the command itself are reported
+ * @return s: STORED if successful, NOT_STORED if the command did not allow
+ *  storing the data, EXISTS or NOT_FOUND if the cas check failed,
+ *  CLIENT_ERROR on failure, an empty string with noreply
+ */
+string ParseStorageCmd(string s, Cache* memcache, int total_bytes) {
   string result;
   string error_str = "CLIENT_ERROR ";
   int len = total_bytes;
-  int i = 4;
+  size_t cmd_end = s.find(' ');
+  if (cmd_end == string::npos || cmd_end >= len) {
+    error_str.append("wrong command format\r\n");
+    return error_str;
+  }
+  string cmd = s.substr(0, cmd_end);
+  StoreMode mode;
+  if (cmd == "set") {
+    mode = StoreSet;
+  } else if (cmd == "add") {
+    mode = StoreAdd;
+  } else if (cmd == "replace") {
+    mode = StoreReplace;
+  } else if (cmd == "append") {
+    mode = StoreAppend;
+  } else if (cmd == "prepend") {
+    mode = StorePrepend;
+  } else if (cmd == "cas") {
+    mode = StoreCas;
+  } else {
+    return "ERROR\r\n";
+  }
+  int i = cmd_end + 1;
   string key;
   uint16_t flags;
   unsigned long exp_time;
@@ -325,6 +846,22 @@ string ParseSetCmd(string s, Cache* memcache, int total_bytes) {
     error_str.append("wrong bytes format\r\n");
     return error_str;
   }
+  uint64_t cas_unique = 0;
+  if (mode == StoreCas) {
+    while (i < len && s[i] == ' ') {
+      i++;
+    }
+    string cas_str;
+    while (i < len && isdigit(s[i])) {
+      cas_str += s[i];
+      i++;
+    }
+    if (cas_str.length() == 0 || i == len) {
+      error_str.append("wrong command format\r\n");
+      return error_str;
+    }
+    cas_unique = strtoull(cas_str.c_str(), nullptr, 10);
+  }
   // printf("%" PRIu64 "\n", bytes);
   // skip the space, optional noreply and trailing \r\n part of the command
   while (i < len && s[i] == ' ') {
@@ -337,8 +874,10 @@ string ParseSetCmd(string s, Cache* memcache, int total_bytes) {
   }
 
   // skip noreply if present
+  bool noreply = false;
   if (i + 7 < len && s.substr(i, 7) == "noreply") {
     i += 7;
+    noreply = true;
   }
   if (i+2 >= len) {
     error_str.append("wrong command format\r\n");
@@ -367,10 +906,6 @@ string ParseSetCmd(string s, Cache* memcache, int total_bytes) {
     error_str.append("wrong command format\r\n");
     return error_str;
   }
-  char *data = new char[bytes];
-  void *data_ptr = reinterpret_cast<void *>(&s[i]);
-  memcpy(reinterpret_cast<void *>(data), data_ptr, bytes);
-  
   CacheNode *node = new CacheNode();
   if (node == nullptr) {
     error_str.append("memory error\r\n");
@@ -380,9 +915,14 @@ string ParseSetCmd(string s, Cache* memcache, int total_bytes) {
   node->flags = flags;
   node->exptime = exp_time;
   node->bytes = bytes;
-  node->data = data;
-  if (memcache->addNewEntry(node) == Stored) {
-    result = return_str[Stored];
+  node->AllocateData(bytes);
+  memcpy(node->data, &s[i], bytes);
+  CacheStatus status = memcache->storeEntry(node, mode, cas_unique);
+  if (noreply) {
+    return result;
+  }
+  if (status == Stored || status == NotStored || status == Exists || status == NotFound) {
+    result = return_str[status];
   } else {
     error_str.append("\r\n");
     return error_str;
@@ -390,8 +930,301 @@ string ParseSetCmd(string s, Cache* memcache, int total_bytes) {
   return result.append("\r\n");
 }
 
-/* This function parses the data from client and determines if the command
- * is a set or a get. For any other command type it returns an ERROR
+/* Splits a command without a data block into its space separated tokens
+ * @param s: the command
+ * @param tokens: filled with the tokens of the command line
+ * @return: false if the command is not a single line terminated by \r\n
+ */
+static bool TokenizeCommand(const string& s, vector<string> *tokens) {
+  size_t line_end = s.find("\r\n");
+  if (line_end == string::npos || line_end + 2 != s.length()) {
+    return false;
+  }
+  size_t pos = 0;
+  while (pos < line_end) {
+    size_t end = s.find(' ', pos);
+    if (end == string::npos || end > line_end) {
+      end = line_end;
+    }
+    if (end > pos) {
+      tokens->push_back(s.substr(pos, end - pos));
+    }
+    pos = end + 1;
+  }
+  return true;
+}
+
+/* Checks the key of a command
+ * @param key: the key
+ * @param error_str: the error string to append the reason to
+ * @return: true if the key is valid, false otherwise
+ */
+static bool CheckKey(const string& key, string *error_str) {
+  if (key.length() > 250) {
+    error_str->append("key length exceeds 250 characters\r\n");
+    return false;
+  }
+  for (auto c : key) {
+    if (iscntrl(c)) {
+      error_str->append("key contains control character\r\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+/* This function parses the 'incr' and 'decr' commands
+ * incr|decr <key> <value> [noreply]\r\n
+ * The value of the entry is treated as an unsigned 64 bit decimal number
+ * @param s: the string that needs to be parsed
+ * @param memcache: the pointer to memcache
+ * @return: the new value if successful, NOT_FOUND if the key is not
+ *  present, CLIENT_ERROR on failure, an empty string with noreply
+ */
+string ParseArithmeticCmd(string s, Cache* memcache) {
+  string error_str = "CLIENT_ERROR ";
+  vector<string> tokens;
+  if (!TokenizeCommand(s, &tokens) || tokens.size() < 3 || tokens.size() > 4 ||
+      (tokens.size() == 4 && tokens[3] != "noreply")) {
+    error_str.append("wrong command format\r\n");
+    return error_str;
+  }
+  const string& key = tokens[1];
+  if (!CheckKey(key, &error_str)) {
+    return error_str;
+  }
+  char *end;
+  errno = 0;
+  uint64_t delta = strtoull(tokens[2].c_str(), &end, 10);
+  if (errno == ERANGE || !isdigit(tokens[2][0]) || *end != '\0') {
+    error_str.append("invalid numeric delta argument\r\n");
+    return error_str;
+  }
+
+  uint64_t value;
+  CacheStatus status = memcache->incrEntry(key, delta, tokens[0] == "decr", &value);
+  if (tokens.size() == 4) {
+    // noreply
+    return "";
+  }
+  if (status == NotFound) {
+    return return_str[NotFound] + "\r\n";
+  } else if (status != Stored) {
+    error_str.append("cannot increment or decrement non-numeric value\r\n");
+    return error_str;
+  }
+  return to_string(value) + "\r\n";
+}
+
+/* This function parses the 'delete' command
+ * delete <key> [noreply]\r\n
+ * @param s: the string that needs to be parsed
+ * @param memcache: the pointer to memcache
+ * @return: DELETED if the entry was removed, NOT_FOUND if the key is not
+ *  present, CLIENT_ERROR on failure, an empty string with noreply
+ */
+string ParseDeleteCmd(string s, Cache* memcache) {
+  string error_str = "CLIENT_ERROR ";
+  vector<string> tokens;
+  if (!TokenizeCommand(s, &tokens) || tokens.size() < 2 || tokens.size() > 3 ||
+      (tokens.size() == 3 && tokens[2] != "noreply")) {
+    error_str.append("wrong command format\r\n");
+    return error_str;
+  }
+  if (!CheckKey(tokens[1], &error_str)) {
+    return error_str;
+  }
+  CacheStatus status = memcache->deleteEntry(tokens[1]);
+  if (tokens.size() == 3) {
+    // noreply
+    return "";
+  }
+  return return_str[status] + "\r\n";
+}
+
+/* This function parses the 'touch' command, which updates the expiry
+ * time of an entry without sending its data again
+ * touch <key> <exptime> [noreply]\r\n
+ * @param s: the string that needs to be parsed
+ * @param memcache: the pointer to memcache
+ * @return: TOUCHED if the entry was updated, NOT_FOUND if the key is not
+ *  present, CLIENT_ERROR on failure, an empty string with noreply
+ */
+string ParseTouchCmd(string s, Cache* memcache) {
+  string error_str = "CLIENT_ERROR ";
+  vector<string> tokens;
+  if (!TokenizeCommand(s, &tokens) || tokens.size() < 3 || tokens.size() > 4 ||
+      (tokens.size() == 4 && tokens[3] != "noreply")) {
+    error_str.append("wrong command format\r\n");
+    return error_str;
+  }
+  if (!CheckKey(tokens[1], &error_str)) {
+    return error_str;
+  }
+  char *end;
+  time_t exptime = strtol(tokens[2].c_str(), &end, 10);
+  if (*end != '\0') {
+    error_str.append("invalid exptime argument\r\n");
+    return error_str;
+  }
+  CacheStatus status = memcache->touchEntry(tokens[1], exptime);
+  if (tokens.size() == 4) {
+    // noreply
+    return "";
+  }
+  return return_str[status] + "\r\n";
+}
+
+/* Returns the number of data bytes that follow the command line of a
+ * storage command, including the trailing \r\n of the data block
+ * @param cmd: the command name
+ * @param line: the command line, without the trailing \r\n
+ * @return: the length of the data block, 0 if the command has none
+ */
+static size_t DataBlockLength(const string& cmd, const string& line) {
+  int bytes_token;
+  if (cmd == "set" || cmd == "add" || cmd == "replace" || cmd == "append" ||
+      cmd == "prepend" || cmd == "cas") {
+    bytes_token = 4;
+  } else if (cmd == "ms") {
+    bytes_token = 2;
+  } else {
+    return 0;
+  }
+  size_t pos = 0;
+  for (int token = 0; token < bytes_token; token++) {
+    pos = line.find(' ', pos);
+    if (pos == string::npos) {
+      return 0;
+    }
+    while (pos < line.length() && line[pos] == ' ') {
+      pos++;
+    }
+  }
+  uint64_t bytes = strtoull(line.c_str() + pos, nullptr, 10);
+  if (bytes == 0 || bytes > MAX_DATA_LEN) {
+    return 0;
+  }
+  return bytes + 2;
+}
+
+/* Returns the length of the command that starts at pos. A command is a
+ * line terminated by \r\n, followed by a data block for the storage
+ * commands
+ * @param s: the data received from the client
+ * @param pos: the offset of the command in s
+ * @param total_bytes: the number of bytes received
+ * @return: the number of bytes of the command, 0 if the buffer ends
+ *  before the command is complete
+ */
+static size_t CommandLength(const string& s, size_t pos, size_t total_bytes) {
+  size_t line_end = s.find("\r\n", pos);
+  if (line_end == string::npos || line_end + 2 > total_bytes) {
+    return 0;
+  }
+  size_t cmd_end = s.find_first_of(" \r", pos);
+  string cmd = s.substr(pos, cmd_end - pos);
+  size_t length = line_end + 2 - pos;
+  length += DataBlockLength(cmd, s.substr(pos, line_end - pos));
+  if (pos + length > total_bytes) {
+    return 0;
+  }
+  return length;
+}
+
+/* Returns the length of the command that starts at pos. If the buffer
+ * ends before the command is complete, the rest of the buffer is treated
+ * as the command, so that the command parser reports the error
+ * @param s: the data received from the client
+ * @param pos: the offset of the command in s
+ * @param total_bytes: the number of bytes received
+ * @return: the number of bytes of the command
+ */
+size_t NextCommandLength(const string& s, size_t pos, size_t total_bytes) {
+  size_t length = CommandLength(s, pos, total_bytes);
+  if (length == 0) {
+    return total_bytes - pos;
+  }
+  return length;
+}
+
+/* Returns the number of bytes at the start of the data received from a
+ * client that form complete commands. The server keeps the rest until
+ * more data arrives, so that a pipelined batch that is split across
+ * reads is not cut in the middle of a command
+ * @param s: the data received from the client
+ * @param total_bytes: the number of bytes received
+ * @return: the length of the complete commands
+ */
+size_t CompleteCommandsLength(const string& s, size_t total_bytes) {
+  size_t pos = 0;
+  size_t length;
+  while (pos < total_bytes && (length = CommandLength(s, pos, total_bytes)) > 0) {
+    pos += length;
+  }
+  return pos;
+}
+
+/* This function runs every command contained in the data received from
+ * a client, so that clients can pipeline several commands in one
+ * request, and collects the replies. For any unknown command type it
+ * replies with an ERROR
+ * @param s: the data received from the client
+ * @param memcache: pointer to memcache
+ * @param total_bytes: the number of bytes received
+ * @param response: filled with the replies, in command order
+ */
+void ProcessCommands(const string& s, Cache* memcache, int total_bytes, Response* response) {
+  if (total_bytes < 3) {
+    response->append("ERROR wrong command format\r\n");
+    return;
+  }
+  size_t pos = 0;
+  while (pos < total_bytes) {
+    size_t length = NextCommandLength(s, pos, total_bytes);
+    string cmd_str = s.substr(pos, length);
+    size_t cmd_end = cmd_str.find_first_of(" \r");
+    string cmd = cmd_str.substr(0, cmd_end);
+    if (cmd == "set" || cmd == "add" || cmd == "replace" || cmd == "append" ||
+        cmd == "prepend" || cmd == "cas") {
+      response->append(ParseStorageCmd(cmd_str, memcache, length));
+    } else if (cmd == "incr" || cmd == "decr") {
+      response->append(ParseArithmeticCmd(cmd_str, memcache));
+    } else if (cmd == "delete") {
+      response->append(ParseDeleteCmd(cmd_str, memcache));
+    } else if (cmd == "touch") {
+      response->append(ParseTouchCmd(cmd_str, memcache));
+    } else if (cmd == "get" || cmd == "gets" || cmd == "gat" || cmd == "gats") {
+      ParseGetCmd(cmd_str, memcache, response);
+    } else if (cmd == "mg") {
+      response->append(ParseMetaGetCmd(cmd_str, memcache));
+    } else if (cmd == "ms") {
+      response->append(ParseMetaSetCmd(cmd_str, memcache, length));
+    } else if (cmd == "md") {
+      response->append(ParseMetaDeleteCmd(cmd_str, memcache));
+    } else if (cmd == "mn") {
+      response->append(ParseMetaNoopCmd(cmd_str));
+    } else {
+      response->append("ERROR\r\n");
+    }
+    pos += length;
+  }
+}
+
+/* Runs the commands received from a client, returning the replies as
+ * a string
+ * @param s: the data received from the client
+ * @param memcache: pointer to memcache
+ * @param total_bytes: the number of bytes received
+ * @return: the replies to be sent to the client, in command order
+ */
+string ProcessCommands(const string& s, Cache* memcache, int total_bytes) {
+  Response response;
+  ProcessCommands(s, memcache, total_bytes, &response);
+  return response.str();
+}
+
+/* This function parses the data from client and runs the commands in it
  * This function is run by the threadpool module
  * @param s: command recevied from the client
  * @param socket: the bidirectional socket to which the reply will be sent
@@ -399,27 +1232,15 @@ string ParseSetCmd(string s, Cache* memcache, int total_bytes) {
  */
 void ParseDataFromClient(string s, int socket, Cache* memcache, int total_bytes) {
   // printf("In ParseDataFromClient for string %s, socket %d\n", s.c_str(), socket);
-  string send_to_client_str;
-  if (total_bytes < 3) {
-    send_to_client_str = "ERROR wrong command format\r\n";
-  } else {
-    string cmd_str = s.substr(0, 3);
-    if (cmd_str == "set") {
-      send_to_client_str = ParseSetCmd(s, memcache, total_bytes);
-    } else if (cmd_str == "get") {
-      send_to_client_str = ParseGetCmd(s, memcache);
-    } else {
-      send_to_client_str = "ERROR\r\n";
-    } 
-  }
-  if (send_to_client_str.length() == 0) {
-    printf("No reply from server for command '%s'", s.c_str());
+  Response response;
+  ProcessCommands(s, memcache, total_bytes, &response);
+  if (response.empty()) {
+    // quiet and noreply commands only reply on failure, a batch of them
+    // is not written back at all
     return;
   }
   // send the result to client
-  if (send(socket, send_to_client_str.c_str(), send_to_client_str.length(), 0) == -1) {
-    printf("Failed to send result %s to client\n", send_to_client_str.c_str());
+  if (response.sendTo(socket) == -1) {
+    printf("Failed to send result of %zu bytes to client\n", response.length());
   }
 }
-
-
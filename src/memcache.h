@@ -2,9 +2,12 @@
 #define memcache_h
 #include <string>
 #include <cstring>
+#include <memory>
 #include <mutex>
 #include <unordered_map>
+#include <vector>
 #include "Threadpool.h"
+#include "response.h"
 
 using namespace std;
 
@@ -15,26 +18,50 @@ using namespace std;
 struct CacheNode {
   string key; // key for the data
   uint16_t flags; // flags associated with the data
-  time_t exptime; //  the exp time, not used
+  time_t exptime; //  the exp time as sent by the client
+  time_t expires_at; // absolute expiry time, 0 if the entry never expires
+  time_t last_access; // time the entry was last stored or fetched
+  bool fetched; // the entry has been fetched since it was stored
+  bool stale; // the entry was invalidated by a meta delete and awaits a recache
+  bool win_token_sent; // a client has already been asked to recache the stale entry
+  uint64_t cas; // unique id of this version of the entry
   uint64_t bytes; // number of bytes of data
+  uint64_t capacity; // size of the data buffer, 0 if it was allocated with bytes
   char *data; // a pointer to the data buffer
+  string header; // the "VALUE <key> <flags> <bytes>\r\n" line of a get reply
   CacheNode *next; // points to the next node in the linkedlist
   CacheNode *prev; // points to the previous node in the linkedlist
   CacheNode() {
     key = "";
     flags = 0;
     exptime = 0;
+    expires_at = 0;
+    last_access = 0;
+    fetched = false;
+    stale = false;
+    win_token_sent = false;
+    cas = 0;
     data = nullptr;
     prev = nullptr;
     next = nullptr;
     bytes = 0;
+    capacity = 0;
   }
 
   CacheNode(const CacheNode *node) {
     key = node->key;
     flags = node->flags;
     exptime = node->exptime;
+    expires_at = node->expires_at;
+    last_access = node->last_access;
+    fetched = node->fetched;
+    stale = node->stale;
+    win_token_sent = node->win_token_sent;
+    cas = node->cas;
     bytes = node->bytes;
+    capacity = 0;
+    header = node->header;
+    data = nullptr;
     next = nullptr;
     prev = nullptr;
     if (bytes > 0 && node->data != nullptr) {
@@ -43,6 +70,24 @@ struct CacheNode {
     }
   }
 
+  // renders the header of get replies, must be called whenever the
+  // key, flags or bytes change
+  void RenderHeader() {
+    header = "VALUE ";
+    header.append(key);
+    header.append(" ").append(to_string(flags));
+    header.append(" ").append(to_string(bytes));
+    header.append("\r\n");
+  }
+
+  // allocates a data buffer for exactly size bytes
+  void AllocateData(uint64_t size);
+  // allocates a data buffer for size bytes, rounded up to a size class
+  // so that appending to the entry again can often reuse the buffer
+  void AllocateDataChunk(uint64_t size);
+
+  inline uint64_t DataCapacity() const { return capacity > bytes ? capacity : bytes; }
+
   ~CacheNode() {
     if (data) {
       delete[] data;
@@ -51,24 +96,49 @@ struct CacheNode {
   }
 };
 
+// A reference to an entry stored in the cache. The entry stays valid as
+// long as the handle is held, even if it is replaced or evicted meanwhile
+typedef shared_ptr<const CacheNode> ItemHandle;
+
 enum CacheStatus {
   Stored,
   NotStored,
   Error,
-  ClientError
+  ClientError,
+  Deleted,
+  NotFound,
+  Exists,
+  Touched
 };
 
 static unordered_map<uint32_t, string> return_str = {
   {Stored, "STORED"},
   {NotStored, "NOT_STORED"},
   {Error, "ERROR"},
-  {ClientError, "CLIENT_ERROR"}
+  {ClientError, "CLIENT_ERROR"},
+  {Deleted, "DELETED"},
+  {NotFound, "NOT_FOUND"},
+  {Exists, "EXISTS"},
+  {Touched, "TOUCHED"}
+};
+
+// how storeEntry() combines a new entry with the stored one
+enum StoreMode {
+  StoreSet, // store the entry
+  StoreAdd, // store the entry only if the key is not present
+  StoreReplace, // store the entry only if the key is present
+  StoreAppend, // add the data after the data of the stored entry
+  StorePrepend, // add the data before the data of the stored entry
+  StoreCas // store the entry only if the stored one has not changed
 };
 
 class Cache {
  public:
-  Cache(int size = CAPACITY) {
+  // a cache that is only used by one thread can skip the locking
+  Cache(int size = CAPACITY, bool locking = true) {
     size_ = size;
+    locking_ = locking;
+    next_cas_ = 1;
     head_ = new CacheNode();
     tail_ = new CacheNode();
     head_->next = tail_;
@@ -76,35 +146,74 @@ class Cache {
   }
 
   ~Cache() {
-    CacheNode *itr = head_;
-    while (itr != nullptr) {
-      CacheNode *temp = itr;
-      itr = itr->next;
-      delete temp;
-    }
     cache_map_.clear();
+    delete head_;
+    delete tail_;
   }
 
   CacheStatus addNewEntry(CacheNode *entry);
 
+  CacheStatus storeEntry(CacheNode *entry, StoreMode mode, uint64_t cas = 0,
+                         uint64_t *stored_cas = nullptr);
+
   CacheNode* getEntry(string key);
 
+  void getEntries(const vector<string>& keys, vector<ItemHandle> *items,
+                  bool touch = false, time_t exptime = 0);
+
+  CacheNode* metaGetEntry(const string& key, bool touch, time_t exptime);
+
+  CacheStatus touchEntry(const string& key, time_t exptime);
+
+  CacheStatus incrEntry(const string& key, uint64_t delta, bool decr, uint64_t *value);
+
+  CacheStatus deleteEntry(const string& key, uint64_t cas = 0);
+
+  CacheStatus invalidateEntry(const string& key, bool touch, time_t exptime, uint64_t cas = 0);
+
   size_t NumEntries();
 
   inline uint32_t Capacity() { return size_; }
 
  private:
+  // locks the cache, unless it is used by a single thread
+  inline unique_lock<mutex> Lock() {
+    return locking_ ? unique_lock<mutex>(cache_mutex_) : unique_lock<mutex>();
+  }
   void DeleteLastNode();
+  void Unlink(CacheNode *node);
+  void MoveToHead(CacheNode *node);
+  CacheNode* FindLocked(const string& key, time_t now);
+  void LinkAtHead(CacheNode *entry, time_t now);
+  bool CombineInPlace(CacheNode *node, const CacheNode *entry, StoreMode mode);
+  CacheNode* CombineEntries(const CacheNode *node, const CacheNode *entry, StoreMode mode);
 
   uint32_t size_; // size of the cache
-  unordered_map<string, CacheNode*> cache_map_; // map to store the key and associated CacheNode pointer
+  unordered_map<string, shared_ptr<CacheNode>> cache_map_; // map to store the key and associated CacheNode
   CacheNode *head_; // the head of the linkedlist
   CacheNode *tail_; // tail of the linkedlist
+  uint64_t next_cas_; // the cas id given to the next stored entry
   mutex cache_mutex_; // mutex to provide synchronization
+  bool locking_; // false if the cache is owned by a single thread
 };
 
 int GetDataFromClient(int socket, ThreadPool *pool, Cache* memcache);
 void ParseDataFromClient(string s, int socket, Cache* memcache, int total_bytes);
 string ParseSetCmd(string s, Cache* memcache, int total_bytes);
+string ParseStorageCmd(string s, Cache* memcache, int total_bytes);
+string ParseArithmeticCmd(string s, Cache* memcache);
+string ParseDeleteCmd(string s, Cache* memcache);
+string ParseTouchCmd(string s, Cache* memcache);
 string ParseGetCmd(string s, Cache* memcache);
+void ParseGetCmd(const string& s, Cache* memcache, Response* response);
+string ProcessCommands(const string& s, Cache* memcache, int total_bytes);
+void ProcessCommands(const string& s, Cache* memcache, int total_bytes, Response* response);
+size_t CompleteCommandsLength(const string& s, size_t total_bytes);
+size_t NextCommandLength(const string& s, size_t pos, size_t total_bytes);
+
+// meta protocol commands, see memcache_meta.cpp
+string ParseMetaGetCmd(string s, Cache* memcache);
+string ParseMetaSetCmd(string s, Cache* memcache, int total_bytes);
+string ParseMetaDeleteCmd(string s, Cache* memcache);
+string ParseMetaNoopCmd(string s);
 #endif //memcache_h
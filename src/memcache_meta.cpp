@@ -0,0 +1,488 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <vector>
+#include "memcache.h"
+
+using namespace std;
+
+/*
+ * This file implements the meta protocol commands 'mg', 'ms', 'md' and 'mn'.
+ * A meta command is a key followed by single character flags, some of which
+ * take a token (e.g. T30 or Oabc). The flags select which fields are
+ * returned, so a client only pays for the data it asks for. The 'q' flag
+ * suppresses the common case reply (a miss for 'mg', a success for 'ms' and
+ * 'md'), which allows clients to pipeline a large batch of quiet commands
+ * terminated by a 'mn', and only read back the interesting replies.
+ */
+
+// maximum length of an opaque token, including the 'O'
+#define MAX_OPAQUE_LENGTH 33
+
+/* Splits the command line of a meta command into space separated tokens
+ * @param s: the command
+ * @param line_end: set to the offset of the \r\n that ends the line
+ * @param tokens: filled with the tokens of the line
+ * @return: false if the line is not terminated by \r\n or contains
+ *  control characters
+ */
+static bool TokenizeMetaLine(const string& s, size_t *line_end, vector<string> *tokens) {
+  *line_end = s.find("\r\n");
+  if (*line_end == string::npos) {
+    return false;
+  }
+  string token;
+  for (size_t i = 0; i < *line_end; i++) {
+    if (s[i] == ' ') {
+      if (token.length() > 0) {
+        tokens->push_back(token);
+        token.clear();
+      }
+      continue;
+    }
+    if (iscntrl(s[i])) {
+      return false;
+    }
+    token += s[i];
+  }
+  if (token.length() > 0) {
+    tokens->push_back(token);
+  }
+  return true;
+}
+
+/* Parses the numeric argument of a flag token such as T30 or F5
+ * @param token: the flag token, including the flag character
+ * @param value: the result of the conversion
+ * @return: true if the token holds a valid number, false otherwise
+ */
+static bool ParseFlagNumber(const string& token, intmax_t *value) {
+  if (token.length() < 2) {
+    return false;
+  }
+  const char *str = token.c_str() + 1;
+  char *end;
+  errno = 0;
+  *value = strtoimax(str, &end, 10);
+  if (errno == ERANGE || end == str || *end != '\0') {
+    return false;
+  }
+  return true;
+}
+
+/* Checks the key of a meta command
+ * @param key: the key
+ * @param error_str: the error string to append the reason to
+ * @return: true if the key can be stored, false otherwise
+ */
+static bool ValidateMetaKey(const string& key, string *error_str) {
+  if (key.length() > 250) {
+    error_str->append("key length exceeds 250 characters\r\n");
+    return false;
+  }
+  return true;
+}
+
+/* Appends the requested return flags that echo the command: the opaque
+ * token and the key
+ * @param flag: the flag character
+ * @param opaque: the opaque token sent with the command
+ * @param key: the key of the command
+ * @param flags_str: the string to append the flag to
+ */
+static void AppendEchoFlag(char flag, const string& opaque, const string& key, string *flags_str) {
+  if (flag == 'O') {
+    flags_str->append(" ").append(opaque);
+  } else if (flag == 'k') {
+    flags_str->append(" k").append(key);
+  }
+}
+
+/* This function parses the 'mg' (meta get) command
+ * mg <key> <flags>*\r\n
+ * Supported flags are:
+ *  v: return the value, f: return the client flags, s: return the size,
+ *  c: return the cas id,
+ *  t: return the remaining TTL in seconds (-1 if the entry never expires),
+ *  h: return whether the entry was fetched before, l: return the seconds
+ *  since the entry was last accessed, k: return the key, O(token): return
+ *  the opaque token, T(token): update the TTL, q: do not reply on a miss
+ * A stale entry (see 'md' with the I flag) is returned with the X flag,
+ * and the first client to fetch it gets the W flag, telling it to recache
+ * the entry, while the others get the Z flag
+ * @param s: the string to be parsed
+ * @param memcache: the Cache pointer
+ * @return: "VA <size> <flags>*\r\n<data>\r\n" if the value was requested,
+ *  "HD <flags>*\r\n" on a hit otherwise, "EN\r\n" on a miss, CLIENT_ERROR
+ *  if the command is not valid
+ */
+string ParseMetaGetCmd(string s, Cache* memcache) {
+  string error_str = "CLIENT_ERROR ";
+  size_t line_end;
+  vector<string> tokens;
+  if (!TokenizeMetaLine(s, &line_end, &tokens) || line_end + 2 != s.length() ||
+      tokens.size() < 2) {
+    error_str.append("wrong command format\r\n");
+    return error_str;
+  }
+  string key = tokens[1];
+  if (!ValidateMetaKey(key, &error_str)) {
+    return error_str;
+  }
+
+  bool quiet = false;
+  bool value = false;
+  bool touch = false;
+  time_t exptime = 0;
+  string opaque;
+  string requested;
+  for (size_t i = 2; i < tokens.size(); i++) {
+    const string& token = tokens[i];
+    intmax_t number;
+    switch (token[0]) {
+      case 'v':
+        value = true;
+        break;
+      case 'q':
+        quiet = true;
+        break;
+      case 'c':
+      case 'f':
+      case 'h':
+      case 'k':
+      case 'l':
+      case 's':
+      case 't':
+        requested += token[0];
+        break;
+      case 'O':
+        if (token.length() > MAX_OPAQUE_LENGTH) {
+          error_str.append("opaque token too long\r\n");
+          return error_str;
+        }
+        opaque = token;
+        requested += 'O';
+        break;
+      case 'T':
+        if (!ParseFlagNumber(token, &number)) {
+          error_str.append("bad token in command line format\r\n");
+          return error_str;
+        }
+        touch = true;
+        exptime = number;
+        break;
+      default:
+        error_str.append("invalid flag\r\n");
+        return error_str;
+    }
+  }
+
+  CacheNode* returnedNode = memcache->metaGetEntry(key, touch, exptime);
+  if (returnedNode == nullptr) {
+    return quiet ? "" : "EN\r\n";
+  }
+
+  time_t now = time(nullptr);
+  string flags_str;
+  for (auto flag : requested) {
+    switch (flag) {
+      case 'c':
+        flags_str.append(" c").append(to_string(returnedNode->cas));
+        break;
+      case 'f':
+        flags_str.append(" f").append(to_string(returnedNode->flags));
+        break;
+      case 'h':
+        flags_str.append(returnedNode->fetched ? " h1" : " h0");
+        break;
+      case 'l':
+        flags_str.append(" l").append(to_string(now - returnedNode->last_access));
+        break;
+      case 's':
+        flags_str.append(" s").append(to_string(returnedNode->bytes));
+        break;
+      case 't':
+        if (returnedNode->expires_at == 0) {
+          flags_str.append(" t-1");
+        } else {
+          flags_str.append(" t").append(to_string(returnedNode->expires_at - now));
+        }
+        break;
+      default:
+        AppendEchoFlag(flag, opaque, key, &flags_str);
+        break;
+    }
+  }
+  if (returnedNode->stale) {
+    flags_str.append(returnedNode->win_token_sent ? " Z" : " W");
+    flags_str.append(" X");
+  }
+
+  string result;
+  if (value) {
+    result.append("VA ").append(to_string(returnedNode->bytes));
+    result.append(flags_str).append("\r\n");
+    result.append(returnedNode->data, returnedNode->bytes);
+    result.append("\r\n");
+  } else {
+    result.append("HD").append(flags_str).append("\r\n");
+  }
+  delete returnedNode;
+  return result;
+}
+
+/* This function parses the 'ms' (meta set) command
+ * ms <key> <datalen> <flags>*\r\n<data>\r\n
+ * Supported flags are:
+ *  F(token): set the client flags, T(token): set the TTL, k: return the
+ *  key, O(token): return the opaque token, c: return the cas id of the
+ *  stored entry, C(token): store only if the entry has this cas id,
+ *  M(token): the mode, one of E (add), A (append), P (prepend),
+ *  R (replace) and S (set, the default), q: do not reply on success
+ * @param s: the string to be parsed
+ * @param memcache: the Cache pointer
+ * @param total_bytes: the length of the command
+ * @return: "HD <flags>*\r\n" if stored, "NS\r\n" if not stored, "EX\r\n" if
+ *  the cas id did not match, "NF\r\n" if there was no entry to compare the
+ *  cas id with, CLIENT_ERROR if the command is not valid
+ */
+string ParseMetaSetCmd(string s, Cache* memcache, int total_bytes) {
+  string error_str = "CLIENT_ERROR ";
+  size_t line_end;
+  vector<string> tokens;
+  if (!TokenizeMetaLine(s, &line_end, &tokens) || tokens.size() < 3) {
+    error_str.append("wrong command format\r\n");
+    return error_str;
+  }
+  string key = tokens[1];
+  if (!ValidateMetaKey(key, &error_str)) {
+    return error_str;
+  }
+  char *end;
+  uint64_t bytes = strtoull(tokens[2].c_str(), &end, 10);
+  if (*end != '\0' || !isdigit(tokens[2][0]) || bytes == 0 || bytes > MAX_DATA_LEN) {
+    error_str.append("wrong bytes format\r\n");
+    return error_str;
+  }
+  size_t data_start = line_end + 2;
+  if (data_start + bytes + 2 != total_bytes ||
+      s[data_start + bytes] != '\r' || s[data_start + bytes + 1] != '\n') {
+    error_str.append("wrong command format\r\n");
+    return error_str;
+  }
+
+  bool quiet = false;
+  uint16_t flags = 0;
+  time_t exptime = 0;
+  StoreMode mode = StoreSet;
+  uint64_t compare_cas = 0;
+  string opaque;
+  string requested;
+  for (size_t i = 3; i < tokens.size(); i++) {
+    const string& token = tokens[i];
+    intmax_t number;
+    switch (token[0]) {
+      case 'q':
+        quiet = true;
+        break;
+      case 'c':
+      case 'k':
+        requested += token[0];
+        break;
+      case 'C':
+        if (!ParseFlagNumber(token, &number) || number <= 0) {
+          error_str.append("bad token in command line format\r\n");
+          return error_str;
+        }
+        compare_cas = number;
+        break;
+      case 'M':
+        if (token.length() != 2) {
+          error_str.append("invalid mode for ms\r\n");
+          return error_str;
+        }
+        switch (token[1]) {
+          case 'E': case 'e': mode = StoreAdd; break;
+          case 'A': case 'a': mode = StoreAppend; break;
+          case 'P': case 'p': mode = StorePrepend; break;
+          case 'R': case 'r': mode = StoreReplace; break;
+          case 'S': case 's': mode = StoreSet; break;
+          default:
+            error_str.append("invalid mode for ms\r\n");
+            return error_str;
+        }
+        break;
+      case 'O':
+        if (token.length() > MAX_OPAQUE_LENGTH) {
+          error_str.append("opaque token too long\r\n");
+          return error_str;
+        }
+        opaque = token;
+        requested += 'O';
+        break;
+      case 'F':
+        if (!ParseFlagNumber(token, &number) || number < 0 || number > UINT16_MAX) {
+          error_str.append("expected flag\r\n");
+          return error_str;
+        }
+        flags = (uint16_t) number;
+        break;
+      case 'T':
+        if (!ParseFlagNumber(token, &number)) {
+          error_str.append("bad token in command line format\r\n");
+          return error_str;
+        }
+        exptime = number;
+        break;
+      default:
+        error_str.append("invalid flag\r\n");
+        return error_str;
+    }
+  }
+
+  CacheNode *node = new CacheNode();
+  node->key = key;
+  node->flags = flags;
+  node->exptime = exptime;
+  node->bytes = bytes;
+  node->AllocateData(bytes);
+  memcpy(node->data, &s[data_start], bytes);
+  if (compare_cas != 0) {
+    if (mode != StoreSet) {
+      delete node;
+      error_str.append("cas compare is only supported in set mode\r\n");
+      return error_str;
+    }
+    mode = StoreCas;
+  }
+  uint64_t stored_cas = 0;
+  CacheStatus status = memcache->storeEntry(node, mode, compare_cas, &stored_cas);
+  if (status == NotStored) {
+    return "NS\r\n";
+  } else if (status == Exists) {
+    return "EX\r\n";
+  } else if (status == NotFound) {
+    return "NF\r\n";
+  } else if (status != Stored) {
+    error_str.append("\r\n");
+    return error_str;
+  }
+  if (quiet) {
+    return "";
+  }
+  string flags_str;
+  for (auto flag : requested) {
+    if (flag == 'c') {
+      flags_str.append(" c").append(to_string(stored_cas));
+    } else {
+      AppendEchoFlag(flag, opaque, key, &flags_str);
+    }
+  }
+  return string("HD").append(flags_str).append("\r\n");
+}
+
+/* This function parses the 'md' (meta delete) command
+ * md <key> <flags>*\r\n
+ * Supported flags are:
+ *  I: mark the entry as stale instead of removing it, T(token): update
+ *  the TTL of an invalidated entry, C(token): delete only if the entry
+ *  has this cas id, k: return the key, O(token): return the opaque token,
+ *  q: do not reply unless there is an error
+ * @param s: the string to be parsed
+ * @param memcache: the Cache pointer
+ * @return: "HD <flags>*\r\n" if deleted, "NF <flags>*\r\n" if not found,
+ *  "EX <flags>*\r\n" if the cas id did not match, CLIENT_ERROR if the
+ *  command is not valid
+ */
+string ParseMetaDeleteCmd(string s, Cache* memcache) {
+  string error_str = "CLIENT_ERROR ";
+  size_t line_end;
+  vector<string> tokens;
+  if (!TokenizeMetaLine(s, &line_end, &tokens) || line_end + 2 != s.length() ||
+      tokens.size() < 2) {
+    error_str.append("wrong command format\r\n");
+    return error_str;
+  }
+  string key = tokens[1];
+  if (!ValidateMetaKey(key, &error_str)) {
+    return error_str;
+  }
+
+  bool quiet = false;
+  bool invalidate = false;
+  bool touch = false;
+  uint64_t compare_cas = 0;
+  time_t exptime = 0;
+  string opaque;
+  string requested;
+  for (size_t i = 2; i < tokens.size(); i++) {
+    const string& token = tokens[i];
+    intmax_t number;
+    switch (token[0]) {
+      case 'q':
+        quiet = true;
+        break;
+      case 'I':
+        invalidate = true;
+        break;
+      case 'C':
+        if (!ParseFlagNumber(token, &number) || number <= 0) {
+          error_str.append("bad token in command line format\r\n");
+          return error_str;
+        }
+        compare_cas = number;
+        break;
+      case 'k':
+        requested += 'k';
+        break;
+      case 'O':
+        if (token.length() > MAX_OPAQUE_LENGTH) {
+          error_str.append("opaque token too long\r\n");
+          return error_str;
+        }
+        opaque = token;
+        requested += 'O';
+        break;
+      case 'T':
+        if (!ParseFlagNumber(token, &number)) {
+          error_str.append("bad token in command line format\r\n");
+          return error_str;
+        }
+        touch = true;
+        exptime = number;
+        break;
+      default:
+        error_str.append("invalid flag\r\n");
+        return error_str;
+    }
+  }
+
+  CacheStatus status;
+  if (invalidate) {
+    status = memcache->invalidateEntry(key, touch, exptime, compare_cas);
+  } else {
+    status = memcache->deleteEntry(key, compare_cas);
+  }
+  if (quiet && status != Exists) {
+    return "";
+  }
+  string flags_str;
+  for (auto flag : requested) {
+    AppendEchoFlag(flag, opaque, key, &flags_str);
+  }
+  string result = status == Deleted ? "HD" : status == Exists ? "EX" : "NF";
+  return result.append(flags_str).append("\r\n");
+}
+
+/* This function parses the 'mn' (meta no-op) command. Clients send it
+ * after a batch of quiet commands; since commands are answered in order,
+ * its reply tells the client that the whole batch has been processed
+ * @param s: the string to be parsed
+ * @return: "MN\r\n", CLIENT_ERROR if the command is not valid
+ */
+string ParseMetaNoopCmd(string s) {
+  if (s != "mn\r\n") {
+    return "CLIENT_ERROR wrong command format\r\n";
+  }
+  return "MN\r\n";
+}
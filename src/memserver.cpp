@@ -7,6 +7,11 @@
 #include <netinet/in.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <linux/errqueue.h>
 #include <vector>
 #include "memserver.h"
 
@@ -16,8 +21,7 @@ int CacheServer::init() {
   struct addrinfo hints, *ai, *p;
   int rv, yes = 1;
 
-  FD_ZERO(&master_);
-  FD_ZERO(&read_fds_);
+  recv_buffer_.resize(MAX_PAYLOAD_LENGTH);
 
   // get us a socket and bind it
 	memset(&hints, 0, sizeof hints);
@@ -37,6 +41,13 @@ int CacheServer::init() {
 		
 		// lose the pesky "address already in use" error message
 		setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+		// every reactor binds its own listener to the port, and the kernel
+		// spreads the incoming connections over them; a single one does
+		// not, so that it cannot share the port with another server by
+		// mistake
+		if (reuse_port_) {
+			setsockopt(listener_, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+		}
 
 		if (bind(listener_, (const struct sockaddr *)p->ai_addr, p->ai_addrlen) < 0) {
 			close(listener_);
@@ -54,65 +65,407 @@ int CacheServer::init() {
 
 	freeaddrinfo(ai); // all done with this
 
-  // listen
-  if (listen(listener_, 10) == -1) {
+  // listen, with a backlog large enough for many clients connecting at once
+  if (listen(listener_, SOMAXCONN) == -1) {
       perror("listen");
       exit(3);
   }
 
-  // add the listener to the master set
-  FD_SET(listener_, &master_);
+  // connections are accepted until accept() would block
+  fcntl(listener_, F_SETFL, fcntl(listener_, F_GETFL) | O_NONBLOCK);
+
+  if (!unix_path_.empty() && InitUnixSocket() < 0) {
+    return -1;
+  }
+
+  if (loop_ == LoopIoUring && InitUring() < 0) {
+    printf("Falling back to epoll\n");
+    loop_ = LoopEpoll;
+  }
+
+  if (loop_ == LoopCoroutine && InitCoroutines() < 0) {
+    printf("Falling back to epoll\n");
+    loop_ = LoopEpoll;
+  }
 
-  // keep track of the biggest file descriptor
-  fdmax_ = listener_; // so far, it's this one
+  if (loop_ != LoopIoUring) {
+    // the workers hand the replies back to the loop and wake it up
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd_ == -1) {
+      perror("eventfd");
+      return -1;
+    }
+  }
+
+  if (loop_ == LoopEpoll || loop_ == LoopCoroutine) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ == -1) {
+      perror("epoll_create1");
+      printf("Falling back to select\n");
+      loop_ = LoopSelect;
+    } else {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof ev);
+      ev.events = EPOLLIN | EPOLLET;
+      ev.data.u64 = LISTENER_ID;
+      if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listener_, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+      }
+      ev.data.u64 = WAKE_ID;
+      if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+      }
+      ev.data.u64 = UNIX_LISTENER_ID;
+      if (unix_listener_ >= 0 &&
+          epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, unix_listener_, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+      }
+    }
+  }
 
   return 0;
 }
 
+int CacheServer::LocalPort() const {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof addr;
+  if (getsockname(listener_, (struct sockaddr *) &addr, &len) < 0) {
+    return -1;
+  }
+  if (addr.ss_family == AF_INET6) {
+    return ntohs(((struct sockaddr_in6 *) &addr)->sin6_port);
+  }
+  return ntohs(((struct sockaddr_in *) &addr)->sin_port);
+}
+
+/* Creates the unix domain socket listener. A socket file left at the
+ * path by an earlier run is removed first
+ * @return: 0 on success, -1 on failure
+ */
+int CacheServer::InitUnixSocket() {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (unix_path_.length() >= sizeof addr.sun_path) {
+    fprintf(stderr, "unix socket path %s is too long\n", unix_path_.c_str());
+    return -1;
+  }
+  strcpy(addr.sun_path, unix_path_.c_str());
+
+  unix_listener_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (unix_listener_ < 0) {
+    perror("socket");
+    return -1;
+  }
+  struct stat st;
+  if (lstat(unix_path_.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(unix_path_.c_str());
+  }
+  if (bind(unix_listener_, (const struct sockaddr *)&addr, sizeof addr) < 0) {
+    perror("bind");
+    return -1;
+  }
+  if (chmod(unix_path_.c_str(), unix_mode_) < 0) {
+    perror("chmod");
+    return -1;
+  }
+  if (listen(unix_listener_, SOMAXCONN) == -1) {
+    perror("listen");
+    return -1;
+  }
+  return 0;
+}
+
+/* Waits forever for new connections and for data from the existing
+ * connections, using the event loop the server was created with
+ */
 void CacheServer::WaitForClientRequests() {
-  int newfd, i;
-  struct sockaddr_storage remoteaddr;
-  socklen_t addrlen;
-  char remoteIP[INET6_ADDRSTRLEN];
+  if (loop_ == LoopIoUring) {
+    UringLoop();
+  } else if (loop_ == LoopEpoll) {
+    EpollLoop();
+  } else if (loop_ == LoopCoroutine) {
+    CoroutineLoop();
+  } else {
+    SelectLoop();
+  }
+}
+
+/* The epoll event loop. The sockets are non-blocking and registered edge
+ * triggered, so every wakeup only returns the connections that received
+ * data or became writable, and each of them is read until recv() would
+ * block
+ */
+void CacheServer::EpollLoop() {
+  struct epoll_event events[MAX_EVENTS];
+
+  for(;;) {
+    int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      exit(4);
+    }
+
+    for (int i = 0; i < n; i++) {
+      uint64_t id = events[i].data.u64;
+      if (id == LISTENER_ID) {
+        AcceptConnections(listener_);
+        continue;
+      }
+      if (id == UNIX_LISTENER_ID) {
+        AcceptConnections(unix_listener_);
+        continue;
+      }
+      if (id == WAKE_ID) {
+        OnWake();
+        continue;
+      }
+      auto it = connections_.find(id);
+      if (it == connections_.end()) {
+        // the completions of a connection closed with sends in flight
+        if (events[i].events & EPOLLERR) {
+          ReapClosed(id);
+        }
+        continue;
+      }
+      Connection *conn = it->second.get();
+      int ret = 0;
+      if ((events[i].events & EPOLLERR) && !conn->zerocopy_pending.empty()) {
+        ReadZeroCopyCompletions(conn);
+      }
+      if (events[i].events & EPOLLOUT) {
+        ret = Flush(id, conn);
+      }
+      // a paused connection is read again once its replies drained
+      if (ret == 0 && (events[i].events & ~EPOLLOUT) && !conn->paused) {
+        ret = GetData(id, conn);
+      }
+      if (ret < 0) {
+        printf("connection from socket %d disconnected\n", conn->fd);
+        CloseConnection(id);
+      }
+    }
+  }
+}
 
+/* The select event loop, every wakeup scans all the file descriptors up
+ * to the biggest one
+ */
+void CacheServer::SelectLoop() {
   for(;;) {
-    read_fds_ = master_; // copy it
-    if (select(fdmax_+1, &read_fds_, NULL, NULL, NULL) == -1) {
+    // watch the connections that are not paused for data, and the ones
+    // with queued replies for room to send them
+    FD_ZERO(&read_fds_);
+    FD_ZERO(&write_fds_);
+    FD_SET(listener_, &read_fds_);
+    FD_SET(wake_fd_, &read_fds_);
+    int fdmax = listener_ > wake_fd_ ? listener_ : wake_fd_;
+    if (unix_listener_ >= 0) {
+      FD_SET(unix_listener_, &read_fds_);
+      fdmax = unix_listener_ > fdmax ? unix_listener_ : fdmax;
+    }
+    for (auto& entry : connections_) {
+      Connection *conn = entry.second.get();
+      // the completions of MSG_ZEROCOPY sends make the socket readable
+      if (!conn->paused || !conn->zerocopy_pending.empty()) {
+        FD_SET(conn->fd, &read_fds_);
+      }
+      if (!conn->output.empty()) {
+        FD_SET(conn->fd, &write_fds_);
+      }
+      if (conn->fd > fdmax) {
+        fdmax = conn->fd;
+      }
+    }
+
+    if (select(fdmax+1, &read_fds_, &write_fds_, NULL, NULL) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
       perror("select");
       exit(4);
     }
 
+    if (FD_ISSET(wake_fd_, &read_fds_)) {
+      OnWake();
+    }
+    if (FD_ISSET(listener_, &read_fds_)) {
+      // handle new connections
+      AcceptConnections(listener_);
+    }
+    if (unix_listener_ >= 0 && FD_ISSET(unix_listener_, &read_fds_)) {
+      AcceptConnections(unix_listener_);
+    }
+
     // run through the existing connections looking for data to read
-    for(i = 0; i <= fdmax_; i++) {
-      if (FD_ISSET(i, &read_fds_)) { // we got one!!
-        if (i == listener_) {
-          // handle new connections
-          addrlen = sizeof remoteaddr;
-				  newfd = accept(listener_, (struct sockaddr *)&remoteaddr, &addrlen);
-
-				  if (newfd == -1) {
-            perror("accept");
-          } else {
-            FD_SET(newfd, &master_); // add to master set
-            if (newfd > fdmax_) {    // keep track of the max
-              fdmax_ = newfd;
-            }
-            printf("selectserver: new connection from %s on "
-                   "socket %d\n",
-					  inet_ntop(remoteaddr.ss_family,
-					  get_in_server_addr((struct sockaddr*)&remoteaddr), remoteIP, INET6_ADDRSTRLEN), 
-                         newfd);
-          }
-        } else {
-          // printf("Got data to read from client\n");
-          if (GetData(i) < 0) {
-            printf("connection from socket %d disconnected\n", i);
-            close(i);
-            FD_CLR(i, &master_);
-          }
-        } // END handle data from client
-      } // END got new incoming connection
-    } // END looping through file descriptors
+    vector<uint64_t> closed;
+    for (auto& entry : connections_) {
+      Connection *conn = entry.second.get();
+      int ret = 0;
+      if (FD_ISSET(conn->fd, &read_fds_) && !conn->zerocopy_pending.empty()) {
+        ReadZeroCopyCompletions(conn);
+      }
+      if (FD_ISSET(conn->fd, &write_fds_)) {
+        ret = Flush(entry.first, conn);
+      }
+      if (ret == 0 && FD_ISSET(conn->fd, &read_fds_) && !conn->paused) {
+        ret = GetData(entry.first, conn);
+      }
+      if (ret < 0) {
+        printf("connection from socket %d disconnected\n", conn->fd);
+        closed.push_back(entry.first);
+      }
+    }
+    for (uint64_t id : closed) {
+      CloseConnection(id);
+    }
+
+    // the sockets of the connections closed with sends in flight are not
+    // watched, one the client reset would always be ready; their
+    // completions are read whenever the loop wakes up
+    closed.clear();
+    for (auto& entry : closing_) {
+      closed.push_back(entry.first);
+    }
+    for (uint64_t id : closed) {
+      ReapClosed(id);
+    }
+  }
+}
+
+/* Adds a connection to the connection table
+ * @param fd: the socket of the connection
+ * @return: the id of the connection, which is never reused
+ */
+uint64_t CacheServer::AddConnection(int fd) {
+  unique_ptr<Connection> conn(new Connection());
+  conn->fd = fd;
+  conn->output_bytes = 0;
+  conn->strand.reset(new ThreadPool::Strand(pool_));
+  conn->in_flight = 0;
+  conn->in_flight_bytes = 0;
+  conn->zerocopy = false;
+  conn->front_zerocopy_sends = 0;
+  conn->zerocopy_next = 0;
+  conn->paused = false;
+  conn->sending = false;
+  conn->receiving = false;
+  conn->closed = false;
+  uint64_t id = next_connection_id_++;
+  connections_[id] = move(conn);
+  return id;
+}
+
+/* Accepts the pending connections and adds them to the event loop
+ * @param listener: the TCP or the unix domain socket listener
+ */
+void CacheServer::AcceptConnections(int listener) {
+  int newfd;
+  struct sockaddr_storage remoteaddr;
+  socklen_t addrlen;
+  char remoteIP[INET6_ADDRSTRLEN];
+
+  for(;;) {
+    addrlen = sizeof remoteaddr;
+    newfd = accept4(listener, (struct sockaddr *)&remoteaddr, &addrlen, SOCK_NONBLOCK);
+    if (newfd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("accept");
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    if (loop_ == LoopSelect && newfd >= FD_SETSIZE) {
+      printf("selectserver: too many connections, closing socket %d\n", newfd);
+      close(newfd);
+      continue;
+    }
+    uint64_t id = AddConnection(newfd);
+    if (zerocopy_threshold_ > 0 && (loop_ == LoopEpoll || loop_ == LoopSelect)) {
+      // not supported by unix domain sockets
+      int yes = 1;
+      connections_[id]->zerocopy = setsockopt(newfd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof yes) == 0;
+    }
+    if (loop_ == LoopEpoll || loop_ == LoopCoroutine) {
+      // EPOLLOUT reports when a full socket has room for the queued replies
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof ev);
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.u64 = id;
+      if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, newfd, &ev) == -1) {
+        perror("epoll_ctl");
+        CloseConnection(id);
+        continue;
+      }
+    }
+    if (remoteaddr.ss_family == AF_UNIX) {
+      printf("selectserver: new connection on unix socket %d\n", newfd);
+    } else {
+      printf("selectserver: new connection from %s on "
+             "socket %d\n",
+             inet_ntop(remoteaddr.ss_family,
+             get_in_server_addr((struct sockaddr*)&remoteaddr), remoteIP, INET6_ADDRSTRLEN),
+             newfd);
+    }
+    if (loop_ == LoopCoroutine) {
+      StartCoroutine(id);
+    }
+  }
+}
+
+/* Closes a connection and drops the data it did not complete and the
+ * replies it did not receive. Replies posted later for it are dropped.
+ * If the kernel may still read the data of MSG_ZEROCOPY sends, the socket
+ * is only shut down, and the connection is kept with the replies it sent
+ * until their completions are read
+ * @param id: the id of the connection
+ */
+void CacheServer::CloseConnection(uint64_t id) {
+  auto it = connections_.find(id);
+  if (it == connections_.end()) {
+    return;
+  }
+  Connection *conn = it->second.get();
+  if (conn->front_zerocopy_sends > 0) {
+    RetireZeroCopyFront(conn);
+  }
+  if (!conn->zerocopy_pending.empty()) {
+    ReadZeroCopyCompletions(conn);
+  }
+  if (!conn->zerocopy_pending.empty()) {
+    shutdown(conn->fd, SHUT_RDWR);
+    conn->input.clear();
+    conn->output.clear();
+    closing_[id] = move(it->second);
+    connections_.erase(it);
+    return;
+  }
+  close(conn->fd);
+  connections_.erase(it);
+}
+
+/* Reads the completions of a connection closed with MSG_ZEROCOPY sends
+ * in flight, and closes its socket once they all completed
+ * @param id: the id of the connection
+ */
+void CacheServer::ReapClosed(uint64_t id) {
+  auto it = closing_.find(id);
+  if (it == closing_.end()) {
+    return;
+  }
+  ReadZeroCopyCompletions(it->second.get());
+  if (it->second->zerocopy_pending.empty()) {
+    close(it->second->fd);
+    closing_.erase(it);
   }
 }
 
@@ -128,50 +481,306 @@ void *CacheServer::get_in_server_addr(struct sockaddr *sa)
 
 /* This function received data from client and submits the
  * recieved data to threadpool from processing
- * @param: socket to receive the data from
- * @param: threadpool to submit the data for processing
- * @param: memcache object
- * @return: 0 on success, -1 on failure
+ * The socket is read until recv() would block, or until the backlog of
+ * the connection exceeds OUTPUT_LIMIT even after sending what the socket
+ * takes: a client that sends requests without reading the replies, or
+ * faster than the workers run them, is then not read any more until the
+ * backlog drained
+ * @param id: the id of the connection
+ * @param conn: the connection to receive the data from
+ * @return: 0 on success, -1 on failure or if the client disconnected
  */
-int CacheServer::GetData(int socket) {
-  char buffer[MAX_PAYLOAD_LENGTH];
-  int nbytes = 0;
-  string s;
-  
-  /*if ((nbytes = recv(socket, buffer, sizeof buffer, 0)) <= 0) {
-    printf("Received no data from socket %d\n", socket);
-    return -1;
-  }*/
-  int n;
-  while((n = recv(socket, buffer, sizeof(buffer), 0)) > 0) {
-    if(n > 0 && (nbytes + n <= MAX_PAYLOAD_LENGTH)) {
-      s.append(buffer, n);
-      nbytes += n;
-    }
-    if (n == 0 || nbytes == MAX_PAYLOAD_LENGTH) {
-      break;
+int CacheServer::GetData(uint64_t id, Connection *conn) {
+  char *buffer = recv_buffer_.data();
+  bool replied = false;
+  for(;;) {
+    if (Backlog(conn) > OUTPUT_LIMIT) {
+      if (Send(conn) < 0) {
+        return -1;
+      }
+      if (Backlog(conn) > OUTPUT_LIMIT) {
+        conn->paused = true;
+        return 0;
+      }
+    }
+    int n = recv(conn->fd, buffer, recv_buffer_.size(), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
     }
-    if (nbytes > 2 && s[nbytes - 2] == '\r' && s[nbytes - 1] == '\n') {
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
       break;
     }
+    if (n <= 0) {
+      return -1;
+    }
+    conn->input.append(buffer, n);
+    replied |= Submit(id, conn);
   }
+  // the replies of the commands that ran inline
+  return replied ? Send(conn) : 0;
+}
 
-  if(n < 0) {
-    return -1;
+/* Runs the complete commands received on a connection, or submits them
+ * to the threadpool. The rest of the data is kept until more is
+ * received, so that the commands of a pipelined batch are never split
+ * between two submissions.
+ * A small batch, such as a get or a set of a small value, costs less
+ * to run than to hand to a worker, and runs here on the loop thread,
+ * unless batches of the connection are still running on the threadpool
+ * and its reply would overtake theirs. Larger batches go through the
+ * strand of the connection, so they run one after the other and their
+ * replies keep the order of the commands. The worker posts the reply
+ * back to the event loop, an empty one for commands without a reply,
+ * so that the loop knows when the connection has no batch in flight.
+ * The cost of a batch is mostly the payloads it copies: a storage command
+ * copies its data in the parser and again under the cache lock, while
+ * retrieval lines are short. A batch of bulk_threshold_ bytes or more, a
+ * large value or a long pipeline, goes to the bulk lane of the threadpool,
+ * so that it does not hold the workers the small requests need
+ * @param id: the id of the connection
+ * @param conn: the connection
+ * @return: true if a reply was queued on the connection
+ */
+bool CacheServer::Submit(uint64_t id, Connection *conn) {
+  string& s = conn->input;
+  size_t nbytes = CompleteCommandsLength(s, s.length());
+  if (nbytes == 0 && s.length() >= MAX_PAYLOAD_LENGTH) {
+    // a command cannot be this long, let the parser report the error
+    nbytes = s.length();
   }
-
   if (nbytes == 0) {
-    return 0;
+    return false;
+  }
+  if (nbytes <= inline_limit_ && conn->in_flight == 0) {
+    unique_ptr<Response> response(new Response());
+    ProcessCommands(s.substr(0, nbytes), memcache_, (int) nbytes, response.get());
+    s.erase(0, nbytes);
+    if (response->empty()) {
+      return false;
+    }
+    conn->output_bytes += response->length();
+    conn->output.push_back(move(response));
+    return true;
+  }
+  conn->in_flight++;
+  conn->in_flight_bytes += nbytes;
+  ThreadPool::Lane lane = bulk_threshold_ > 0 && nbytes >= bulk_threshold_ ?
+                          ThreadPool::LaneBulk : ThreadPool::LaneFast;
+  // posted rather than submitted, nothing waits for a future
+  conn->strand->post(lane, [this, id, data = s.substr(0, nbytes)]() {
+    unique_ptr<Response> response(new Response());
+    ProcessCommands(data, memcache_, (int) data.length(), response.get());
+    PostReply(id, data.length(), move(response));
+  });
+  s.erase(0, nbytes);
+  return false;
+}
+
+/* Sends the queued replies of a connection until the socket is full; the
+ * rest is sent when the loop reports the socket writable again. Replies of
+ * zerocopy_threshold_ bytes or more are sent with MSG_ZEROCOPY, so the
+ * kernel reads the data of the cache entries instead of copying it
+ * @param conn: the connection
+ * @return: 0 on success, -1 if the connection failed
+ */
+int CacheServer::Send(Connection *conn) {
+  struct iovec iov[IOV_PER_SEND];
+  while (!conn->output.empty()) {
+    Response *response = conn->output.front().get();
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = response->pendingIovec(iov, IOV_PER_SEND);
+    if (msg.msg_iovlen > 0) {
+      bool zerocopy = conn->zerocopy && response->length() >= zerocopy_threshold_;
+      ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+      if (sent < 0 && zerocopy && errno == ENOBUFS) {
+        // too many sends wait for their completion, copy this one
+        sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        zerocopy = false;
+      }
+      if (sent < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return 0;
+        }
+        return -1;
+      }
+      if (zerocopy) {
+        conn->zerocopy_next++;
+        conn->front_zerocopy_sends++;
+      }
+      conn->output_bytes -= sent;
+      if (!response->consume(sent)) {
+        continue;
+      }
+    }
+    if (conn->front_zerocopy_sends > 0) {
+      RetireZeroCopyFront(conn);
+    }
+    conn->output.pop_front();
+  }
+  return 0;
+}
+
+/* Moves output.front(), which was sent with MSG_ZEROCOPY in part or in
+ * full, to the replies kept until their sends complete. Its sends are the
+ * last ones of the connection, and are numbered one after the other
+ * @param conn: the connection
+ */
+void CacheServer::RetireZeroCopyFront(Connection *conn) {
+  uint32_t sends = conn->front_zerocopy_sends;
+  conn->zerocopy_pending.push_back({conn->zerocopy_next - sends, conn->zerocopy_next - 1, sends,
+                                    move(conn->output.front())});
+  conn->front_zerocopy_sends = 0;
+}
+
+/* Reads the completions of the MSG_ZEROCOPY sends from the error queue of
+ * the socket, and releases the replies whose sends all completed. If the
+ * kernel had to copy the data anyway, as it does over loopback, later
+ * replies of the connection are sent the usual way
+ * @param conn: the connection
+ */
+void CacheServer::ReadZeroCopyCompletions(Connection *conn) {
+  for (;;) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      return;
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cm);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        // the kernel copied the data of these sends after all, as it does
+        // over loopback. They complete like the others, and the later
+        // replies are copied by sendmsg without waiting for completions
+        conn->zerocopy = false;
+      }
+      // the sends from ee_info to ee_data completed. A range usually
+      // follows the one before, but the kernel does not promise it, and
+      // the numbers wrap around. The sends in flight are much less than
+      // 2^31 apart, so their distance to ee_info fits an int32_t
+      uint32_t from = err->ee_info;
+      int64_t span = (uint32_t) (err->ee_data - from);
+      for (auto& reply : conn->zerocopy_pending) {
+        int64_t first = (int32_t) (reply.first - from);
+        int64_t last = (int32_t) (reply.last - from);
+        first = first > 0 ? first : 0;
+        last = last < span ? last : span;
+        if (first <= last) {
+          reply.remaining -= (uint32_t) (last - first + 1);
+        }
+      }
+    }
+    for (auto it = conn->zerocopy_pending.begin(); it != conn->zerocopy_pending.end();) {
+      if (it->remaining == 0) {
+        it = conn->zerocopy_pending.erase(it);
+      } else {
+        ++it;
+      }
+    }
   }
+}
 
-  //buffer[nbytes] = '\0'; 
-  //string s(buffer, MAX_PAYLOAD_LENGTH);
-  //s = buffer;
-  // printf("Received data '%s' sending to threadpool\n", s.c_str());
-  printf("Received total = %d bytes\n", nbytes);
-  pool_->submit(ParseDataFromClient, s, socket, memcache_, nbytes);
+/* Sends the queued replies of a connection, and resumes reading once the
+ * backlog of a paused connection drained below OUTPUT_RESUME
+ * @param id: the id of the connection
+ * @param conn: the connection
+ * @return: 0 on success, -1 if the connection failed
+ */
+int CacheServer::Flush(uint64_t id, Connection *conn) {
+  if (Send(conn) < 0) {
+    return -1;
+  }
+  if (conn->paused && Backlog(conn) < OUTPUT_RESUME) {
+    conn->paused = false;
+    // an edge triggered socket does not report the data that arrived
+    // while it was paused again
+    return GetData(id, conn);
+  }
   return 0;
 }
 
+/* Queues the replies the workers posted since the last wakeup, and sends
+ * them
+ */
+void CacheServer::OnWake() {
+  uint64_t value;
+  if (read(wake_fd_, &value, sizeof value) < 0 && errno != EAGAIN) {
+    perror("eventfd read");
+  }
+  vector<Reply> replies;
+  {
+    lock_guard<mutex> lock(outbox_mutex_);
+    replies.swap(outbox_);
+  }
+  vector<uint64_t> ready;
+  for (auto& reply : replies) {
+    auto it = connections_.find(reply.id);
+    if (it == connections_.end()) {
+      continue;
+    }
+    Connection *conn = it->second.get();
+    conn->in_flight--;
+    conn->in_flight_bytes -= reply.batch_bytes;
+    if (!reply.response->empty()) {
+      conn->output_bytes += reply.response->length();
+      conn->output.push_back(move(reply.response));
+    } else if (!conn->paused) {
+      continue;
+    }
+    // a paused connection may resume without a reply to send
+    ready.push_back(reply.id);
+  }
+  // the replies of a connection are sent together
+  for (uint64_t id : ready) {
+    auto it = connections_.find(id);
+    if (it != connections_.end() && Flush(id, it->second.get()) < 0) {
+      printf("connection from socket %d disconnected\n", it->second->fd);
+      CloseConnection(id);
+    }
+  }
+}
 
+/* Called by the workers to hand a reply to the loop, which is woken up
+ * when the outbox was empty
+ * @param id: the connection id
+ * @param batch_bytes: the size of the batch the reply answers
+ * @param response: the reply
+ */
+void CacheServer::PostReply(uint64_t id, size_t batch_bytes, unique_ptr<Response> response) {
+  bool wake;
+  {
+    lock_guard<mutex> lock(outbox_mutex_);
+    wake = outbox_.empty();
+    outbox_.push_back(Reply{id, batch_bytes, move(response)});
+  }
+  if (wake) {
+    uint64_t one = 1;
+    if (write(wake_fd_, &one, sizeof one) < 0) {
+      perror("eventfd write");
+    }
+  }
+}
 
+/* The bytes a connection holds in the server: its replies that were not
+ * sent, and the requests of its batches on the threadpool, whose replies
+ * are not known yet
+ * @param conn: the connection
+ * @return: the bytes
+ */
+size_t CacheServer::Backlog(const Connection *conn) {
+  return conn->output_bytes + conn->in_flight_bytes;
+}
@@ -2,30 +2,227 @@
 #define memserver_h
 
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include "memcache.h"
 #include "Threadpool.h"
+#include "uring.h"
 using namespace std;
 
+#define MAX_EVENTS 256 // events returned by one epoll_wait
+#define URING_ENTRIES 1024 // size of the io_uring submission queue
+#define URING_BUFFERS 1024 // number of provided receive buffers
+#define URING_BUFFER_SIZE (16 * 1024) // size of each receive buffer
+#define IOV_PER_SEND 64 // segments of a reply sent by one request
+#define INLINE_LIMIT 512 // batches of commands up to this many bytes run on
+                         // the event loop thread instead of the threadpool
+#define BULK_THRESHOLD (16 * 1024) // batches of this many bytes or more go
+                                  // to the bulk lane of the threadpool
+#define ZEROCOPY_THRESHOLD (64 * 1024) // replies of this many bytes or more are
+                                      // sent with MSG_ZEROCOPY
+#define OUTPUT_LIMIT (4 * 1024 * 1024) // reply bytes queued on a connection,
+                                       // and request bytes of its batches on
+                                       // the threadpool, before reading from
+                                       // it pauses
+#define OUTPUT_RESUME (OUTPUT_LIMIT / 2) // reading resumes once both drained
+                                         // below this
+
+// the event loop the server uses to wait for client requests
+enum ServerLoop {
+  LoopEpoll, // edge triggered epoll, the cost of a wakeup only depends
+             // on the number of ready connections
+  LoopSelect, // select, limited to FD_SETSIZE file descriptors
+  LoopIoUring, // io_uring with multishot accept and receive, replies are
+               // sent by the event loop, falls back to epoll if io_uring
+               // is not available
+  LoopCoroutine // edge triggered epoll with every connection a coroutine,
+                // needs the MEMCACHE_COROUTINES (C++20) build, falls back
+                // to epoll without it
+};
+
+/*
+ * A reactor: one event loop with its own listener socket. With
+ * SetReusePort the listener is bound with SO_REUSEPORT, so several servers
+ * started on the same port, each waiting for client requests in its own
+ * thread, share the incoming connections and spread the network I/O over
+ * several cores. Without it a port that is in use fails init
+ */
 class CacheServer {
  public:
   CacheServer() {
-  } 
-  CacheServer(string port, ThreadPool* pool, Cache* memcache) {
+  }
+  CacheServer(string port, ThreadPool* pool, Cache* memcache, ServerLoop loop = LoopEpoll) {
     port_ = port;
     pool_ = pool;
     memcache_ = memcache;
+    loop_ = loop;
+    next_connection_id_ = FIRST_CONNECTION_ID;
+    wake_fd_ = -1;
+    inline_limit_ = INLINE_LIMIT;
+    bulk_threshold_ = BULK_THRESHOLD;
+    unix_listener_ = -1;
+    unix_mode_ = 0700;
+    zerocopy_threshold_ = ZEROCOPY_THRESHOLD;
+    uring_entries_ = URING_ENTRIES;
+    coroutines_ = nullptr;
+    reuse_port_ = false;
   }
   int init();
+  // batches of commands up to this many bytes run on the event loop
+  // thread, 0 sends every batch to the threadpool
+  void SetInlineLimit(size_t bytes) { inline_limit_ = bytes; }
+  // batches of this many bytes or more run in the bulk lane of the
+  // threadpool, 0 puts every batch in the fast lane
+  void SetBulkThreshold(size_t bytes) { bulk_threshold_ = bytes; }
+  // binds the listener with SO_REUSEPORT, for several servers that share
+  // the port; called before init
+  void SetReusePort(bool reuse_port) { reuse_port_ = reuse_port; }
+  // the size of the io_uring submission queue; called before init
+  void SetUringEntries(unsigned entries) { uring_entries_ = entries; }
+  // replies of this many bytes or more are sent with MSG_ZEROCOPY by the
+  // epoll and select loops, 0 never
+  void SetZeroCopyThreshold(size_t bytes) { zerocopy_threshold_ = bytes; }
+  // also listens on a unix domain socket at path, created with the
+  // permissions in mode, for clients on the same host; called before init
+  void SetUnixSocket(const string& path, mode_t mode) {
+    unix_path_ = path;
+    unix_mode_ = mode;
+  }
   void WaitForClientRequests();
+  // the event loop in use, after the fallbacks of init
+  ServerLoop loop() const { return loop_; }
+  // the port the listener is bound to, the one the kernel picked for
+  // port "0"
+  int LocalPort() const;
  private:
   void *get_in_server_addr(struct sockaddr *sa);
-  int GetData(int socket);
-  fd_set master_;
+
+  // ids of the listener and of the eventfd in the epoll loop, the
+  // connections are numbered after them
+  enum { LISTENER_ID = 0, WAKE_ID = 1, UNIX_LISTENER_ID = 2, FIRST_CONNECTION_ID = 3 };
+
+  // a client connection. The workers post their replies back to the
+  // event loop, which queues them here and sends them when the socket is
+  // writable, so a worker never waits for a slow client
+  struct Connection {
+    int fd;
+    string input; // data that does not form a complete command yet
+    deque<unique_ptr<Response>> output; // replies waiting to be sent
+    size_t output_bytes; // bytes of the queued replies that were not sent
+    // runs the commands of the connection in order on the threadpool
+    unique_ptr<ThreadPool::Strand> strand;
+    // batches submitted to the threadpool whose reply the loop did not
+    // get yet, the commands only run inline while there are none
+    int in_flight;
+    size_t in_flight_bytes; // the request bytes of those batches
+    bool paused; // reading stopped until the queued replies drain
+    // MSG_ZEROCOPY: the kernel reads the data of a reply after sendmsg
+    // returned, so the reply, and with it the cache entries it references,
+    // is kept until the completions of all its sends are read from the
+    // error queue, even after the connection closed
+    bool zerocopy; // SO_ZEROCOPY is set, and the kernel did not copy
+    uint32_t front_zerocopy_sends; // MSG_ZEROCOPY sends of output.front()
+    uint32_t zerocopy_next; // the number of the next MSG_ZEROCOPY send,
+                            // it wraps around like the kernel's counter
+    // a sent reply, the numbers of its MSG_ZEROCOPY sends, from first to
+    // last, and how many of them did not complete yet
+    struct ZeroCopyReply {
+      uint32_t first;
+      uint32_t last;
+      uint32_t remaining;
+      unique_ptr<Response> response;
+    };
+    deque<ZeroCopyReply> zerocopy_pending;
+    // io_uring loop
+    struct msghdr msg; // the send in flight
+    struct iovec iov[IOV_PER_SEND];
+    bool sending; // a send is in flight
+    bool receiving; // a receive is armed
+    bool closed; // the client disconnected, or a send failed
+  };
+  uint64_t AddConnection(int fd);
+  void SelectLoop();
+  void EpollLoop();
+  int InitUnixSocket();
+  void AcceptConnections(int listener);
+  void CloseConnection(uint64_t id);
+  int GetData(uint64_t id, Connection *conn);
+  bool Submit(uint64_t id, Connection *conn);
+  int Send(Connection *conn);
+  void ReadZeroCopyCompletions(Connection *conn);
+  void RetireZeroCopyFront(Connection *conn);
+  void ReapClosed(uint64_t id);
+  int Flush(uint64_t id, Connection *conn);
+  void OnWake();
+  void PostReply(uint64_t id, size_t batch_bytes, unique_ptr<Response> response);
+  static size_t Backlog(const Connection *conn);
+
+  int InitUring();
+  void UringLoop();
+  void UringAccept(uint64_t id);
+  void UringRecv(uint64_t id);
+  void UringPause(uint64_t id, Connection *conn);
+  void UringResume(uint64_t id, Connection *conn);
+  void UringCancelRecv(uint64_t id);
+  void UringSend(uint64_t id, Connection *conn);
+  void UringWake();
+  struct io_uring_sqe *UringSqe(uint64_t user_data);
+  void UringRetry();
+  void UringRelease(uint64_t id, Connection *conn);
+  void OnUringRecv(uint64_t id, struct io_uring_cqe *cqe);
+  void OnUringSend(uint64_t id, struct io_uring_cqe *cqe);
+  void OnUringWake();
+
+  // the coroutine loop, in memserver_coro.cpp
+  class Coroutines;
+  Coroutines *coroutines_;
+  int InitCoroutines();
+  void CoroutineLoop();
+  void StartCoroutine(uint64_t id);
+
   fd_set read_fds_;
-  int fdmax_;
+  fd_set write_fds_;
+  int epoll_fd_;
+  ServerLoop loop_;
   string port_;
   int listener_;
+  bool reuse_port_; // the listener shares the port with other servers
+  string unix_path_; // the path of the unix domain socket, empty if none
+  mode_t unix_mode_; // the permissions of the unix domain socket
+  size_t zerocopy_threshold_; // the smallest reply sent with MSG_ZEROCOPY
+  int unix_listener_;
   ThreadPool *pool_;
-  Cache *memcache_; 
+  Cache *memcache_;
+  unordered_map<uint64_t, unique_ptr<Connection>> connections_;
+  // closed connections whose MSG_ZEROCOPY sends did not all complete, kept
+  // with their socket open until the kernel reported them
+  unordered_map<uint64_t, unique_ptr<Connection>> closing_;
+  uint64_t next_connection_id_;
+  int wake_fd_; // eventfd the workers write to when replies are ready
+  // the receive buffer of the loop thread, on the heap so that -k can
+  // give the reactor a small stack; the coroutines of the loop share it
+  vector<char> recv_buffer_;
+  size_t inline_limit_; // the largest batch that runs on the loop thread
+  size_t bulk_threshold_; // the smallest batch that runs in the bulk lane
+  // io_uring loop
+  unique_ptr<IoUring> ring_;
+  unsigned uring_entries_;
+  // the user_data of the requests that found the submission queue full,
+  // prepared again once the loop submitted it
+  vector<uint64_t> uring_retry_;
+  uint64_t wake_value_;
+  // a reply a worker posts back to the loop, with the size of the batch
+  // it answers
+  struct Reply {
+    uint64_t id;
+    size_t batch_bytes;
+    unique_ptr<Response> response;
+  };
+  mutex outbox_mutex_; // protects outbox_
+  vector<Reply> outbox_; // replies from workers
 };
 #endif
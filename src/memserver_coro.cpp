@@ -0,0 +1,338 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "memserver.h"
+
+using namespace std;
+
+/*
+ * The coroutine event loop. Every connection is a coroutine that reads,
+ * runs and replies in a plain loop, and suspends where the epoll loop
+ * would return to wait for the next event: on a socket that has no data
+ * or no room, and on a batch that runs on the threadpool. A partial
+ * command is just read again, a pipelined batch is one reply, and a
+ * client that does not read its replies is not read either, since the
+ * coroutine only reads once it sent everything. The loop resumes a
+ * coroutine when epoll reports the event it waits for, or when a worker
+ * finished its batch. The frames of the coroutines come from free lists
+ * of the loop thread, and a connection reuses its batch and its reply,
+ * so a request allocates nothing once the connection served a few
+ */
+
+#ifdef MEMCACHE_COROUTINES
+
+#include <coroutine>
+#include <exception>
+
+#define FRAME_CLASS_SIZE 64 // coroutine frames are pooled in size classes
+                            // of this many bytes
+#define FRAME_POOL_LIMIT 4096 // larger frames come from the heap
+
+// Per-thread free lists of coroutine frames. A frame is allocated and
+// freed by the loop thread, the only thread that resumes the coroutines
+// of its connections, so the lists need no lock. The frames are kept for
+// the next connections rather than given back to the heap
+class FramePool {
+ public:
+  static void *allocate(size_t size) {
+    if (size > FRAME_POOL_LIMIT) {
+      return ::operator new(size);
+    }
+    FreeFrame *&head = free_[(size - 1) / FRAME_CLASS_SIZE];
+    if (head == nullptr) {
+      return ::operator new((size + FRAME_CLASS_SIZE - 1) / FRAME_CLASS_SIZE * FRAME_CLASS_SIZE);
+    }
+    FreeFrame *frame = head;
+    head = frame->next;
+    return frame;
+  }
+
+  static void release(void *frame, size_t size) {
+    if (size > FRAME_POOL_LIMIT) {
+      ::operator delete(frame);
+      return;
+    }
+    FreeFrame *&head = free_[(size - 1) / FRAME_CLASS_SIZE];
+    FreeFrame *free_frame = static_cast<FreeFrame *>(frame);
+    free_frame->next = head;
+    head = free_frame;
+  }
+
+ private:
+  struct FreeFrame {
+    FreeFrame *next;
+  };
+  static thread_local FreeFrame *free_[FRAME_POOL_LIMIT / FRAME_CLASS_SIZE];
+};
+
+thread_local FramePool::FreeFrame *FramePool::free_[FRAME_POOL_LIMIT / FRAME_CLASS_SIZE];
+
+// A coroutine that starts at once and frees its frame when it returns,
+// nothing waits for it
+struct Coroutine {
+  struct promise_type {
+    Coroutine get_return_object() { return Coroutine(); }
+    suspend_never initial_suspend() noexcept { return {}; }
+    suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { terminate(); }
+    static void *operator new(size_t size) { return FramePool::allocate(size); }
+    static void operator delete(void *frame, size_t size) { FramePool::release(frame, size); }
+  };
+};
+
+// only used between two suspensions of a coroutine, so the coroutines of
+// a loop share it
+static thread_local struct iovec send_iov[IOV_PER_SEND];
+
+class CacheServer::Coroutines {
+ public:
+  explicit Coroutines(CacheServer *server) : server_(server) {
+  }
+
+  Coroutine Serve(uint64_t id, Connection *conn);
+
+  /* Resumes the coroutine of a connection if it waits for one of the
+   * events; an error or a hangup resumes it whatever it waits for, and
+   * the socket call it retries fails
+   * @param id: the id of the connection
+   * @param events: the events epoll reported
+   */
+  void Dispatch(uint64_t id, uint32_t events) {
+    auto it = waiters_.find(id);
+    if (it == waiters_.end()) {
+      return;
+    }
+    Waiter *waiter = it->second;
+    if (waiter->events == 0 ||
+        !(events & (waiter->events | EPOLLERR | EPOLLHUP))) {
+      return;
+    }
+    waiter->events = 0;
+    waiter->handle.resume();
+  }
+
+  // resumes the coroutines whose batches the workers finished
+  void OnWake() {
+    uint64_t value;
+    if (read(server_->wake_fd_, &value, sizeof value) < 0 && errno != EAGAIN) {
+      perror("eventfd read");
+    }
+    {
+      lock_guard<mutex> lock(ready_mutex_);
+      resuming_.swap(ready_);
+    }
+    for (coroutine_handle<> handle : resuming_) {
+      handle.resume();
+    }
+    resuming_.clear();
+  }
+
+ private:
+  // the socket events a suspended coroutine waits for, 0 if it does not
+  // wait for the socket
+  struct Waiter {
+    coroutine_handle<> handle;
+    uint32_t events;
+  };
+
+  // suspends until the socket reports one of the events
+  struct Readiness {
+    Waiter *waiter;
+    uint32_t events;
+    bool await_ready() { return false; }
+    void await_suspend(coroutine_handle<> handle) {
+      waiter->handle = handle;
+      waiter->events = events;
+    }
+    void await_resume() {}
+  };
+
+  // suspends while a worker runs the batch, the coroutine is resumed by
+  // the loop thread
+  struct Offload {
+    Coroutines *coroutines;
+    ThreadPool::Lane lane;
+    const string *batch;
+    Response *response;
+    bool await_ready() { return false; }
+    void await_suspend(coroutine_handle<> handle) {
+      Coroutines *self = coroutines;
+      const string *data = batch;
+      Response *reply = response;
+      self->server_->pool_->post(lane, [self, handle, data, reply]() {
+        ProcessCommands(*data, self->server_->memcache_, (int) data->length(), reply);
+        self->Ready(handle);
+      });
+    }
+    void await_resume() {}
+  };
+
+  /* Called by the workers to hand a coroutine back to the loop, which is
+   * woken up when no other coroutine was ready
+   * @param handle: the coroutine
+   */
+  void Ready(coroutine_handle<> handle) {
+    bool wake;
+    {
+      lock_guard<mutex> lock(ready_mutex_);
+      wake = ready_.empty();
+      ready_.push_back(handle);
+    }
+    if (wake) {
+      uint64_t one = 1;
+      if (write(server_->wake_fd_, &one, sizeof one) < 0) {
+        perror("eventfd write");
+      }
+    }
+  }
+
+  CacheServer *server_;
+  unordered_map<uint64_t, Waiter *> waiters_; // the waiter of every connection
+  mutex ready_mutex_; // protects ready_
+  vector<coroutine_handle<>> ready_; // coroutines whose batch finished
+  vector<coroutine_handle<>> resuming_; // the ones the loop resumes now
+};
+
+/* Serves a connection until the client disconnects. The complete
+ * commands of what was received run as one batch, on the loop thread up
+ * to inline_limit_ bytes and in the lane of the threadpool that fits
+ * their size otherwise, like in the epoll loop; there is no strand, the
+ * coroutine waits for a batch before it reads the next one
+ * @param id: the id of the connection
+ * @param conn: the connection
+ */
+Coroutine CacheServer::Coroutines::Serve(uint64_t id, Connection *conn) {
+  Waiter waiter = {nullptr, 0};
+  waiters_[id] = &waiter;
+  string batch;
+  Response response;
+  bool connected = true;
+  while (connected) {
+    char *buffer = server_->recv_buffer_.data();
+    ssize_t n = recv(conn->fd, buffer, server_->recv_buffer_.size(), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      co_await Readiness{&waiter, EPOLLIN | EPOLLRDHUP};
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    string& s = conn->input;
+    s.append(buffer, n);
+    size_t nbytes = CompleteCommandsLength(s, s.length());
+    if (nbytes == 0 && s.length() >= MAX_PAYLOAD_LENGTH) {
+      // a command cannot be this long, let the parser report the error
+      nbytes = s.length();
+    }
+    if (nbytes == 0) {
+      continue;
+    }
+    batch.assign(s, 0, nbytes);
+    s.erase(0, nbytes);
+    response.clear();
+    if (nbytes <= server_->inline_limit_) {
+      ProcessCommands(batch, server_->memcache_, (int) nbytes, &response);
+    } else {
+      ThreadPool::Lane lane = server_->bulk_threshold_ > 0 && nbytes >= server_->bulk_threshold_ ?
+                              ThreadPool::LaneBulk : ThreadPool::LaneFast;
+      co_await Offload{this, lane, &batch, &response};
+    }
+
+    bool sent_all = response.empty();
+    while (!sent_all) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof msg);
+      msg.msg_iov = send_iov;
+      msg.msg_iovlen = response.pendingIovec(send_iov, IOV_PER_SEND);
+      ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR) {
+        continue;
+      }
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        co_await Readiness{&waiter, EPOLLOUT};
+        continue;
+      }
+      if (sent < 0) {
+        connected = false;
+        break;
+      }
+      sent_all = response.consume(sent);
+    }
+  }
+  waiters_.erase(id);
+  printf("connection from socket %d disconnected\n", conn->fd);
+  server_->CloseConnection(id);
+}
+
+/* Creates the state the coroutines of the connections share
+ * @return: 0
+ */
+int CacheServer::InitCoroutines() {
+  coroutines_ = new Coroutines(this);
+  return 0;
+}
+
+/* Starts the coroutine of a connection that was just accepted, it runs
+ * until it waits for the first time
+ * @param id: the id of the connection
+ */
+void CacheServer::StartCoroutine(uint64_t id) {
+  coroutines_->Serve(id, connections_[id].get());
+}
+
+/* The event loop of the coroutines. The sockets are registered edge
+ * triggered; a coroutine only waits for an event after a socket call
+ * would block, so it never misses the edge it waits for
+ */
+void CacheServer::CoroutineLoop() {
+  struct epoll_event events[MAX_EVENTS];
+
+  for(;;) {
+    int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      exit(4);
+    }
+
+    for (int i = 0; i < n; i++) {
+      uint64_t id = events[i].data.u64;
+      if (id == LISTENER_ID) {
+        AcceptConnections(listener_);
+      } else if (id == UNIX_LISTENER_ID) {
+        AcceptConnections(unix_listener_);
+      } else if (id == WAKE_ID) {
+        coroutines_->OnWake();
+      } else {
+        coroutines_->Dispatch(id, events[i].events);
+      }
+    }
+  }
+}
+
+#else
+
+/* The coroutine loop needs C++20, the server falls back to epoll
+ * @return: -1
+ */
+int CacheServer::InitCoroutines() {
+  fprintf(stderr, "the coroutine loop needs a build with MEMCACHE_COROUTINES\n");
+  return -1;
+}
+
+void CacheServer::StartCoroutine(uint64_t id) {
+}
+
+void CacheServer::CoroutineLoop() {
+}
+
+#endif
@@ -0,0 +1,377 @@
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "memserver.h"
+
+using namespace std;
+
+/*
+ * The io_uring event loop. A multishot accept adds the connections and a
+ * multishot receive per connection fills buffers taken from a ring of
+ * provided buffers, so idle connections do not hold any buffer and a
+ * request costs no system call of its own. The workers hand their replies
+ * back to the loop, which sends them with requests that are submitted
+ * together with everything else at the next io_uring_enter
+ */
+
+#define URING_BUFFER_GROUP 0
+
+// the operation of a request is kept in the top byte of its user_data,
+// the connection id in the rest
+enum UringOp {
+  OpAccept = 1,
+  OpRecv,
+  OpSend,
+  OpWake,
+  OpCancel
+};
+
+static inline uint64_t user_data(UringOp op, uint64_t id) {
+  return ((uint64_t) op << 56) | id;
+}
+
+/* Sets up the ring, the provided buffers and the eventfd the workers use
+ * to wake up the loop
+ * @return: 0 on success, -1 if io_uring is not available
+ */
+int CacheServer::InitUring() {
+  ring_.reset(new IoUring());
+  int ret = ring_->init(uring_entries_);
+  if (ret == 0) {
+    ret = ring_->registerBuffers(URING_BUFFER_GROUP, URING_BUFFERS, URING_BUFFER_SIZE);
+  }
+  if (ret < 0) {
+    printf("io_uring is not available: %s\n", strerror(-ret));
+    ring_.reset();
+    return -1;
+  }
+  wake_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (wake_fd_ == -1) {
+    perror("eventfd");
+    ring_.reset();
+    return -1;
+  }
+  return 0;
+}
+
+void CacheServer::UringLoop() {
+  UringAccept(LISTENER_ID);
+  if (unix_listener_ >= 0) {
+    UringAccept(UNIX_LISTENER_ID);
+  }
+  UringWake();
+  for(;;) {
+    // submits the requests queued by the previous completions, and waits,
+    // unless requests wait for room in the submission queue
+    int ret = ring_->submitAndWait(uring_retry_.empty() ? 1 : 0);
+    if (ret < 0 && ret != -EBUSY) {
+      printf("io_uring_enter: %s\n", strerror(-ret));
+      exit(4);
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = ring_->peekCqe()) != nullptr) {
+      UringOp op = (UringOp) (cqe->user_data >> 56);
+      uint64_t id = cqe->user_data & ((1ULL << 56) - 1);
+      if (op == OpAccept) {
+        if (cqe->res >= 0) {
+          UringRecv(AddConnection(cqe->res));
+        } else if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+          printf("accept: %s\n", strerror(-cqe->res));
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+          UringAccept(id);
+        }
+      } else if (op == OpRecv) {
+        OnUringRecv(id, cqe);
+      } else if (op == OpSend) {
+        OnUringSend(id, cqe);
+      } else if (op == OpWake) {
+        OnUringWake();
+      }
+      // nothing to do when a cancel completes, the receive it stopped
+      // completes too
+      ring_->cqeSeen();
+    }
+    UringRetry();
+  }
+}
+
+/* Takes a submission queue entry for a request. If the queue is full the
+ * request is prepared again by UringRetry after the loop submitted it
+ * @param data: the user_data of the request
+ * @return: the entry with its user_data set, nullptr if the queue is full
+ */
+struct io_uring_sqe *CacheServer::UringSqe(uint64_t data) {
+  struct io_uring_sqe *sqe = ring_->getSqe();
+  if (sqe == nullptr) {
+    uring_retry_.push_back(data);
+    return nullptr;
+  }
+  sqe->user_data = data;
+  return sqe;
+}
+
+/* Prepares again the requests that found the submission queue full. The
+ * state of their connection may have changed meanwhile: a connection
+ * that was closed or paused is not read, and one that was released is
+ * skipped
+ */
+void CacheServer::UringRetry() {
+  vector<uint64_t> retry;
+  retry.swap(uring_retry_);
+  for (uint64_t data : retry) {
+    UringOp op = (UringOp) (data >> 56);
+    uint64_t id = data & ((1ULL << 56) - 1);
+    if (op == OpAccept) {
+      UringAccept(id);
+      continue;
+    }
+    if (op == OpWake) {
+      UringWake();
+      continue;
+    }
+    auto it = connections_.find(id);
+    if (it == connections_.end()) {
+      continue;
+    }
+    Connection *conn = it->second.get();
+    if (op == OpRecv) {
+      conn->receiving = false;
+      if (!conn->paused && !conn->closed) {
+        UringRecv(id);
+      }
+    } else if (op == OpCancel) {
+      if (conn->receiving) {
+        UringCancelRecv(id);
+      }
+    } else if (op == OpSend) {
+      conn->sending = false;
+      if (conn->closed) {
+        UringRelease(id, conn);
+      } else if (!conn->output.empty()) {
+        UringSend(id, conn);
+      }
+    }
+  }
+}
+
+/* Arms the multishot accept of a listener
+ * @param id: LISTENER_ID or UNIX_LISTENER_ID
+ */
+void CacheServer::UringAccept(uint64_t id) {
+  struct io_uring_sqe *sqe = UringSqe(user_data(OpAccept, id));
+  if (sqe == nullptr) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = id == UNIX_LISTENER_ID ? unix_listener_ : listener_;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+void CacheServer::UringRecv(uint64_t id) {
+  Connection *conn = connections_[id].get();
+  conn->receiving = true;
+  struct io_uring_sqe *sqe = UringSqe(user_data(OpRecv, id));
+  if (sqe == nullptr) {
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+/* Stops reading from a connection until its backlog drained
+ */
+void CacheServer::UringPause(uint64_t id, Connection *conn) {
+  if (conn->paused) {
+    return;
+  }
+  conn->paused = true;
+  if (conn->receiving) {
+    UringCancelRecv(id);
+  }
+}
+
+/* Reads from a paused connection again once its backlog drained below
+ * OUTPUT_RESUME, running the commands that waited in the input first
+ */
+void CacheServer::UringResume(uint64_t id, Connection *conn) {
+  if (!conn->paused || conn->closed || Backlog(conn) >= OUTPUT_RESUME) {
+    return;
+  }
+  conn->paused = false;
+  if (Submit(id, conn) && !conn->sending) {
+    UringSend(id, conn);
+  }
+  if (Backlog(conn) > OUTPUT_LIMIT) {
+    UringPause(id, conn);
+  } else if (!conn->receiving) {
+    UringRecv(id);
+  }
+}
+
+/* Stops the multishot receive of a connection that is paused
+ */
+void CacheServer::UringCancelRecv(uint64_t id) {
+  struct io_uring_sqe *sqe = UringSqe(user_data(OpCancel, id));
+  if (sqe == nullptr) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = user_data(OpRecv, id);
+}
+
+/* Sends the next part of the first queued reply of a connection
+ */
+void CacheServer::UringSend(uint64_t id, Connection *conn) {
+  conn->sending = true;
+  memset(&conn->msg, 0, sizeof conn->msg);
+  conn->msg.msg_iov = conn->iov;
+  conn->msg.msg_iovlen = conn->output.front()->pendingIovec(conn->iov, IOV_PER_SEND);
+  struct io_uring_sqe *sqe = UringSqe(user_data(OpSend, id));
+  if (sqe == nullptr) {
+    return;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->fd;
+  sqe->addr = reinterpret_cast<uint64_t>(&conn->msg);
+  sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+void CacheServer::UringWake() {
+  struct io_uring_sqe *sqe = UringSqe(user_data(OpWake, 0));
+  if (sqe == nullptr) {
+    return;
+  }
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = wake_fd_;
+  sqe->addr = reinterpret_cast<uint64_t>(&wake_value_);
+  sqe->len = sizeof wake_value_;
+}
+
+/* Removes a connection once it is closed and has no request in flight
+ */
+void CacheServer::UringRelease(uint64_t id, Connection *conn) {
+  if (conn->sending) {
+    return;
+  }
+  printf("connection from socket %d disconnected\n", conn->fd);
+  close(conn->fd);
+  connections_.erase(id);
+}
+
+/* Handles received data. Complete commands run inline or are submitted
+ * to the threadpool, whose worker posts the reply back to the loop. The receive
+ * is cancelled while the backlog of the connection exceeds OUTPUT_LIMIT,
+ * and the data that arrived meanwhile waits in the input
+ */
+void CacheServer::OnUringRecv(uint64_t id, struct io_uring_cqe *cqe) {
+  auto it = connections_.find(id);
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (it != connections_.end() && cqe->res > 0) {
+      it->second->input.append(ring_->buffer(buffer_id), cqe->res);
+    }
+    ring_->recycleBuffer(buffer_id);
+  }
+  if (it == connections_.end()) {
+    return;
+  }
+  Connection *conn = it->second.get();
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  if (!more) {
+    conn->receiving = false;
+  }
+  if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+    // all buffers are in use, or the connection was paused: the receive
+    // stopped and is armed again unless the connection is paused
+    if (!conn->paused && !conn->closed) {
+      UringRecv(id);
+    }
+    return;
+  }
+  if (cqe->res <= 0) {
+    conn->closed = true;
+    UringRelease(id, conn);
+    return;
+  }
+
+  if (!conn->paused) {
+    if (Submit(id, conn) && !conn->sending) {
+      // the commands ran inline
+      UringSend(id, conn);
+    }
+    if (Backlog(conn) > OUTPUT_LIMIT) {
+      UringPause(id, conn);
+    }
+  }
+  if (!more && !conn->paused) {
+    UringRecv(id);
+  }
+}
+
+void CacheServer::OnUringSend(uint64_t id, struct io_uring_cqe *cqe) {
+  auto it = connections_.find(id);
+  if (it == connections_.end()) {
+    return;
+  }
+  Connection *conn = it->second.get();
+  conn->sending = false;
+  if (cqe->res < 0) {
+    // stop the receive too, the connection is released when it ends
+    conn->output.clear();
+    conn->closed = true;
+    shutdown(conn->fd, SHUT_RDWR);
+  } else {
+    conn->output_bytes -= cqe->res;
+    if (conn->output.front()->consume(cqe->res)) {
+      conn->output.pop_front();
+    }
+  }
+  // resuming may have run commands inline and sent their replies
+  UringResume(id, conn);
+  if (conn->output.empty()) {
+    if (conn->closed) {
+      UringRelease(id, conn);
+    }
+  } else if (!conn->sending) {
+    UringSend(id, conn);
+  }
+}
+
+/* Queues the replies the workers posted since the last wakeup, and
+ * starts sending on the connections that have no send in flight
+ */
+void CacheServer::OnUringWake() {
+  vector<Reply> replies;
+  {
+    lock_guard<mutex> lock(outbox_mutex_);
+    replies.swap(outbox_);
+  }
+  for (auto& reply : replies) {
+    auto it = connections_.find(reply.id);
+    if (it == connections_.end() || it->second->closed) {
+      continue;
+    }
+    Connection *conn = it->second.get();
+    conn->in_flight--;
+    conn->in_flight_bytes -= reply.batch_bytes;
+    if (reply.response->empty()) {
+      UringResume(reply.id, conn);
+      continue;
+    }
+    conn->output_bytes += reply.response->length();
+    conn->output.push_back(move(reply.response));
+    if (!conn->sending) {
+      UringSend(reply.id, conn);
+    }
+  }
+  UringWake();
+}
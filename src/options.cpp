@@ -0,0 +1,299 @@
+#include <getopt.h>
+#include <limits.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <utility>
+#include <vector>
+#include "options.h"
+#include "threads.h"
+
+static const struct option LONG_OPTIONS[] = {
+  {"config", required_argument, nullptr, 'f'},
+  {"port", required_argument, nullptr, 'p'},
+  {"loop", required_argument, nullptr, 'l'},
+  {"reactors", required_argument, nullptr, 'r'},
+  {"workers", required_argument, nullptr, 't'},
+  {"inline-limit", required_argument, nullptr, 'i'},
+  {"bulk-threshold", required_argument, nullptr, 'b'},
+  {"bulk-workers", required_argument, nullptr, 'B'},
+  {"zerocopy-threshold", required_argument, nullptr, 'z'},
+  {"udp-port", required_argument, nullptr, 'u'},
+  {"unix-socket", required_argument, nullptr, 'U'},
+  {"unix-mode", required_argument, nullptr, 'a'},
+  {"shards", no_argument, nullptr, 's'},
+  {"stack-size", required_argument, nullptr, 'k'},
+  {"pin", required_argument, nullptr, 'P'},
+  {"help", no_argument, nullptr, 'h'},
+  {nullptr, 0, nullptr, 0}
+};
+
+Options::Options()
+  : port(PORT), loop(LoopEpoll), reactors((int) AllowedCpus().size()), workers(WORKERS),
+    inline_limit(INLINE_LIMIT), bulk_threshold(BULK_THRESHOLD), bulk_workers(0),
+    zerocopy_threshold(ZEROCOPY_THRESHOLD), unix_mode(0700),
+    shards(false), stack_size(0), pinning(PinNone) {
+}
+
+/* Parses a whole decimal number
+ * @param value: the text
+ * @param min: the smallest valid number
+ * @param number: set to the number
+ * @return: false if value is not a number, or is less than min
+ */
+static bool ParseNumber(const string& value, long min, long *number) {
+  char *end;
+  errno = 0;
+  long n = strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0' || errno != 0 || n < min || n > INT_MAX) {
+    return false;
+  }
+  *number = n;
+  return true;
+}
+
+/* Parses a size in bytes, with an optional k or m suffix
+ * @param value: the text, such as 262144, 256k or 1m
+ * @param size: set to the size in bytes
+ * @return: false if value is not a size, or one too large for a size_t
+ */
+static bool ParseSize(const string& value, size_t *size) {
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull(value.c_str(), &end, 10);
+  if (value.empty() || end == value.c_str() || errno != 0 || value[0] == '-') {
+    return false;
+  }
+  unsigned long long multiplier = 1;
+  if (*end == 'k' || *end == 'K') {
+    multiplier = 1024;
+    end++;
+  } else if (*end == 'm' || *end == 'M') {
+    multiplier = 1024 * 1024;
+    end++;
+  }
+  if (*end != '\0' || n > SIZE_MAX / multiplier) {
+    return false;
+  }
+  n *= multiplier;
+  *size = (size_t) n;
+  return true;
+}
+
+/* Sets an option by the name it has in the config file
+ * @param options: the options
+ * @param name: the long name of the option
+ * @param value: its value
+ * @return: 0 on success, -1 if the option is unknown or the value is not
+ * valid for it
+ */
+int SetOption(Options *options, const string& name, const string& value) {
+  long n = 0;
+  bool valid = true;
+  if (name == "port") {
+    valid = ParseNumber(value, 1, &n) && n <= 65535;
+    options->port = value;
+  } else if (name == "udp-port") {
+    valid = ParseNumber(value, 1, &n) && n <= 65535;
+    options->udp_port = value;
+  } else if (name == "loop") {
+    if (value == "epoll") {
+      options->loop = LoopEpoll;
+    } else if (value == "io_uring") {
+      options->loop = LoopIoUring;
+    } else if (value == "select") {
+      options->loop = LoopSelect;
+    } else if (value == "coroutine") {
+      options->loop = LoopCoroutine;
+    } else {
+      valid = false;
+    }
+  } else if (name == "reactors") {
+    valid = ParseNumber(value, 1, &n);
+    options->reactors = (int) n;
+  } else if (name == "workers") {
+    valid = ParseNumber(value, 1, &n);
+    options->workers = (int) n;
+  } else if (name == "inline-limit") {
+    valid = ParseNumber(value, 0, &n);
+    options->inline_limit = (int) n;
+  } else if (name == "bulk-threshold") {
+    valid = ParseNumber(value, 0, &n);
+    options->bulk_threshold = (int) n;
+  } else if (name == "bulk-workers") {
+    valid = ParseNumber(value, 1, &n);
+    options->bulk_workers = (int) n;
+  } else if (name == "zerocopy-threshold") {
+    valid = ParseNumber(value, 0, &n);
+    options->zerocopy_threshold = (int) n;
+  } else if (name == "unix-socket") {
+    valid = !value.empty();
+    options->unix_path = value;
+  } else if (name == "unix-mode") {
+    char *end;
+    n = strtol(value.c_str(), &end, 8);
+    valid = !value.empty() && *end == '\0' && n >= 0 && n <= 0777;
+    options->unix_mode = (mode_t) n;
+  } else if (name == "shards") {
+    valid = value == "yes" || value == "no" || value == "true" || value == "false" ||
+            value == "1" || value == "0";
+    options->shards = value == "yes" || value == "true" || value == "1";
+  } else if (name == "stack-size") {
+    size_t size = 0;
+    valid = ParseSize(value, &size);
+    if (valid && size != 0 && size < MIN_STACK_SIZE) {
+      printf("The stack size must be at least %dk\n", MIN_STACK_SIZE / 1024);
+      valid = false;
+    }
+    options->stack_size = size;
+  } else if (name == "pin") {
+    if (value == "none") {
+      options->pinning = PinNone;
+    } else if (value == "spread") {
+      options->pinning = PinSpread;
+    } else if (value == "core") {
+      options->pinning = PinCore;
+    } else if (value == "node") {
+      options->pinning = PinNode;
+    } else {
+      valid = false;
+    }
+  } else {
+    printf("Unknown option %s\n", name.c_str());
+    return -1;
+  }
+  if (!valid) {
+    printf("Invalid value '%s' for %s\n", value.c_str(), name.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+static string Trim(const string& s) {
+  size_t first = s.find_first_not_of(" \t\r");
+  if (first == string::npos) {
+    return "";
+  }
+  size_t last = s.find_last_not_of(" \t\r");
+  return s.substr(first, last - first + 1);
+}
+
+/* Reads the options from a config file, 'name = value' on every line;
+ * blank lines and the text after a '#' are ignored
+ * @param options: the options
+ * @param path: the config file
+ * @return: 0 on success, -1 if the file cannot be read or holds an
+ * option that is not valid
+ */
+int LoadConfig(Options *options, const string& path) {
+  ifstream file(path);
+  if (!file) {
+    printf("Cannot read the config file %s\n", path.c_str());
+    return -1;
+  }
+  string line;
+  for (int number = 1; getline(file, line); number++) {
+    line = Trim(line.substr(0, line.find('#')));
+    if (line.empty()) {
+      continue;
+    }
+    size_t equals = line.find('=');
+    if (equals == string::npos) {
+      printf("%s:%d: expected 'name = value'\n", path.c_str(), number);
+      return -1;
+    }
+    if (SetOption(options, Trim(line.substr(0, equals)), Trim(line.substr(equals + 1))) < 0) {
+      printf("%s:%d: in the config file\n", path.c_str(), number);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Parses the command line. The config file given with -f is read first,
+ * wherever it is on the command line, so that the other options override
+ * the file
+ * @param options: the options
+ * @param argc: the number of arguments
+ * @param argv: the arguments
+ * @return: 0 on success, 1 if -h asked for the usage, -1 if the options
+ * are not valid
+ */
+int ParseOptions(Options *options, int argc, char *argv[]) {
+  vector<pair<string, string>> settings;
+  string config;
+  int opt;
+  int index;
+  optind = 0; // getopt starts over, the tests parse several command lines
+  opterr = 0;
+  while ((opt = getopt_long(argc, argv, "f:p:l:r:t:i:b:B:z:u:U:a:sk:P:h", LONG_OPTIONS, &index)) != -1) {
+    if (opt == 'h') {
+      return 1;
+    }
+    if (opt == '?') {
+      printf("Unknown option or missing value: %s\n", argv[optind - 1]);
+      return -1;
+    }
+    const struct option *long_option = LONG_OPTIONS;
+    while (long_option->val != opt) {
+      long_option++;
+    }
+    if (opt == 'f') {
+      config = optarg;
+    } else {
+      settings.push_back(make_pair(long_option->name, optarg != nullptr ? optarg : "yes"));
+    }
+  }
+  if (optind < argc) {
+    printf("Unexpected argument: %s\n", argv[optind]);
+    return -1;
+  }
+  if (!config.empty() && LoadConfig(options, config) < 0) {
+    return -1;
+  }
+  for (auto& setting : settings) {
+    if (SetOption(options, setting.first, setting.second) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void PrintUsage(const char *name) {
+  printf("Usage: %s [-f file] [-p port] [-l epoll|io_uring|select|coroutine] [-r reactors] [-t workers]\n"
+         "          [-i bytes] [-b bytes] [-B workers] [-z bytes] [-u port] [-U path]\n"
+         "          [-a mode] [-s] [-k size] [-P none|spread|core|node]\n", name);
+  printf("  -f, --config: read the options from this file, one 'name = value' per\n");
+  printf("      line with the long names below; the command line overrides it\n");
+  printf("  -p, --port: the TCP port, %s by default\n", PORT);
+  printf("  -l, --loop: the event loop, io_uring falls back to epoll when it is not\n");
+  printf("      available, coroutine when the server was built without it\n");
+  printf("  -r, --reactors: the number of event loop threads, one per core by default\n");
+  printf("  -t, --workers: the number of threadpool threads, %d by default\n", WORKERS);
+  printf("  -i, --inline-limit: batches of commands up to this many bytes run on the\n");
+  printf("      event loop thread instead of the threadpool, %d by default, 0 never\n", INLINE_LIMIT);
+  printf("  -b, --bulk-threshold: batches of this many bytes or more run in the bulk\n");
+  printf("      lane of the threadpool, %d by default, 0 never\n", BULK_THRESHOLD);
+  printf("  -B, --bulk-workers: the most workers of a threadpool running bulk batches\n");
+  printf("      at the same time, half of them by default\n");
+  printf("  -z, --zerocopy-threshold: replies of this many bytes or more are sent with\n");
+  printf("      MSG_ZEROCOPY, %d by default, 0 never\n", ZEROCOPY_THRESHOLD);
+  printf("  -u, --udp-port: also serve get and gets over UDP on this port, with one\n");
+  printf("      thread per event loop thread\n");
+  printf("  -U, --unix-socket: also listen on a unix domain socket at this path\n");
+  printf("  -a, --unix-mode: the permissions of the unix domain socket, in octal, 0700\n");
+  printf("      by default\n");
+  printf("  -s, --shards: thread-per-core mode, every event loop thread owns its\n");
+  printf("      connections and a partition of the cache, and runs the commands itself\n");
+  printf("  -k, --stack-size: the stack size of every thread, in bytes or with a k or m\n");
+  printf("      suffix and at least %dk, the system default (ulimit -s) by default\n",
+         MIN_STACK_SIZE / 1024);
+  printf("  -P, --pin: none leaves the threads to the scheduler (the default); spread\n");
+  printf("      pins every reactor and worker to a cpu of its own; core gives every\n");
+  printf("      reactor a threadpool of its own on the same cpu; node gives every\n");
+  printf("      reactor a threadpool of its own on the cpus of the same NUMA node;\n");
+  printf("      with core and node every threadpool has a worker at least, so there\n");
+  printf("      are as many workers as reactors if -t asks for fewer\n");
+}
@@ -0,0 +1,64 @@
+#ifndef options_h
+#define options_h
+
+#include <sys/types.h>
+#include <string>
+#include "memserver.h"
+
+using namespace std;
+
+#define PORT "11211" // port we're listening on
+#define WORKERS 12 // threads of the threadpool
+#define MIN_STACK_SIZE (256 * 1024) // the smallest stack size, the frames of the
+                                    // threads of the server need this much
+
+// which cpus the threads of the server are pinned to
+enum Pinning {
+  PinNone, // left to the scheduler
+  PinSpread, // every reactor and every worker on a cpu of its own, round robin
+  PinCore, // every reactor with a threadpool of its own on the same cpu,
+           // so the work of a connection stays on the core that received it
+  PinNode // every reactor on a cpu, with a threadpool of its own on the
+          // cpus of the same NUMA node
+};
+
+/*
+ * The settings of the server. They come from a config file, with one
+ * 'name = value' per line and '#' comments, and from the command line,
+ * which overrides the file. The names in the file are the long options
+ * of the command line: port, loop, reactors, workers, inline-limit,
+ * bulk-threshold, bulk-workers, zerocopy-threshold, udp-port, unix-socket, unix-mode, shards,
+ * stack-size and pin
+ */
+struct Options {
+  string port;
+  ServerLoop loop;
+  int reactors; // one per cpu by default
+  int workers;
+  int inline_limit;
+  int bulk_threshold;
+  int bulk_workers; // 0 for half of the workers of every threadpool
+  int zerocopy_threshold;
+  string udp_port; // empty for no UDP
+  string unix_path; // empty for no unix domain socket
+  mode_t unix_mode;
+  bool shards;
+  size_t stack_size; // of every thread in bytes, 0 for the system default
+  Pinning pinning;
+
+  Options();
+};
+
+// sets the option called name, returns -1 if the value is not valid
+int SetOption(Options *options, const string& name, const string& value);
+
+// reads a config file, returns -1 if it cannot be read or is not valid
+int LoadConfig(Options *options, const string& path);
+
+// parses the command line, returns 1 if the usage was asked for and -1
+// if the options are not valid
+int ParseOptions(Options *options, int argc, char *argv[]);
+
+void PrintUsage(const char *name);
+
+#endif
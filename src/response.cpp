@@ -0,0 +1,159 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <stdio.h>
+#include "response.h"
+
+using namespace std;
+
+// maximum number of segments passed to one sendmsg call
+#define MAX_IOV_PER_SEND 1024
+
+/* Copies bytes into the response. Bytes appended right after other
+ * copied bytes extend the same segment
+ * @param data: the bytes to be copied
+ * @param len: the number of bytes
+ */
+void Response::append(const char *data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  if (!segments_.empty() && segments_.back().ref == nullptr) {
+    segments_.back().len += len;
+  } else {
+    segments_.push_back({nullptr, text_.length(), len});
+  }
+  text_.append(data, len);
+  length_ += len;
+}
+
+/* Adds a segment that points at the data of a cache entry
+ * @param data: the bytes to be sent, owned by item
+ * @param len: the number of bytes
+ * @param item: the cache entry that owns the bytes, nullptr for static bytes
+ */
+void Response::appendRef(const char *data, size_t len, const shared_ptr<const CacheNode>& item) {
+  if (len == 0) {
+    return;
+  }
+  segments_.push_back({data, 0, len});
+  if (item != nullptr && (items_.empty() || items_.back() != item)) {
+    items_.push_back(item);
+  }
+  length_ += len;
+}
+
+/* Appends the segments of another response, sharing its referenced entries
+ * @param other: the response to be appended
+ */
+void Response::append(const Response& other) {
+  for (auto& segment : other.segments_) {
+    if (segment.ref == nullptr) {
+      append(other.text_.data() + segment.offset, segment.len);
+    } else {
+      segments_.push_back(segment);
+      length_ += segment.len;
+    }
+  }
+  items_.insert(items_.end(), other.items_.begin(), other.items_.end());
+}
+
+/* Returns the whole response as a string
+ */
+string Response::str() const {
+  string result;
+  result.reserve(length_);
+  for (auto& segment : segments_) {
+    if (segment.ref == nullptr) {
+      result.append(text_, segment.offset, segment.len);
+    } else {
+      result.append(segment.ref, segment.len);
+    }
+  }
+  return result;
+}
+
+/* Fills an iovec array with the bytes of the response that were not
+ * sent yet
+ * @param iov: the array to be filled
+ * @param max_iov: the size of the array
+ * @return: the number of entries filled
+ */
+int Response::pendingIovec(struct iovec *iov, int max_iov) const {
+  int count = 0;
+  for (size_t i = sent_segment_; i < segments_.size() && count < max_iov; i++, count++) {
+    const Segment& segment = segments_[i];
+    const char *base = segment.ref ? segment.ref : text_.data() + segment.offset;
+    iov[count].iov_base = const_cast<char *>(base);
+    iov[count].iov_len = segment.len;
+  }
+  if (count > 0) {
+    // skip the part of the first segment sent by a short write
+    iov[0].iov_base = static_cast<char *>(iov[0].iov_base) + sent_skip_;
+    iov[0].iov_len -= sent_skip_;
+  }
+  return count;
+}
+
+/* Advances past bytes that were sent, so that a short write is resumed
+ * from the first byte that was not sent
+ * @param sent: the number of bytes sent
+ * @return: true if the whole response has been sent
+ */
+bool Response::consume(size_t sent) {
+  size_t left = sent + sent_skip_;
+  while (sent_segment_ < segments_.size() && left >= segments_[sent_segment_].len) {
+    left -= segments_[sent_segment_].len;
+    sent_segment_++;
+  }
+  sent_skip_ = left;
+  return sent_segment_ == segments_.size();
+}
+
+/* Resets the segments and the sent position, and releases the cache
+ * entries the response held, so that the object can be reused for the
+ * next reply. The copied text keeps its buffer, so a response that is
+ * reused stops allocating once it held its largest reply
+ */
+void Response::clear() {
+  text_.clear();
+  segments_.clear();
+  items_.clear();
+  length_ = 0;
+  sent_segment_ = 0;
+  sent_skip_ = 0;
+}
+
+/* Sends the response with gathering writes. Short writes are resumed
+ * from the first byte that was not sent. Client sockets are non-blocking,
+ * so when the socket buffer is full this waits until it is writable
+ * @param socket: the socket to send the response to
+ * @return: 0 on success, -1 on failure
+ */
+int Response::sendTo(int socket) {
+  struct iovec iov[MAX_IOV_PER_SEND];
+  while (sent_segment_ < segments_.size()) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = pendingIovec(iov, MAX_IOV_PER_SEND);
+    ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd pfd = {socket, POLLOUT, 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+          return -1;
+        }
+        continue;
+      }
+      return -1;
+    }
+    consume(sent);
+  }
+  return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef response_h
+#define response_h
+#include <sys/uio.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct CacheNode;
+
+/*
+ * A reply to a client, assembled as a list of segments that is sent with
+ * a single gathering write. Small pieces such as headers are copied into
+ * a buffer owned by the response, while the data of cache entries is only
+ * referenced: the response holds a handle to each referenced entry, so
+ * the data stays valid until the reply has been sent
+ */
+class Response {
+ public:
+  Response() : length_(0), sent_segment_(0), sent_skip_(0) {
+  }
+
+  // copies the bytes into the response
+  void append(const char *data, size_t len);
+
+  void append(const string& s) {
+    append(s.data(), s.length());
+  }
+
+  // references bytes owned by a cache entry, without copying them; item
+  // may be nullptr for bytes that live as long as the program, such as
+  // string literals
+  void appendRef(const char *data, size_t len, const shared_ptr<const CacheNode>& item);
+
+  // appends all the segments of another response
+  void append(const Response& other);
+
+  inline size_t length() const { return length_; }
+
+  inline bool empty() const { return length_ == 0; }
+
+  // returns the response as one string
+  string str() const;
+
+  // sends the rest of the response, waiting while the socket is full
+  int sendTo(int socket);
+
+  // fills iov with the bytes that were not sent yet, returns the count
+  int pendingIovec(struct iovec *iov, int max_iov) const;
+
+  // marks sent bytes, returns true once the whole response was sent
+  bool consume(size_t sent);
+
+  // resets the segments and releases the items held, so that the response
+  // can be reused for the next reply
+  void clear();
+
+ private:
+  struct Segment {
+    const char *ref; // referenced bytes, nullptr if the bytes are in text_
+    size_t offset; // offset of the bytes in text_
+    size_t len; // number of bytes
+  };
+
+  string text_; // bytes copied into the response
+  vector<Segment> segments_; // the segments in the order they are sent
+  vector<shared_ptr<const CacheNode>> items_; // keeps referenced entries alive
+  size_t length_; // total number of bytes
+  size_t sent_segment_; // the first segment that was not completely sent
+  size_t sent_skip_; // bytes of that segment already sent
+};
+#endif //response_h
@@ -0,0 +1,482 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <functional>
+#include "shard.h"
+
+using namespace std;
+
+// epoll data of the listener and of the doorbell, connection ids start after them
+#define LISTENER_ID 0
+#define WAKE_ID 1
+
+Shard::Shard(int id, int count, string port, int capacity) {
+  id_ = id;
+  count_ = count;
+  port_ = port;
+  listener_ = -1;
+  epoll_fd_ = -1;
+  wake_fd_ = -1;
+  // the shard is the only thread that uses its cache
+  cache_.reset(new Cache(capacity, false));
+  next_connection_id_ = WAKE_ID + 1;
+  for (int i = 0; i < count; i++) {
+    inbox_.push_back(unique_ptr<SpscRing<ShardMessage *>>(
+        new SpscRing<ShardMessage *>(SHARD_RING_SIZE)));
+  }
+  outgoing_.resize(count);
+  recv_buffer_.resize(MAX_PAYLOAD_LENGTH);
+}
+
+Shard::~Shard() {
+  for (auto& conn : connections_) {
+    close(conn.second->fd);
+  }
+  if (listener_ >= 0) {
+    close(listener_);
+  }
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+  }
+  if (wake_fd_ >= 0) {
+    close(wake_fd_);
+  }
+}
+
+/* Returns the shard that owns a key
+ * @param key: the key
+ * @param count: the number of shards
+ */
+int Shard::Owner(const string& key, int count) {
+  return hash<string>()(key) % count;
+}
+
+/* Creates the listener of the shard, bound with SO_REUSEPORT when there
+ * are several shards so that the kernel spreads the connections over
+ * them, the epoll instance and the eventfd the other shards use to wake
+ * the shard up
+ * @return: 0 on success, -1 on failure
+ */
+int Shard::init() {
+  struct addrinfo hints, *ai, *p;
+  int rv, yes = 1;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ((rv = getaddrinfo(nullptr, port_.c_str(), &hints, &ai)) != 0) {
+    fprintf(stderr, "shard: %s\n", gai_strerror(rv));
+    return -1;
+  }
+  for (p = ai; p != nullptr; p = p->ai_next) {
+    listener_ = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+    if (listener_ < 0) {
+      continue;
+    }
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+    if (count_ > 1) {
+      setsockopt(listener_, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+    }
+    if (bind(listener_, p->ai_addr, p->ai_addrlen) < 0) {
+      close(listener_);
+      listener_ = -1;
+      continue;
+    }
+    break;
+  }
+  freeaddrinfo(ai);
+  if (listener_ < 0 || listen(listener_, SOMAXCONN) == -1) {
+    fprintf(stderr, "shard: failed to bind\n");
+    return -1;
+  }
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd_ == -1 || wake_fd_ == -1) {
+    perror("shard");
+    return -1;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof ev);
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.u64 = LISTENER_ID;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listener_, &ev);
+  ev.events = EPOLLIN;
+  ev.data.u64 = WAKE_ID;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+  return 0;
+}
+
+int Shard::LocalPort() const {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof addr;
+  if (getsockname(listener_, (struct sockaddr *) &addr, &len) < 0) {
+    return -1;
+  }
+  if (addr.ss_family == AF_INET6) {
+    return ntohs(((struct sockaddr_in6 *) &addr)->sin6_port);
+  }
+  return ntohs(((struct sockaddr_in *) &addr)->sin_port);
+}
+
+void Shard::connect(const vector<Shard *>& shards) {
+  shards_ = shards;
+}
+
+/* The event loop of the shard. It handles the clients of its own
+ * connections, and the commands and replies forwarded by the other
+ * shards. The thread is started on the cpus of the shard
+ */
+void Shard::run() {
+  struct epoll_event events[SHARD_MAX_EVENTS];
+  for(;;) {
+    // messages left over because a ring was full are retried right away
+    bool backlog = false;
+    for (auto& out : outgoing_) {
+      backlog = backlog || !out.empty();
+    }
+    int n = epoll_wait(epoll_fd_, events, SHARD_MAX_EVENTS, backlog ? 0 : -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      exit(4);
+    }
+
+    for (int i = 0; i < n; i++) {
+      uint64_t id = events[i].data.u64;
+      if (id == LISTENER_ID) {
+        Accept();
+        continue;
+      }
+      if (id == WAKE_ID) {
+        uint64_t value;
+        if (read(wake_fd_, &value, sizeof value) < 0 && errno != EAGAIN) {
+          perror("eventfd read");
+        }
+        Receive();
+        continue;
+      }
+      auto it = connections_.find(id);
+      if (it == connections_.end()) {
+        continue;
+      }
+      Connection *conn = it->second.get();
+      // a paused connection is read again once its backlog drained
+      if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !conn->paused &&
+          Read(id, conn) < 0) {
+        Close(id);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        Flush(conn);
+        if (Resume(id, conn) < 0) {
+          Close(id);
+        }
+      }
+    }
+    if (backlog) {
+      // the other shards may be waiting for room in their rings too
+      Receive();
+    }
+    Forward();
+  }
+}
+
+void Shard::Accept() {
+  for(;;) {
+    int fd = accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept");
+      }
+      return;
+    }
+    uint64_t id = next_connection_id_++;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    // EPOLLOUT is edge triggered too, it is only reported when a full
+    // socket buffer drains
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = id;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      perror("epoll_ctl");
+      close(fd);
+      continue;
+    }
+    unique_ptr<Connection> conn(new Connection());
+    conn->fd = fd;
+    conn->first_slot = 0;
+    conn->backlog = 0;
+    conn->paused = false;
+    connections_[id] = move(conn);
+  }
+}
+
+/* Reads from a connection until recv() would block, and runs or forwards
+ * the complete commands. Consecutive commands for the same shard are
+ * kept together, so a pipelined batch is forwarded with few messages.
+ * Reading pauses while the backlog of the connection exceeds
+ * SHARD_OUTPUT_LIMIT even after sending what the socket takes, so a
+ * client that does not read its replies is not read either
+ * @return: 0 on success, -1 if the client disconnected
+ */
+int Shard::Read(uint64_t id, Connection *conn) {
+  char *buffer = recv_buffer_.data();
+  for(;;) {
+    if (conn->backlog > SHARD_OUTPUT_LIMIT) {
+      Flush(conn);
+      if (conn->backlog > SHARD_OUTPUT_LIMIT) {
+        conn->paused = true;
+        return 0;
+      }
+    }
+    int n = recv(conn->fd, buffer, recv_buffer_.size(), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    string& s = conn->input;
+    s.append(buffer, n);
+    size_t nbytes = CompleteCommandsLength(s, s.length());
+    if (nbytes == 0 && s.length() >= MAX_PAYLOAD_LENGTH) {
+      // a command cannot be this long, let the parser report the error
+      nbytes = s.length();
+    }
+
+    vector<pair<int, string>> parts;
+    size_t pos = 0;
+    while (pos < nbytes) {
+      size_t length = NextCommandLength(s, pos, nbytes);
+      Route(s.substr(pos, length), &parts);
+      pos += length;
+    }
+    int owner = -1;
+    string batch;
+    for (auto& part : parts) {
+      if (part.first != owner && !batch.empty()) {
+        Dispatch(id, conn, owner, batch);
+        batch.clear();
+      }
+      owner = part.first;
+      batch.append(part.second);
+    }
+    if (!batch.empty()) {
+      Dispatch(id, conn, owner, batch);
+    }
+    s.erase(0, nbytes);
+  }
+  Flush(conn);
+  return 0;
+}
+
+/* Finds the shards that own the keys of a command. A multi-key get is
+ * split into gets of the keys owned by the same shard, in key order, so
+ * that the replies can be sent in the order of the keys
+ * @param cmd_str: the command
+ * @param parts: filled with the owners and the commands they run
+ */
+void Shard::Route(const string& cmd_str, vector<pair<int, string>> *parts) {
+  size_t line_end = cmd_str.find("\r\n");
+  if (line_end == string::npos || count_ == 1) {
+    parts->push_back(make_pair(id_, cmd_str));
+    return;
+  }
+  vector<string> tokens;
+  size_t pos = 0;
+  while (pos < line_end) {
+    size_t end = cmd_str.find(' ', pos);
+    if (end == string::npos || end > line_end) {
+      end = line_end;
+    }
+    if (end > pos) {
+      tokens.push_back(cmd_str.substr(pos, end - pos));
+    }
+    pos = end + 1;
+  }
+  if (tokens.size() < 2) {
+    // commands without a key run on the shard that received them
+    parts->push_back(make_pair(id_, cmd_str));
+    return;
+  }
+
+  const string& cmd = tokens[0];
+  size_t first_key = 0;
+  if (cmd == "get" || cmd == "gets") {
+    first_key = 1;
+  } else if (cmd == "gat" || cmd == "gats") {
+    first_key = 2;
+  }
+  if (first_key == 0 || tokens.size() <= first_key + 1) {
+    size_t key = first_key == 0 ? 1 : first_key;
+    int owner = key < tokens.size() ? Owner(tokens[key], count_) : id_;
+    parts->push_back(make_pair(owner, cmd_str));
+    return;
+  }
+
+  string prefix = cmd;
+  for (size_t i = 1; i < first_key; i++) {
+    prefix.append(" ").append(tokens[i]);
+  }
+  int owner = -1;
+  string part;
+  for (size_t i = first_key; i < tokens.size(); i++) {
+    int key_owner = Owner(tokens[i], count_);
+    if (key_owner != owner && !part.empty()) {
+      parts->push_back(make_pair(owner, part.append("\r\n")));
+      part.clear();
+    }
+    if (part.empty()) {
+      part = prefix;
+    }
+    part.append(" ").append(tokens[i]);
+    owner = key_owner;
+  }
+  parts->push_back(make_pair(owner, part.append("\r\n")));
+}
+
+/* Runs commands on this shard, or forwards them to the shard that owns
+ * their keys. Either way they take the next reply slot of the connection
+ */
+void Shard::Dispatch(uint64_t id, Connection *conn, int owner, const string& commands) {
+  conn->slots.push_back(Slot());
+  Slot& slot = conn->slots.back();
+  if (owner == id_) {
+    ProcessCommands(commands, cache_.get(), commands.length(), &slot.response);
+    slot.ready = true;
+    conn->backlog += slot.response.length();
+    return;
+  }
+  slot.ready = false;
+  conn->backlog += commands.length();
+  ShardMessage *message = new ShardMessage();
+  message->from = id_;
+  message->connection = id;
+  message->slot = conn->first_slot + conn->slots.size() - 1;
+  message->done = false;
+  message->commands = commands;
+  outgoing_[owner].push_back(message);
+}
+
+/* Sends the replies that are ready, in command order, until the socket
+ * buffer is full. The rest is sent when epoll reports the socket writable
+ */
+void Shard::Flush(Connection *conn) {
+  struct iovec iov[SHARD_IOV_PER_SEND];
+  while (!conn->slots.empty() && conn->slots.front().ready) {
+    Response& response = conn->slots.front().response;
+    int count = response.pendingIovec(iov, SHARD_IOV_PER_SEND);
+    if (count > 0) {
+      struct msghdr msg;
+      memset(&msg, 0, sizeof msg);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+      if (sent < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // wait for EPOLLOUT, or for the read side to report the error
+        return;
+      }
+      conn->backlog -= sent;
+      if (!response.consume(sent)) {
+        continue;
+      }
+    }
+    conn->slots.pop_front();
+    conn->first_slot++;
+  }
+}
+
+/* Reads from a paused connection again once its backlog drained below
+ * SHARD_OUTPUT_RESUME; the socket is edge triggered and does not report
+ * the data that arrived meanwhile
+ * @return: 0 on success, -1 if the client disconnected
+ */
+int Shard::Resume(uint64_t id, Connection *conn) {
+  if (!conn->paused || conn->backlog >= SHARD_OUTPUT_RESUME) {
+    return 0;
+  }
+  conn->paused = false;
+  return Read(id, conn);
+}
+
+void Shard::Close(uint64_t id) {
+  auto it = connections_.find(id);
+  if (it == connections_.end()) {
+    return;
+  }
+  close(it->second->fd);
+  connections_.erase(it);
+}
+
+/* Handles the messages from the other shards: runs the commands forwarded
+ * to this shard and sends the reply back, and puts the replies to
+ * commands this shard forwarded in the slots of their connections
+ */
+void Shard::Receive() {
+  for (int from = 0; from < count_; from++) {
+    ShardMessage *message;
+    while (inbox_[from]->pop(&message)) {
+      if (!message->done) {
+        ProcessCommands(message->commands, cache_.get(), message->commands.length(),
+                        &message->response);
+        message->done = true;
+        outgoing_[from].push_back(message);
+        continue;
+      }
+      auto it = connections_.find(message->connection);
+      if (it != connections_.end()) {
+        Connection *conn = it->second.get();
+        Slot& slot = conn->slots[message->slot - conn->first_slot];
+        slot.response = move(message->response);
+        slot.ready = true;
+        conn->backlog += slot.response.length();
+        conn->backlog -= message->commands.length();
+        Flush(conn);
+        if (Resume(message->connection, conn) < 0) {
+          Close(message->connection);
+        }
+      }
+      delete message;
+    }
+  }
+}
+
+/* Moves the messages for the other shards into their rings, and rings the
+ * doorbell of every shard that got a message
+ */
+void Shard::Forward() {
+  for (int to = 0; to < count_; to++) {
+    deque<ShardMessage *>& out = outgoing_[to];
+    if (out.empty()) {
+      continue;
+    }
+    bool pushed = false;
+    while (!out.empty() && shards_[to]->inbox_[id_]->push(out.front())) {
+      out.pop_front();
+      pushed = true;
+    }
+    if (pushed) {
+      uint64_t one = 1;
+      if (write(shards_[to]->wake_fd_, &one, sizeof one) < 0) {
+        perror("eventfd write");
+      }
+    }
+  }
+}
@@ -0,0 +1,166 @@
+#ifndef shard_h
+#define shard_h
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "memcache.h"
+
+using namespace std;
+
+#define SHARD_RING_SIZE 1024 // messages in flight from one shard to another
+#define SHARD_MAX_EVENTS 256 // events returned by one epoll_wait
+#define SHARD_IOV_PER_SEND 64 // segments of a reply sent by one sendmsg
+#define SHARD_OUTPUT_LIMIT (4 * 1024 * 1024) // backlog of a connection before
+                                             // reading from it pauses, like
+                                             // OUTPUT_LIMIT of the reactors
+#define SHARD_OUTPUT_RESUME (SHARD_OUTPUT_LIMIT / 2) // reading resumes once the
+                                                     // backlog drained below this
+
+/*
+ * A bounded queue with a single producer thread and a single consumer
+ * thread. The producer only writes tail_ and the consumer only writes
+ * head_, which are kept on separate cache lines, so a push or a pop does
+ * not take a lock
+ */
+template <typename T>
+class SpscRing {
+ public:
+  // size must be a power of 2
+  explicit SpscRing(size_t size)
+    : head_(0), tail_cache_(0), tail_(0), head_cache_(0), mask_(size - 1), slots_(size) {
+  }
+
+  // called by the producer, returns false if the ring is full
+  bool push(T item) {
+    size_t tail = tail_.load(memory_order_relaxed);
+    if (tail - head_cache_ == slots_.size()) {
+      head_cache_ = head_.load(memory_order_acquire);
+      if (tail - head_cache_ == slots_.size()) {
+        return false;
+      }
+    }
+    slots_[tail & mask_] = item;
+    tail_.store(tail + 1, memory_order_release);
+    return true;
+  }
+
+  // called by the consumer, returns false if the ring is empty
+  bool pop(T *item) {
+    size_t head = head_.load(memory_order_relaxed);
+    if (head == tail_cache_) {
+      tail_cache_ = tail_.load(memory_order_acquire);
+      if (head == tail_cache_) {
+        return false;
+      }
+    }
+    *item = slots_[head & mask_];
+    head_.store(head + 1, memory_order_release);
+    return true;
+  }
+
+ private:
+  // consumer side
+  atomic<size_t> head_;
+  size_t tail_cache_; // the last tail the consumer has seen
+  char pad1_[64];
+  // producer side
+  atomic<size_t> tail_;
+  size_t head_cache_; // the last head the producer has seen
+  char pad2_[64];
+  size_t mask_;
+  vector<T> slots_;
+};
+
+// commands a shard forwards to the shard that owns their keys, sent back
+// with the reply once they have run
+struct ShardMessage {
+  int from; // the shard that received the commands from the client
+  uint64_t connection; // the connection in that shard
+  uint64_t slot; // the position of the reply among the replies of the connection
+  bool done; // the commands have run and response holds the reply
+  string commands;
+  Response response;
+};
+
+/*
+ * A shard of the thread-per-core mode: one thread, pinned to a core, that
+ * owns a reactor, the connections it accepted and a partition of the
+ * cache. Keys are spread over the shards by hash. Commands for keys owned
+ * by another shard are forwarded to it through a ring per pair of shards,
+ * and the reply comes back the same way, so nothing on the data path is
+ * shared between threads or takes a lock
+ */
+class Shard {
+ public:
+  Shard(int id, int count, string port, int capacity);
+  ~Shard();
+
+  // creates the listener, the epoll instance and the doorbell
+  int init();
+
+  // gives the shard the other shards to forward commands to
+  void connect(const vector<Shard *>& shards);
+
+  // runs the event loop forever
+  void run();
+
+  // the shard that owns a key
+  static int Owner(const string& key, int count);
+
+  size_t NumEntries() { return cache_->NumEntries(); }
+
+  // the port the listener is bound to, the one the kernel picked for
+  // port "0"
+  int LocalPort() const;
+
+ private:
+  // a reply to a client, in the order the commands were received
+  struct Slot {
+    bool ready; // the commands have run
+    Response response;
+  };
+  struct Connection {
+    int fd;
+    string input; // data that does not form a complete command yet
+    deque<Slot> slots; // replies that were not sent yet
+    uint64_t first_slot; // the number of slots.front()
+    // the bytes of the replies that were not sent, and of the commands
+    // forwarded to other shards whose replies did not come back yet
+    size_t backlog;
+    bool paused; // reading stopped until the backlog drains
+  };
+
+  void Accept();
+  int Read(uint64_t id, Connection *conn);
+  void Route(const string& cmd_str, vector<pair<int, string>> *parts);
+  void Dispatch(uint64_t id, Connection *conn, int owner, const string& commands);
+  void Flush(Connection *conn);
+  int Resume(uint64_t id, Connection *conn);
+  void Close(uint64_t id);
+  void Receive();
+  void Forward();
+
+  int id_; // the index of the shard
+  int count_; // the number of shards
+  string port_;
+  int listener_;
+  int epoll_fd_;
+  int wake_fd_; // eventfd the other shards write to after forwarding
+  unique_ptr<Cache> cache_; // the partition of the cache owned by the shard
+  uint64_t next_connection_id_;
+  unordered_map<uint64_t, unique_ptr<Connection>> connections_;
+  vector<Shard *> shards_;
+  // the receive buffer, on the heap so that -k can give the shard a
+  // small stack
+  vector<char> recv_buffer_;
+  // inbox_[i] carries the messages from shard i to this shard
+  vector<unique_ptr<SpscRing<ShardMessage *>>> inbox_;
+  // messages that did not fit in the ring of another shard yet
+  vector<deque<ShardMessage *>> outgoing_;
+};
+
+#endif //shard_h
@@ -0,0 +1,155 @@
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include "threads.h"
+
+static void *RunThread(void *arg) {
+  unique_ptr<function<void()>> func(static_cast<function<void()> *>(arg));
+  (*func)();
+  return nullptr;
+}
+
+/* Starts a thread
+ * @param thread: set to the new thread
+ * @param func: what the thread runs
+ * @param stack_size: the size of its stack in bytes, 0 for the default
+ * @param cpus: the cpus it may run on, empty for any
+ * @return: 0 on success, the errno of the failed call otherwise
+ */
+int StartThread(pthread_t *thread, function<void()> func, size_t stack_size,
+                const vector<int>& cpus) {
+  pthread_attr_t attr;
+  int ret = pthread_attr_init(&attr);
+  if (ret != 0) {
+    return ret;
+  }
+  if (stack_size > 0) {
+    ret = pthread_attr_setstacksize(&attr, stack_size);
+  }
+  if (ret == 0 && !cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+      CPU_SET(cpu, &set);
+    }
+    ret = pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+  }
+  if (ret == 0) {
+    function<void()> *arg = new function<void()>(move(func));
+    ret = pthread_create(thread, &attr, RunThread, arg);
+    if (ret != 0) {
+      delete arg;
+    }
+  }
+  pthread_attr_destroy(&attr);
+  return ret;
+}
+
+/* Pins the calling thread
+ * @param cpus: the cpus it may run on
+ * @return: 0 on success, the errno of pthread_setaffinity_np otherwise
+ */
+int PinThread(const vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+}
+
+/* Finds the cpus the process may run on, which taskset or a cgroup
+ * cpuset may restrict
+ * @return: the cpus in increasing order, cpu 0 if they cannot be read
+ */
+vector<int> AllowedCpus() {
+  vector<int> cpus;
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof set, &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  if (cpus.empty()) {
+    cpus.push_back(0);
+  }
+  return cpus;
+}
+
+/* Finds the NUMA node of a cpu in sysfs. The node ids need not be
+ * contiguous, so every node directory is looked at
+ * @param cpu: the cpu
+ * @return: the cpus of its node, only cpu itself if the kernel has no
+ * NUMA information
+ */
+vector<int> NodeCpus(int cpu) {
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (dir == nullptr) {
+    return vector<int>(1, cpu);
+  }
+  vector<int> node_cpus(1, cpu);
+  while (struct dirent *entry = readdir(dir)) {
+    string name = entry->d_name;
+    if (name.compare(0, 4, "node") != 0 || name.length() == 4 ||
+        name.find_first_not_of("0123456789", 4) != string::npos) {
+      continue;
+    }
+    ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+    string list;
+    if (!file || !getline(file, list)) {
+      continue;
+    }
+    vector<int> cpus = ParseCpuList(list);
+    bool found = false;
+    for (int c : cpus) {
+      found = found || c == cpu;
+    }
+    if (found) {
+      node_cpus = cpus;
+      break;
+    }
+  }
+  closedir(dir);
+  return node_cpus;
+}
+
+/* Parses the cpu list format of sysfs and taskset
+ * @param list: ranges and single cpus separated by commas, "0-3,8"
+ * @return: the cpus, empty if the list is malformed
+ */
+vector<int> ParseCpuList(const string& list) {
+  vector<int> cpus;
+  const char *p = list.c_str();
+  while (*p != '\0' && *p != '\n') {
+    char *end;
+    long first = strtol(p, &end, 10);
+    if (end == p || first < 0 || first >= CPU_SETSIZE) {
+      return vector<int>();
+    }
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      last = strtol(p + 1, &end, 10);
+      if (end == p + 1 || last < first || last >= CPU_SETSIZE) {
+        return vector<int>();
+      }
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      cpus.push_back((int) cpu);
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0' && *p != '\n') {
+      return vector<int>();
+    }
+  }
+  return cpus;
+}
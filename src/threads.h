@@ -0,0 +1,34 @@
+#ifndef threads_h
+#define threads_h
+
+#include <pthread.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Starting the threads of the server with an explicit stack size and CPU
+ * affinity, which std::thread does not offer. A stack size of 0 keeps the
+ * default of the system (ulimit -s, often 8MB of virtual memory per
+ * thread), and an empty set of cpus leaves the thread to the scheduler
+ */
+
+// starts func on a new thread, returns 0 or an errno
+int StartThread(pthread_t *thread, function<void()> func, size_t stack_size,
+                const vector<int>& cpus);
+
+// pins the calling thread to cpus, returns 0 or an errno
+int PinThread(const vector<int>& cpus);
+
+// the cpus the process may run on, at least one
+vector<int> AllowedCpus();
+
+// the cpus of the NUMA node of cpu, only cpu itself without NUMA
+vector<int> NodeCpus(int cpu);
+
+// parses a cpu list such as "0-3,8,10-11", empty if malformed
+vector<int> ParseCpuList(const string& list);
+
+#endif
@@ -0,0 +1,208 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "udpserver.h"
+
+using namespace std;
+
+UdpServer::UdpServer(string port, Cache* memcache)
+  : port_(port), memcache_(memcache), socket_(-1), reuse_port_(false) {
+}
+
+UdpServer::~UdpServer() {
+  if (socket_ >= 0) {
+    close(socket_);
+  }
+}
+
+/* Binds the UDP socket to the port
+ * @return: 0 on success, -1 on failure
+ */
+int UdpServer::init() {
+  struct addrinfo hints, *ai, *p;
+  int rv, yes = 1;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ((rv = getaddrinfo(nullptr, port_.c_str(), &hints, &ai)) != 0) {
+    fprintf(stderr, "udpserver: %s\n", gai_strerror(rv));
+    return -1;
+  }
+
+  for (p = ai; p != nullptr; p = p->ai_next) {
+    socket_ = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (socket_ < 0) {
+      continue;
+    }
+    // the servers started on the port share the datagrams. SO_REUSEADDR
+    // is not set: UDP has no TIME_WAIT, and on Linux it would let two
+    // sockets bind the port without an error
+    if (reuse_port_) {
+      setsockopt(socket_, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+    }
+    if (bind(socket_, p->ai_addr, p->ai_addrlen) < 0) {
+      close(socket_);
+      socket_ = -1;
+      continue;
+    }
+    break;
+  }
+  freeaddrinfo(ai);
+
+  if (socket_ < 0) {
+    fprintf(stderr, "udpserver: failed to bind\n");
+    return -1;
+  }
+  return 0;
+}
+
+static inline uint16_t ReadUint16(const char *p) {
+  uint16_t value;
+  memcpy(&value, p, sizeof value);
+  return ntohs(value);
+}
+
+static inline void WriteUint16(char *p, uint16_t value) {
+  value = htons(value);
+  memcpy(p, &value, sizeof value);
+}
+
+/* Runs the request in a datagram
+ * @param data: the datagram
+ * @param len: the length of the datagram
+ * @param memcache: the cache
+ * @param replies: filled with the datagrams of the reply, frame header
+ *  included, left empty if the datagram has no valid frame header
+ */
+void UdpServer::HandleDatagram(const char *data, size_t len, Cache* memcache,
+                               vector<string> *replies) {
+  if (len < UDP_HEADER_SIZE) {
+    return;
+  }
+  uint16_t request_id = ReadUint16(data);
+  uint16_t sequence = ReadUint16(data + 2);
+  uint16_t count = ReadUint16(data + 4);
+
+  string reply;
+  string body(data + UDP_HEADER_SIZE, len - UDP_HEADER_SIZE);
+  if (sequence != 0 || count != 1) {
+    reply = "SERVER_ERROR a request must fit in one datagram\r\n";
+  } else if (body.empty() || CompleteCommandsLength(body, body.length()) != body.length()) {
+    reply = "CLIENT_ERROR wrong command format\r\n";
+  } else {
+    size_t pos = 0;
+    while (pos < body.length()) {
+      size_t cmd_end = body.find_first_of(" \r", pos);
+      string cmd = body.substr(pos, cmd_end - pos);
+      if (cmd != "get" && cmd != "gets") {
+        reply = "CLIENT_ERROR only get and gets are served over UDP\r\n";
+        break;
+      }
+      pos += NextCommandLength(body, pos, body.length());
+    }
+    if (reply.empty()) {
+      reply = ProcessCommands(body, memcache, (int) body.length());
+    }
+  }
+
+  // a miss is answered with one datagram without data
+  size_t payload = UDP_MAX_DATAGRAM - UDP_HEADER_SIZE;
+  size_t datagrams = reply.empty() ? 1 : (reply.length() + payload - 1) / payload;
+  if (datagrams > 0xffff) {
+    reply = "SERVER_ERROR reply too large for UDP\r\n";
+    datagrams = 1;
+  }
+  for (size_t i = 0; i < datagrams; i++) {
+    size_t offset = i * payload;
+    size_t length = min(payload, reply.length() - min(offset, reply.length()));
+    string datagram(UDP_HEADER_SIZE, '\0');
+    WriteUint16(&datagram[0], request_id);
+    WriteUint16(&datagram[2], (uint16_t) i);
+    WriteUint16(&datagram[4], (uint16_t) datagrams);
+    datagram.append(reply, offset, length);
+    replies->push_back(move(datagram));
+  }
+}
+
+/* Receives up to UDP_BATCH datagrams with one recvmmsg, runs them, and
+ * sends the replies with as few sendmmsg as the batch allows
+ */
+void UdpServer::run() {
+  vector<char> buffers((size_t) UDP_BATCH * UDP_MAX_REQUEST);
+  struct mmsghdr in[UDP_BATCH];
+  struct iovec in_iov[UDP_BATCH];
+  struct sockaddr_storage addrs[UDP_BATCH];
+  struct mmsghdr out[UDP_BATCH];
+  struct iovec out_iov[UDP_BATCH];
+
+  for(;;) {
+    for (int i = 0; i < UDP_BATCH; i++) {
+      in_iov[i].iov_base = &buffers[(size_t) i * UDP_MAX_REQUEST];
+      in_iov[i].iov_len = UDP_MAX_REQUEST;
+      memset(&in[i], 0, sizeof in[i]);
+      in[i].msg_hdr.msg_iov = &in_iov[i];
+      in[i].msg_hdr.msg_iovlen = 1;
+      in[i].msg_hdr.msg_name = &addrs[i];
+      in[i].msg_hdr.msg_namelen = sizeof addrs[i];
+    }
+    // waits for the first datagram, then takes the ones already queued
+    int n = recvmmsg(socket_, in, UDP_BATCH, MSG_WAITFORONE, nullptr);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("recvmmsg");
+      return;
+    }
+
+    // the replies of the whole batch, with the client each one goes to
+    vector<string> replies;
+    vector<int> clients;
+    for (int i = 0; i < n; i++) {
+      size_t before = replies.size();
+      HandleDatagram(static_cast<char *>(in_iov[i].iov_base), in[i].msg_len, memcache_, &replies);
+      clients.insert(clients.end(), replies.size() - before, i);
+    }
+
+    size_t sent = 0;
+    while (sent < replies.size()) {
+      int count = (int) min(replies.size() - sent, (size_t) UDP_BATCH);
+      for (int i = 0; i < count; i++) {
+        string& datagram = replies[sent + i];
+        int client = clients[sent + i];
+        out_iov[i].iov_base = &datagram[0];
+        out_iov[i].iov_len = datagram.length();
+        memset(&out[i], 0, sizeof out[i]);
+        out[i].msg_hdr.msg_iov = &out_iov[i];
+        out[i].msg_hdr.msg_iovlen = 1;
+        out[i].msg_hdr.msg_name = &addrs[client];
+        out[i].msg_hdr.msg_namelen = in[client].msg_hdr.msg_namelen;
+      }
+      // sendmmsg stops at a datagram that fails, and only reports the
+      // error when that datagram comes first
+      int ret = sendmmsg(socket_, out, count, 0);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // UDP makes no promise, the clients retry the requests they
+        // got no reply to
+        bool full = errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS;
+        perror("sendmmsg");
+        if (full) {
+          // the socket is out of buffers, the rest would fail too
+          break;
+        }
+        // this datagram cannot be sent, the others of the batch still go
+        ret = 1;
+      }
+      sent += ret;
+    }
+  }
+}
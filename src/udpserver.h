@@ -0,0 +1,55 @@
+#ifndef udpserver_h
+#define udpserver_h
+
+#include <string>
+#include <vector>
+#include "memcache.h"
+
+using namespace std;
+
+#define UDP_HEADER_SIZE 8 // request id, sequence number, datagram count, reserved
+#define UDP_MAX_DATAGRAM 1400 // the largest reply datagram, header included
+#define UDP_MAX_REQUEST (16 * 1024) // the largest request datagram
+#define UDP_BATCH 64 // datagrams received or sent by one system call
+
+/*
+ * The UDP listener for get traffic. Every datagram starts with the
+ * memcached UDP frame header: the request id, the sequence number of the
+ * datagram, the number of datagrams of the message and 2 reserved bytes,
+ * in network byte order. A request must fit in one datagram and may only
+ * hold 'get' and 'gets' commands. The reply is split over as many
+ * datagrams as it needs, all with the request id of the request, and a
+ * miss is answered with a datagram without data.
+ * The server keeps no state per client. Its thread receives and sends
+ * batches of datagrams with recvmmsg and sendmmsg, and with SetReusePort
+ * several servers started on the same port share the datagrams, since
+ * the socket is bound with SO_REUSEPORT
+ */
+class UdpServer {
+ public:
+  UdpServer(string port, Cache* memcache);
+  ~UdpServer();
+
+  // binds the socket with SO_REUSEPORT, for several servers that share
+  // the port; called before init
+  void SetReusePort(bool reuse_port) { reuse_port_ = reuse_port; }
+
+  // binds the socket
+  int init();
+
+  // serves the requests forever
+  void run();
+
+  // runs the request in a datagram and fills replies with the datagrams
+  // of the reply, leaves it empty if the datagram is not a request
+  static void HandleDatagram(const char *data, size_t len, Cache* memcache,
+                             vector<string> *replies);
+
+ private:
+  string port_;
+  Cache *memcache_;
+  int socket_;
+  bool reuse_port_; // the socket shares the port with other servers
+};
+
+#endif //udpserver_h
@@ -0,0 +1,212 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "uring.h"
+
+/* Loads and stores of the indexes shared with the kernel */
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+IoUring::IoUring()
+  : ring_fd_(-1), sq_ptr_(MAP_FAILED), sq_size_(0), sqes_(nullptr), sqes_size_(0),
+    sqe_tail_(0), sq_entries_(0), cq_ptr_(MAP_FAILED), cq_size_(0),
+    buf_ring_(nullptr), buf_ring_size_(0), buffers_(nullptr), buffer_size_(0),
+    buffer_count_(0), enter_calls_(0) {
+}
+
+IoUring::~IoUring() {
+  if (buffers_ != nullptr) {
+    munmap(buffers_, (size_t) buffer_count_ * buffer_size_);
+  }
+  if (buf_ring_ != nullptr) {
+    munmap(buf_ring_, buf_ring_size_);
+  }
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+    munmap(cq_ptr_, cq_size_);
+  }
+  if (sq_ptr_ != MAP_FAILED) {
+    munmap(sq_ptr_, sq_size_);
+  }
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+  }
+}
+
+/* Sets up the submission and completion queues and maps them
+ * @param entries: the size of the submission queue
+ * @return: 0 on success, a negative errno if io_uring is not available
+ */
+int IoUring::init(unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof p);
+  ring_fd_ = io_uring_setup(entries, &p);
+  if (ring_fd_ < 0) {
+    return -errno;
+  }
+  // multishot requests need a kernel that never drops completions
+  if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_FAST_POLL)) {
+    return -EOPNOTSUPP;
+  }
+
+  sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size_ = cq_size_ = sq_size_ > cq_size_ ? sq_size_ : cq_size_;
+  }
+  sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED) {
+    return -errno;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr_ = sq_ptr_;
+  } else {
+    cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ptr_ == MAP_FAILED) {
+      return -errno;
+    }
+  }
+  sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return -errno;
+  }
+  sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+  char *sq = static_cast<char *>(sq_ptr_);
+  sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+  sq_entries_ = p.sq_entries;
+  sqe_tail_ = *sq_tail_;
+
+  char *cq = static_cast<char *>(cq_ptr_);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+  return 0;
+}
+
+/* Registers a ring of provided buffers. A receive with IOSQE_BUFFER_SELECT
+ * and this group id takes a buffer from the ring when data arrives, so
+ * idle connections do not hold any buffer
+ * @param group_id: the buffer group id
+ * @param count: the number of buffers, a power of 2
+ * @param size: the size of each buffer
+ * @return: 0 on success, a negative errno on failure
+ */
+int IoUring::registerBuffers(uint16_t group_id, unsigned count, unsigned size) {
+  buf_ring_size_ = count * sizeof(struct io_uring_buf);
+  void *ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    return -errno;
+  }
+  buf_ring_ = static_cast<struct io_uring_buf_ring *>(ring);
+  void *buffers = mmap(nullptr, (size_t) count * size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers == MAP_FAILED) {
+    return -errno;
+  }
+  buffers_ = static_cast<char *>(buffers);
+  buffer_size_ = size;
+  buffer_count_ = count;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+  reg.ring_entries = count;
+  reg.bgid = group_id;
+  if (io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return -errno;
+  }
+  for (unsigned i = 0; i < count; i++) {
+    recycleBuffer(i);
+  }
+  return 0;
+}
+
+/* Gives a provided buffer back to the ring
+ * @param id: the buffer id from the completion flags
+ */
+void IoUring::recycleBuffer(uint16_t id) {
+  unsigned short tail = buf_ring_->tail;
+  // not buf_ring_->bufs, in C++ the empty struct that header puts before
+  // the array takes a byte and moves the array off the kernel layout
+  struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(buf_ring_) +
+                             (tail & (buffer_count_ - 1));
+  buf->addr = reinterpret_cast<uint64_t>(buffer(id));
+  buf->len = buffer_size_;
+  buf->bid = id;
+  store_release(&buf_ring_->tail, (unsigned short) (tail + 1));
+}
+
+/* Returns a cleared submission queue entry. A full queue is not submitted
+ * here, the caller decides when to enter the kernel
+ * @return: the entry, nullptr if the queue is full
+ */
+struct io_uring_sqe *IoUring::getSqe() {
+  if (sqe_tail_ - load_acquire(sq_head_) >= sq_entries_) {
+    return nullptr;
+  }
+  unsigned index = sqe_tail_ & *sq_mask_;
+  struct io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0, sizeof *sqe);
+  sq_array_[index] = index;
+  sqe_tail_++;
+  return sqe;
+}
+
+/* Publishes the queued entries and enters the kernel once, to submit them
+ * and to wait for completions
+ * @param wait_nr: the number of completions to wait for
+ * @return: the number of entries submitted, a negative errno on failure
+ */
+int IoUring::submitAndWait(unsigned wait_nr) {
+  unsigned to_submit = sqe_tail_ - *sq_tail_;
+  store_release(sq_tail_, sqe_tail_);
+  if (to_submit == 0 && wait_nr == 0) {
+    return 0;
+  }
+  for (;;) {
+    enter_calls_++;
+    int ret = io_uring_enter(ring_fd_, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    return ret < 0 ? -errno : ret;
+  }
+}
+
+struct io_uring_cqe *IoUring::peekCqe() {
+  unsigned head = *cq_head_;
+  if (head == load_acquire(cq_tail_)) {
+    return nullptr;
+  }
+  return &cqes_[head & *cq_mask_];
+}
+
+void IoUring::cqeSeen() {
+  store_release(cq_head_, *cq_head_ + 1);
+}
@@ -0,0 +1,74 @@
+#ifndef uring_h
+#define uring_h
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A minimal io_uring, set up with the raw system calls: a submission
+ * queue, a completion queue, and one ring of provided buffers that
+ * multishot receives pick their buffers from
+ */
+class IoUring {
+ public:
+  IoUring();
+  ~IoUring();
+
+  // sets up the rings, returns 0 or a negative errno
+  int init(unsigned entries);
+
+  // registers count buffers of size bytes as buffer group group_id,
+  // returns 0 or a negative errno
+  int registerBuffers(uint16_t group_id, unsigned count, unsigned size);
+
+  // returns a cleared submission queue entry, nullptr if the queue is
+  // full until the queued entries are submitted
+  struct io_uring_sqe *getSqe();
+
+  // submits the queued entries and waits for at least wait_nr completions,
+  // returns the number of entries submitted or a negative errno
+  int submitAndWait(unsigned wait_nr);
+
+  // returns the next completion, nullptr if there is none
+  struct io_uring_cqe *peekCqe();
+
+  // marks the completion returned by peekCqe() as consumed
+  void cqeSeen();
+
+  // the data of a provided buffer, and giving the buffer back to the ring
+  char *buffer(uint16_t id) const { return buffers_ + (size_t) id * buffer_size_; }
+  void recycleBuffer(uint16_t id);
+
+  // number of io_uring_enter calls made, for the benchmarks
+  uint64_t enterCalls() const { return enter_calls_; }
+
+ private:
+  int ring_fd_;
+  // submission queue
+  void *sq_ptr_;
+  size_t sq_size_;
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned *sq_mask_;
+  unsigned *sq_array_;
+  struct io_uring_sqe *sqes_;
+  size_t sqes_size_;
+  unsigned sqe_tail_; // entries queued, not yet published to the kernel
+  unsigned sq_entries_;
+  // completion queue
+  void *cq_ptr_;
+  size_t cq_size_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned *cq_mask_;
+  struct io_uring_cqe *cqes_;
+  // provided buffers
+  struct io_uring_buf_ring *buf_ring_;
+  size_t buf_ring_size_;
+  char *buffers_;
+  unsigned buffer_size_;
+  unsigned buffer_count_;
+  uint64_t enter_calls_;
+};
+#endif //uring_h
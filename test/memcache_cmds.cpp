@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <vector>
 #include <thread>
 #include "gtest/gtest.h"
@@ -45,7 +46,7 @@ TEST(memcache, setCmdStrwithnoreply) {
   cmd_str += "0 900 9 noreply\r\n";
   cmd_str += "memcached\r\n";
   std::string result = ParseSetCmd(cmd_str, cache.get(), cmd_str.length());
-  ASSERT_EQ(result, "STORED\r\n");
+  ASSERT_EQ(result, "");
   ASSERT_EQ(cache->NumEntries(), 1);
   std::string key = "tutorialspoint";
   time_t exptime = 900;
@@ -210,3 +211,215 @@ TEST(memcache, stressTest) {
   }
 }
 
+
+// add only stores new keys, replace only existing ones
+TEST(memcache, addAndReplace) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string cmd_str = "replace key1 0 0 5\r\nvalue\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "NOT_STORED\r\n");
+  cmd_str = "add key1 0 0 5\r\nvalue\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  cmd_str = "add key1 0 0 6\r\nvalue2\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "NOT_STORED\r\n");
+  cmd_str = "replace key1 7 0 6\r\nvalue3\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  ASSERT_EQ(ParseGetCmd("get key1\r\n", cache.get()), "VALUE key1 7 6\r\nvalue3\r\n");
+}
+
+// append and prepend keep the flags of the stored entry
+TEST(memcache, appendAndPrepend) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string cmd_str = "append list 0 0 2\r\n,c\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "NOT_STORED\r\n");
+  cmd_str = "set list 5 0 1\r\nb\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  cmd_str = "append list 0 0 2\r\n,c\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  cmd_str = "prepend list 0 0 2\r\na,\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  ASSERT_EQ(ParseGetCmd("get list\r\n", cache.get()), "VALUE list 5 5\r\na,b,c\r\n");
+
+  // while a reader holds the entry, appending copies it instead
+  std::vector<ItemHandle> items;
+  cache->getEntries({"list"}, &items);
+  cmd_str = "append list 0 0 2\r\n,d\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  ASSERT_EQ(std::string(items[0]->data, items[0]->bytes), "a,b,c");
+  ASSERT_EQ(ParseGetCmd("get list\r\n", cache.get()), "VALUE list 5 7\r\na,b,c,d\r\n");
+}
+
+// a set allocates exactly its data, an append leaves room for the next one
+TEST(memcache, appendRoundsUpBuffer) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  std::string cmd_str = "set list 0 0 100\r\n" + std::string(100, 'a') + "\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  const char *data;
+  {
+    std::vector<ItemHandle> items;
+    cache->getEntries({"list"}, &items);
+    EXPECT_EQ(items[0]->DataCapacity(), 100);
+  }
+  cmd_str = "append list 0 0 1\r\nb\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  {
+    std::vector<ItemHandle> items;
+    cache->getEntries({"list"}, &items);
+    EXPECT_GT(items[0]->DataCapacity(), 101);
+    data = items[0]->data;
+  }
+  // the next append fits in the buffer
+  cmd_str = "append list 0 0 1\r\nc\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  std::vector<ItemHandle> items;
+  cache->getEntries({"list"}, &items);
+  EXPECT_EQ(items[0]->data, data);
+  EXPECT_EQ(items[0]->bytes, 102);
+}
+
+// cas only stores the entry if it was not updated since the gets
+TEST(memcache, getsAndCas) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string cmd_str = "cas key1 0 0 5 1\r\nvalue\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "NOT_FOUND\r\n");
+  cmd_str = "set key1 0 0 5\r\nvalue\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+
+  std::vector<ItemHandle> items;
+  cache->getEntries({"key1"}, &items);
+  uint64_t cas = items[0]->cas;
+  items.clear();
+  std::string expected_str = "VALUE key1 0 5 " + std::to_string(cas) + "\r\nvalue\r\n";
+  ASSERT_EQ(ParseGetCmd("gets key1\r\n", cache.get()), expected_str);
+
+  cmd_str = "cas key1 0 0 6 " + std::to_string(cas) + "\r\nvalue2\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  cmd_str = "cas key1 0 0 6 " + std::to_string(cas) + " noreply\r\nvalue3\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "");
+  ASSERT_EQ(ParseGetCmd("get key1\r\n", cache.get()), "VALUE key1 0 6\r\nvalue2\r\n");
+}
+
+// incr and decr update a decimal counter
+TEST(memcache, incrAndDecr) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  ASSERT_EQ(ParseArithmeticCmd("incr counter 1\r\n", cache.get()), "NOT_FOUND\r\n");
+  std::string cmd_str = "set counter 3 0 2\r\n98\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  ASSERT_EQ(ParseArithmeticCmd("incr counter 1\r\n", cache.get()), "99\r\n");
+  // the number of digits grows
+  ASSERT_EQ(ParseArithmeticCmd("incr counter 1\r\n", cache.get()), "100\r\n");
+  ASSERT_EQ(ParseGetCmd("get counter\r\n", cache.get()), "VALUE counter 3 3\r\n100\r\n");
+  // and shrinks again
+  ASSERT_EQ(ParseArithmeticCmd("decr counter 95\r\n", cache.get()), "5\r\n");
+  ASSERT_EQ(ParseGetCmd("get counter\r\n", cache.get()), "VALUE counter 3 1\r\n5\r\n");
+  // decr stops at 0, incr wraps around at 2^64
+  ASSERT_EQ(ParseArithmeticCmd("decr counter 10\r\n", cache.get()), "0\r\n");
+  ASSERT_EQ(ParseArithmeticCmd("incr counter 18446744073709551615\r\n", cache.get()), "18446744073709551615\r\n");
+  ASSERT_EQ(ParseArithmeticCmd("incr counter 2\r\n", cache.get()), "1\r\n");
+
+  ASSERT_EQ(ParseArithmeticCmd("incr counter abc\r\n", cache.get()), "CLIENT_ERROR invalid numeric delta argument\r\n");
+  cmd_str = "set name 0 0 3\r\nabc\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  ASSERT_EQ(ParseArithmeticCmd("incr name 1\r\n", cache.get()), "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+}
+
+void incrThreadCmd(Cache* cache, int count) {
+  for (int i = 0; i < count; i++) {
+    ParseArithmeticCmd("incr hot" + std::to_string(i % 2) + " 1\r\n", cache);
+  }
+}
+
+// concurrent increments of the same counters are never lost
+TEST(memcache, incrConcurrent) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  for (int i = 0; i < 2; i++) {
+    std::string cmd_str = "set hot" + std::to_string(i) + " 0 0 1\r\n0\r\n";
+    ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  }
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.push_back(std::thread(incrThreadCmd, cache.get(), 1000));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(ParseGetCmd("get hot0 hot1\r\n", cache.get()),
+            "VALUE hot0 0 4\r\n4000\r\nVALUE hot1 0 4\r\n4000\r\n");
+}
+
+// delete removes an entry
+TEST(memcache, deleteCmd) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string cmd_str = "set key1 0 0 5\r\nvalue\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  ASSERT_EQ(ParseDeleteCmd("delete key1\r\n", cache.get()), "DELETED\r\n");
+  ASSERT_EQ(cache->NumEntries(), 0);
+  ASSERT_EQ(ParseDeleteCmd("delete key1\r\n", cache.get()), "NOT_FOUND\r\n");
+  ASSERT_EQ(ParseDeleteCmd("delete key1 0 1\r\n", cache.get()), "CLIENT_ERROR wrong command format\r\n");
+}
+
+// touch and gat update the expiry time without storing the data again
+TEST(memcache, touchAndGat) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  ASSERT_EQ(ParseTouchCmd("touch key1 100\r\n", cache.get()), "NOT_FOUND\r\n");
+  std::string cmd_str = "set key1 0 0 5\r\nvalue\r\n";
+  ASSERT_EQ(ParseStorageCmd(cmd_str, cache.get(), cmd_str.length()), "STORED\r\n");
+  ASSERT_EQ(ParseTouchCmd("touch key1 100\r\n", cache.get()), "TOUCHED\r\n");
+  std::string result = ParseMetaGetCmd("mg key1 t\r\n", cache.get());
+  ASSERT_TRUE(result == "HD t100\r\n" || result == "HD t99\r\n");
+
+  ASSERT_EQ(ParseGetCmd("gat 0 key1 key2\r\n", cache.get()), "VALUE key1 0 5\r\nvalue\r\n");
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 t\r\n", cache.get()), "HD t-1\r\n");
+
+  std::vector<ItemHandle> items;
+  cache->getEntries({"key1"}, &items);
+  std::string expected_str = "VALUE key1 0 5 " + std::to_string(items[0]->cas) + "\r\nvalue\r\n";
+  ASSERT_EQ(ParseGetCmd("gats 200 key1\r\n", cache.get()), expected_str);
+  result = ParseMetaGetCmd("mg key1 t\r\n", cache.get());
+  ASSERT_TRUE(result == "HD t200\r\n" || result == "HD t199\r\n");
+
+  // a negative expiry time expires the entry
+  ASSERT_EQ(ParseGetCmd("gat -1 key1\r\n", cache.get()), "VALUE key1 0 5\r\nvalue\r\n");
+  ASSERT_EQ(ParseGetCmd("get key1\r\n", cache.get()), "");
+  ASSERT_EQ(ParseGetCmd("gat key1\r\n", cache.get()), "CLIENT_ERROR invalid exptime argument\r\n");
+}
+
+// noreply suppresses the reply, a pipelined batch of noreply commands
+// produces no reply at all
+TEST(memcache, noreplyBatch) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string batch = "set key1 0 0 1 noreply\r\n1\r\nadd key1 0 0 1 noreply\r\n2\r\n";
+  batch += "incr key1 5 noreply\r\ntouch key1 100 noreply\r\nset key2 0 0 1 noreply\r\n2\r\n";
+  batch += "delete key2 noreply\r\ndelete key3 noreply\r\n";
+  ASSERT_EQ(ProcessCommands(batch, cache.get(), batch.length()), "");
+  ASSERT_EQ(ParseGetCmd("get key1 key2\r\n", cache.get()), "VALUE key1 0 1\r\n6\r\n");
+  // errors in the command itself are still reported
+  ASSERT_EQ(ParseArithmeticCmd("incr key1 abc noreply\r\n", cache.get()),
+            "CLIENT_ERROR invalid numeric delta argument\r\n");
+}
+
+// only complete commands are taken from the data received from a client
+TEST(memcache, completeCommandsLength) {
+  std::string batch = "set key1 0 0 5\r\nvalue\r\nget key1\r\n";
+  ASSERT_EQ(CompleteCommandsLength(batch, batch.length()), batch.length());
+  // the data block of the set has not arrived yet
+  ASSERT_EQ(CompleteCommandsLength(batch, 16), 0);
+  ASSERT_EQ(CompleteCommandsLength(batch, 25), 23);
+  ASSERT_EQ(CompleteCommandsLength(batch, batch.length() - 1), 23);
+}
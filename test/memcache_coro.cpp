@@ -0,0 +1,121 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "gtest/gtest.h"
+#include "memserver.h"
+
+/*
+ * The unit tests in this file verify the coroutine loop over a socket: a
+ * pipelined batch, a command received in pieces, and large replies to a
+ * client that only reads once it sent all its requests. Without the
+ * MEMCACHE_COROUTINES build the server falls back to epoll, which has to
+ * pass them too
+ */
+
+#define CORO_TEST_PORT 11611
+
+// starts the server once, its loop runs until the tests exit
+static void StartServer() {
+  static bool started = false;
+  if (started) {
+    return;
+  }
+  started = true;
+  ThreadPool *pool = new ThreadPool(2);
+  pool->init();
+  CacheServer *server = new CacheServer(std::to_string(CORO_TEST_PORT), pool, new Cache(),
+                                        LoopCoroutine);
+  ASSERT_EQ(server->init(), 0);
+#ifdef MEMCACHE_COROUTINES
+  EXPECT_EQ(server->loop(), LoopCoroutine);
+#endif
+  std::thread([server]() { server->WaitForClientRequests(); }).detach();
+}
+
+static int Connect() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(CORO_TEST_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void SendAll(int fd, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.length()) {
+    ssize_t n = send(fd, data.data() + sent, data.length() - sent, 0);
+    ASSERT_GT(n, 0);
+    sent += n;
+  }
+}
+
+static std::string Receive(int fd, size_t length) {
+  std::string data;
+  char buffer[16 * 1024];
+  while (data.length() < length) {
+    ssize_t n = recv(fd, buffer, sizeof buffer, 0);
+    if (n <= 0) {
+      break;
+    }
+    data.append(buffer, n);
+  }
+  return data;
+}
+
+TEST(memcache, coroutinePipeline) {
+  StartServer();
+  int fd = Connect();
+  ASSERT_GE(fd, 0);
+  SendAll(fd, "set a 0 0 1\r\nx\r\nget a\r\nset b 0 0 2\r\nyz\r\nget b a\r\n");
+  std::string expected = "STORED\r\nVALUE a 0 1\r\nx\r\nSTORED\r\n"
+                         "VALUE b 0 2\r\nyz\r\nVALUE a 0 1\r\nx\r\n";
+  EXPECT_EQ(Receive(fd, expected.length()), expected);
+  close(fd);
+}
+
+TEST(memcache, coroutinePartialRead) {
+  StartServer();
+  int fd = Connect();
+  ASSERT_GE(fd, 0);
+  std::string request = "set partial 0 0 10\r\n0123456789\r\nget partial\r\n";
+  for (size_t i = 0; i < request.length(); i += 7) {
+    SendAll(fd, request.substr(i, 7));
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  std::string expected = "STORED\r\nVALUE partial 0 10\r\n0123456789\r\n";
+  EXPECT_EQ(Receive(fd, expected.length()), expected);
+  close(fd);
+}
+
+TEST(memcache, coroutineBackpressure) {
+  StartServer();
+  int fd = Connect();
+  ASSERT_GE(fd, 0);
+  // larger than the inline limit, the set runs on the threadpool
+  std::string value(100000, 'v');
+  SendAll(fd, "set large 0 0 100000\r\n" + value + "\r\n");
+  EXPECT_EQ(Receive(fd, 8), "STORED\r\n");
+  // 4MB of replies, far more than the socket buffers hold
+  std::string gets;
+  for (int i = 0; i < 40; i++) {
+    gets += "get large\r\n";
+  }
+  SendAll(fd, gets);
+  std::string reply = "VALUE large 0 100000\r\n" + value + "\r\n";
+  std::string received = Receive(fd, 40 * reply.length());
+  ASSERT_EQ(received.length(), 40 * reply.length());
+  for (int i = 0; i < 40; i++) {
+    EXPECT_EQ(received.compare(i * reply.length(), reply.length(), reply), 0);
+  }
+  close(fd);
+}
@@ -0,0 +1,116 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Threadpool.h"
+
+/*
+ * The unit tests in this file verify the lanes of the threadpool: no
+ * more workers than the bulk share run bulk tasks, fast tasks run while
+ * bulk tasks hold that share, a full bulk queue blocks neither a worker
+ * nor another thread, and a strand keeps the order of its tasks across
+ * lanes
+ */
+
+static bool WaitFor(const std::atomic<int>& count, int value) {
+  for (int i = 0; i < 1000 && count < value; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  return count >= value;
+}
+
+TEST(memcache, bulkLaneShare) {
+  ThreadPool pool(4);
+  pool.setBulkWorkers(2);
+  pool.init();
+  std::atomic<bool> release(false);
+  std::atomic<int> running(0);
+  std::atomic<int> most(0);
+  std::atomic<int> bulk_done(0);
+  for (int i = 0; i < 6; i++) {
+    pool.post(ThreadPool::LaneBulk, [&]() {
+      int now = ++running;
+      int seen = most;
+      while (now > seen && !most.compare_exchange_weak(seen, now)) {
+      }
+      while (!release) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      running--;
+      bulk_done++;
+    });
+  }
+  // the bulk tasks hold their share, the other workers run these
+  std::atomic<int> fast_done(0);
+  for (int i = 0; i < 100; i++) {
+    pool.post([&fast_done]() { fast_done++; });
+  }
+  EXPECT_TRUE(WaitFor(fast_done, 100));
+  EXPECT_EQ(bulk_done, 0);
+  release = true;
+  EXPECT_TRUE(WaitFor(bulk_done, 6));
+  EXPECT_EQ(most, 2);
+  pool.shutdown();
+}
+
+TEST(memcache, bulkQueueFull) {
+  ThreadPool pool(2);
+  pool.setBulkWorkers(1);
+  pool.init();
+  std::atomic<bool> release(false);
+  std::atomic<int> bulk_done(0);
+  // holds the only bulk worker while the queue fills up
+  pool.post(ThreadPool::LaneBulk, [&]() {
+    while (!release) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    bulk_done++;
+  });
+  const int tasks = 2 * POOL_BULK_QUEUE_SIZE;
+  std::vector<int> order;
+  for (int i = 0; i < tasks; i++) {
+    pool.post(ThreadPool::LaneBulk, [&order, &bulk_done, i]() {
+      order.push_back(i);
+      bulk_done++;
+    });
+  }
+  // a worker queues more behind the full queue and goes on
+  std::atomic<int> posted(0);
+  pool.post([&]() {
+    for (int i = 0; i < tasks; i++) {
+      pool.post(ThreadPool::LaneBulk, [&bulk_done]() { bulk_done++; });
+    }
+    posted++;
+  });
+  EXPECT_TRUE(WaitFor(posted, 1));
+  EXPECT_EQ(bulk_done, 0);
+  release = true;
+  EXPECT_TRUE(WaitFor(bulk_done, 2 * tasks + 1));
+  // one bulk worker ran them in the order they were queued
+  ASSERT_EQ(order.size(), (size_t) tasks);
+  for (int i = 0; i < tasks; i++) {
+    EXPECT_EQ(order[i], i);
+  }
+  pool.shutdown();
+}
+
+TEST(memcache, strandOrderAcrossLanes) {
+  ThreadPool pool(4);
+  pool.init();
+  ThreadPool::Strand strand(&pool);
+  std::vector<int> order;
+  std::atomic<int> done(0);
+  for (int i = 0; i < 1000; i++) {
+    ThreadPool::Lane lane = i % 7 < 3 ? ThreadPool::LaneBulk : ThreadPool::LaneFast;
+    strand.post(lane, [&order, &done, i]() {
+      order.push_back(i);
+      done++;
+    });
+  }
+  ASSERT_TRUE(WaitFor(done, 1000));
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(order[i], i);
+  }
+  pool.shutdown();
+}
@@ -0,0 +1,475 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include "gtest/gtest.h"
+#include "memserver.h"
+#include "uring.h"
+
+/*
+ * The unit tests in this file verify the event loops over a socket:
+ * pipelined sets and gets in batches around the inline limit and the
+ * bulk threshold, over TCP and over the unix domain socket, large
+ * replies sent with MSG_ZEROCOPY, also to a client that closes while
+ * their sends are in flight, a port shared only with SO_REUSEPORT, a small batch that may not run inline while the ones
+ * before it are on the threadpool, the submission queue of io_uring
+ * running full, and a
+ * client that sends faster than the workers run its batches and never
+ * reads the replies
+ */
+
+// starts a server on a port the kernel picks, its loop runs until the
+// tests exit; configure is called before init. Without a pool the server
+// gets one of two workers
+static CacheServer *StartServer(ServerLoop loop,
+                                std::function<void(CacheServer *)> configure = nullptr,
+                                ThreadPool *pool = nullptr) {
+  if (pool == nullptr) {
+    pool = new ThreadPool(2);
+    pool->init();
+  }
+  CacheServer *server = new CacheServer("0", pool, new Cache(), loop);
+  if (configure) {
+    configure(server);
+  }
+  if (server->init() != 0) {
+    return nullptr;
+  }
+  std::thread([server]() { server->WaitForClientRequests(); }).detach();
+  return server;
+}
+
+static int Connect(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+    close(fd);
+    return -1;
+  }
+  // a reply that never comes fails the test instead of hanging it
+  struct timeval timeout = {10, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  return fd;
+}
+
+// connects to the unix domain socket of a server
+static int ConnectUnix(const std::string& path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+    close(fd);
+    return -1;
+  }
+  struct timeval timeout = {10, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  return fd;
+}
+
+static void SendAll(int fd, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.length()) {
+    ssize_t n = send(fd, data.data() + sent, data.length() - sent, MSG_NOSIGNAL);
+    ASSERT_GT(n, 0);
+    sent += n;
+  }
+}
+
+static std::string Receive(int fd, size_t length) {
+  std::string data;
+  char buffer[16 * 1024];
+  while (data.length() < length) {
+    ssize_t n = recv(fd, buffer, sizeof buffer, 0);
+    if (n <= 0) {
+      break;
+    }
+    data.append(buffer, n);
+  }
+  return data;
+}
+
+/* A set and a get of the same key, length bytes long unless no value
+ * fits exactly with the digits of its own length in the set
+ * @param key: the key
+ * @param length: the length of the batch
+ * @param reply: filled with the replies to the batch
+ * @return: the batch
+ */
+static std::string Batch(const std::string& key, size_t length, std::string *reply) {
+  std::string get = "get " + key + "\r\n";
+  size_t fixed = std::string("set " + key + " 0 0 \r\n\r\n").length() + get.length();
+  size_t bytes = 1;
+  for (size_t digits = 1; digits < 8; digits++) {
+    bytes = length - fixed - digits;
+    if (std::to_string(bytes).length() == digits) {
+      break;
+    }
+  }
+  std::string header = "set " + key + " 0 0 " + std::to_string(bytes) + "\r\n";
+  std::string value(bytes, (char) ('a' + length % 26));
+  *reply = "STORED\r\nVALUE " + key + " 0 " + std::to_string(bytes) + "\r\n" + value + "\r\n";
+  return header + value + "\r\n" + get;
+}
+
+// The batch lengths of the pipelines: inline, around the inline limit,
+// around the bulk threshold, and a large value
+static const size_t batch_lengths[] = {100, INLINE_LIMIT, INLINE_LIMIT + 1, BULK_THRESHOLD - 1,
+                                       BULK_THRESHOLD, 100000};
+
+// Sends the batches one at a time, each after the reply to the one
+// before, then all of them at once, and checks the bytes of the replies;
+// closes the connection
+static void ExpectPipeline(int fd) {
+  ASSERT_GE(fd, 0);
+  std::string all;
+  std::string all_replies;
+  for (size_t length : batch_lengths) {
+    std::string reply;
+    std::string batch = Batch("p" + std::to_string(length), length, &reply);
+    ASSERT_EQ(batch.length(), length);
+    SendAll(fd, batch);
+    EXPECT_EQ(Receive(fd, reply.length()), reply) << "batch of " << length << " bytes";
+    all += batch;
+    all_replies += reply;
+  }
+  SendAll(fd, all);
+  EXPECT_EQ(Receive(fd, all_replies.length()), all_replies);
+  close(fd);
+}
+
+TEST(memcache, selectLoopPipeline) {
+  CacheServer *server = StartServer(LoopSelect);
+  ASSERT_NE(server, nullptr);
+  ASSERT_EQ(server->loop(), LoopSelect);
+  ExpectPipeline(Connect(server->LocalPort()));
+}
+
+TEST(memcache, epollLoopPipeline) {
+  CacheServer *server = StartServer(LoopEpoll);
+  ASSERT_NE(server, nullptr);
+  ASSERT_EQ(server->loop(), LoopEpoll);
+  ExpectPipeline(Connect(server->LocalPort()));
+}
+
+TEST(memcache, uringLoopPipeline) {
+  CacheServer *server = StartServer(LoopIoUring);
+  ASSERT_NE(server, nullptr);
+  if (server->loop() != LoopIoUring) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+  ExpectPipeline(Connect(server->LocalPort()));
+}
+
+// Holds the only worker while a bulk and a fast batch wait on the strand,
+// and sends a batch small enough to run inline behind them, each on its
+// own: the replies keep the order of the batches. Returns false if the
+// server does not run the loop
+static bool ExpectInlineAfterInFlight(ServerLoop loop) {
+  ThreadPool *pool = new ThreadPool(1);
+  pool->init();
+  std::atomic<bool> release(false);
+  pool->post([&release]() {
+    while (!release) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  CacheServer *server = StartServer(loop, nullptr, pool);
+  if (server == nullptr || server->loop() != loop) {
+    release = true;
+    return false;
+  }
+  int fd = Connect(server->LocalPort());
+  EXPECT_GE(fd, 0);
+  std::string bulk_reply;
+  std::string fast_reply;
+  std::string inline_reply;
+  std::string batches[] = {Batch("order", BULK_THRESHOLD + 100, &bulk_reply),
+                           Batch("order", INLINE_LIMIT + 100, &fast_reply),
+                           Batch("order", 60, &inline_reply)};
+  for (const std::string& batch : batches) {
+    SendAll(fd, batch);
+    // the loop receives the batches one by one
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  release = true;
+  std::string expected = bulk_reply + fast_reply + inline_reply;
+  EXPECT_EQ(Receive(fd, expected.length()), expected);
+  close(fd);
+  return true;
+}
+
+TEST(memcache, selectInlineAfterInFlight) {
+  EXPECT_TRUE(ExpectInlineAfterInFlight(LoopSelect));
+}
+
+TEST(memcache, epollInlineAfterInFlight) {
+  EXPECT_TRUE(ExpectInlineAfterInFlight(LoopEpoll));
+}
+
+TEST(memcache, uringInlineAfterInFlight) {
+  if (!ExpectInlineAfterInFlight(LoopIoUring)) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+}
+
+// Serves the pipeline over a unix domain socket created with mode 0660,
+// returns false if the server does not run the loop
+static bool ExpectUnixSocket(ServerLoop loop) {
+  std::string path = "/tmp/memcache_loops_" + std::to_string(getpid()) + "_" +
+                     std::to_string(loop) + ".sock";
+  CacheServer *server = StartServer(loop, [&path](CacheServer *s) { s->SetUnixSocket(path, 0660); });
+  EXPECT_NE(server, nullptr);
+  if (server == nullptr || server->loop() != loop) {
+    return false;
+  }
+  struct stat st;
+  EXPECT_EQ(stat(path.c_str(), &st), 0);
+  EXPECT_TRUE(S_ISSOCK(st.st_mode));
+  EXPECT_EQ(st.st_mode & 0777, 0660);
+  ExpectPipeline(ConnectUnix(path));
+  unlink(path.c_str());
+  return true;
+}
+
+TEST(memcache, selectUnixSocket) {
+  EXPECT_TRUE(ExpectUnixSocket(LoopSelect));
+}
+
+TEST(memcache, epollUnixSocket) {
+  EXPECT_TRUE(ExpectUnixSocket(LoopEpoll));
+}
+
+TEST(memcache, uringUnixSocket) {
+  if (!ExpectUnixSocket(LoopIoUring)) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+}
+
+// the file descriptors open in the process, the servers' among them
+static int OpenFds() {
+  int count = 0;
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == nullptr) {
+    return -1;
+  }
+  while (readdir(dir) != nullptr) {
+    count++;
+  }
+  closedir(dir);
+  return count;
+}
+
+// Sends replies of 100KB with MSG_ZEROCOPY to a client that reads them
+// all, then to one with a small receive buffer that closes its side
+// while their sends are in flight. The server keeps the socket of the
+// second until the kernel reported every send, and then closes it
+static void ExpectZeroCopy(ServerLoop loop) {
+  CacheServer *server = StartServer(loop, [](CacheServer *s) { s->SetZeroCopyThreshold(64 * 1024); });
+  ASSERT_NE(server, nullptr);
+  ASSERT_EQ(server->loop(), loop);
+  int fd = Connect(server->LocalPort());
+  ASSERT_GE(fd, 0);
+  std::string value(100000, 'z');
+  SendAll(fd, "set zerocopy 0 0 100000\r\n" + value + "\r\n");
+  ASSERT_EQ(Receive(fd, 8), "STORED\r\n");
+  std::string gets;
+  for (int i = 0; i < 20; i++) {
+    gets += "get zerocopy\r\n";
+  }
+  std::string reply = "VALUE zerocopy 0 100000\r\n" + value + "\r\n";
+  std::string replies;
+  for (int i = 0; i < 20; i++) {
+    replies += reply;
+  }
+  SendAll(fd, gets);
+  EXPECT_EQ(Receive(fd, replies.length()), replies);
+
+  int before = OpenFds();
+  int closer = socket(AF_INET, SOCK_STREAM, 0);
+  int rcvbuf = 16 * 1024;
+  setsockopt(closer, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+  struct timeval timeout = {10, 0};
+  setsockopt(closer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(server->LocalPort());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(connect(closer, (struct sockaddr *) &addr, sizeof addr), 0);
+  SendAll(closer, gets);
+  // the replies fill the socket buffers, the last sends wait for room
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  shutdown(closer, SHUT_WR);
+  std::string received;
+  char buffer[64 * 1024];
+  ssize_t n;
+  while ((n = recv(closer, buffer, sizeof buffer, 0)) > 0) {
+    received.append(buffer, n);
+  }
+  // the server dropped the replies it did not send, the data of those
+  // it sent is intact
+  EXPECT_EQ(n, 0);
+  EXPECT_LE(received.length(), replies.length());
+  EXPECT_EQ(replies.compare(0, received.length(), received), 0);
+  close(closer);
+
+  // a request wakes the select loop, which reads the completions of the
+  // closed sockets whenever it wakes up
+  bool released = false;
+  for (int i = 0; i < 100 && !released; i++) {
+    SendAll(fd, "get missing\r\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    released = OpenFds() <= before;
+  }
+  EXPECT_TRUE(released);
+  close(fd);
+}
+
+TEST(memcache, selectZeroCopy) {
+  ExpectZeroCopy(LoopSelect);
+}
+
+TEST(memcache, epollZeroCopy) {
+  ExpectZeroCopy(LoopEpoll);
+}
+
+TEST(memcache, listenerReusePort) {
+  CacheServer *first = StartServer(LoopEpoll);
+  ASSERT_NE(first, nullptr);
+  std::string port = std::to_string(first->LocalPort());
+  ThreadPool pool(1);
+  Cache cache;
+  // a single server does not share the port with one that listens on it
+  CacheServer second(port, &pool, &cache, LoopEpoll);
+  EXPECT_EQ(second.init(), -1);
+  // servers that all set SO_REUSEPORT do
+  CacheServer *shared = StartServer(LoopEpoll, [](CacheServer *s) { s->SetReusePort(true); });
+  ASSERT_NE(shared, nullptr);
+  CacheServer sharing(std::to_string(shared->LocalPort()), &pool, &cache, LoopEpoll);
+  sharing.SetReusePort(true);
+  EXPECT_EQ(sharing.init(), 0);
+}
+
+TEST(memcache, uringFullSubmissionQueue) {
+  IoUring ring;
+  if (ring.init(2) < 0) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+  ASSERT_NE(ring.getSqe(), nullptr);
+  ASSERT_NE(ring.getSqe(), nullptr);
+  // a full queue is not submitted behind the caller's back
+  EXPECT_EQ(ring.getSqe(), nullptr);
+  EXPECT_EQ(ring.submitAndWait(2), 2);
+  EXPECT_NE(ring.getSqe(), nullptr);
+}
+
+TEST(memcache, uringLoopSmallRing) {
+  // two entries: the accept and the wake read fill the queue, and every
+  // receive and send of the connections waits for room at times
+  CacheServer *server = StartServer(LoopIoUring, [](CacheServer *s) { s->SetUringEntries(2); });
+  ASSERT_NE(server, nullptr);
+  if (server->loop() != LoopIoUring) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+  const int connections = 8;
+  int fds[connections];
+  for (int i = 0; i < connections; i++) {
+    fds[i] = Connect(server->LocalPort());
+    ASSERT_GE(fds[i], 0);
+  }
+  for (int i = 0; i < connections; i++) {
+    std::string key = "k" + std::to_string(i);
+    SendAll(fds[i], "set " + key + " 0 0 2\r\nv" + std::to_string(i % 10) + "\r\nget " + key +
+                    "\r\nget " + key + "\r\n");
+  }
+  for (int i = 0; i < connections; i++) {
+    std::string key = "k" + std::to_string(i);
+    std::string value = "VALUE " + key + " 0 2\r\nv" + std::to_string(i % 10) + "\r\n";
+    std::string expected = "STORED\r\n" + value + value;
+    EXPECT_EQ(Receive(fds[i], expected.length()), expected);
+    close(fds[i]);
+  }
+}
+
+// Floods a connection with batches that wait on the strand while the only
+// worker is held, and returns how many bytes the socket took before the
+// server stopped reading; once the worker is released, every batch runs
+static size_t FloodWithoutReading(ServerLoop loop) {
+  ThreadPool *pool = new ThreadPool(1);
+  pool->init();
+  std::atomic<bool> release(false);
+  pool->post([&release]() {
+    while (!release) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  CacheServer *server = StartServer(loop, nullptr, pool);
+  if (server == nullptr || server->loop() != loop) {
+    release = true;
+    return 0;
+  }
+  int fd = Connect(server->LocalPort());
+  EXPECT_GE(fd, 0);
+  int sndbuf = 64 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  // each recv of the server is a batch larger than the inline limit
+  std::string value(1000, 'v');
+  std::string commands;
+  for (int i = 0; i < 64; i++) {
+    commands += "set flood 0 0 1000 noreply\r\n" + value + "\r\n";
+  }
+  const size_t most = 64 * 1024 * 1024;
+  size_t sent = 0;
+  size_t offset = 0;
+  for (int idle = 0; idle < 20 && sent < most;) {
+    ssize_t n = send(fd, commands.data() + offset, commands.length() - offset, MSG_NOSIGNAL);
+    if (n < 0) {
+      idle++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    idle = 0;
+    sent += n;
+    offset = (offset + n) % commands.length();
+  }
+  release = true;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  // the rest of the last batch, then a get behind all of them
+  SendAll(fd, commands.substr(offset) + "get flood\r\n");
+  std::string expected = "VALUE flood 0 1000\r\n" + value + "\r\n";
+  EXPECT_EQ(Receive(fd, expected.length()), expected);
+  close(fd);
+  return sent;
+}
+
+TEST(memcache, epollBacklogPausesReading) {
+  size_t sent = FloodWithoutReading(LoopEpoll);
+  // the batches on the strand count against OUTPUT_LIMIT, the rest of the
+  // data waits in the socket buffers
+  EXPECT_GT(sent, 0);
+  EXPECT_LT(sent, 4 * OUTPUT_LIMIT);
+}
+
+TEST(memcache, uringBacklogPausesReading) {
+  size_t sent = FloodWithoutReading(LoopIoUring);
+  if (sent == 0) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+  EXPECT_LT(sent, 4 * OUTPUT_LIMIT);
+}
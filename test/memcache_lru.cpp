@@ -142,3 +142,64 @@ TEST(memcache, addThreeGetTwoEntries) {
 }
 
 
+
+// Verify that getEntries returns a handle per key, and that a handle stays
+// valid after its entry is replaced
+TEST(memcache, getEntriesBatch) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  for (int i = 0; i < 3; i++) {
+    CacheNode *node = new CacheNode();
+    node->key = std::to_string(i);
+    node->flags = i;
+    node->bytes = 1;
+    node->data = new char[1];
+    node->data[0] = 'a' + i;
+    ASSERT_EQ(cache->addNewEntry(node), Stored);
+  }
+
+  std::vector<std::string> keys = {"2", "missing", "0", "2"};
+  std::vector<ItemHandle> items;
+  cache->getEntries(keys, &items);
+  ASSERT_EQ(items.size(), keys.size());
+  ASSERT_NE(items[0], nullptr);
+  ASSERT_EQ(items[1], nullptr);
+  ASSERT_NE(items[2], nullptr);
+  ASSERT_EQ(items[0], items[3]);
+  ASSERT_EQ(items[2]->flags, 0);
+  ASSERT_EQ(items[2]->data[0], 'a');
+
+  // replace key 0, the handle still refers to the old data
+  CacheNode *node = new CacheNode();
+  node->key = "0";
+  node->bytes = 1;
+  node->data = new char[1];
+  node->data[0] = 'z';
+  ASSERT_EQ(cache->addNewEntry(node), Stored);
+  ASSERT_EQ(items[2]->data[0], 'a');
+
+  // key 1 was the least recently used entry, so it is evicted first
+  node = new CacheNode();
+  node->key = "3";
+  node->bytes = 1;
+  node->data = new char[1];
+  ASSERT_EQ(cache->addNewEntry(node), Stored);
+  ASSERT_EQ(cache->getEntry("1"), nullptr);
+}
+
+// Verify that the header of get replies is rendered when an entry is stored
+TEST(memcache, headerRenderedOnStore) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  CacheNode *node = new CacheNode();
+  node->key = "abcd";
+  node->flags = 421;
+  node->bytes = 3;
+  node->data = new char[3];
+  ASSERT_EQ(cache->addNewEntry(node), Stored);
+
+  std::vector<ItemHandle> items;
+  cache->getEntries({"abcd"}, &items);
+  ASSERT_NE(items[0], nullptr);
+  ASSERT_EQ(items[0]->header, "VALUE abcd 421 3\r\n");
+}
@@ -0,0 +1,133 @@
+#include "gtest/gtest.h"
+#include "memcache.h"
+
+/*
+ * The unit tests in this file verify the meta protocol commands
+ * 'mg', 'ms', 'md' and 'mn'. The flags of a command should select the
+ * fields that are returned, and quiet mode should suppress the common
+ * case replies when a batch of commands is pipelined
+ */
+
+// meta set followed by a meta get of the value and the client flags
+TEST(memcache, metaSetAndGet) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string cmd_str = "ms tutorialspoint 9 F415 T900\r\nmemcached\r\n";
+  std::string result = ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length());
+  ASSERT_EQ(result, "HD\r\n");
+  ASSERT_EQ(cache->NumEntries(), 1);
+  result = ParseMetaGetCmd("mg tutorialspoint v f\r\n", cache.get());
+  ASSERT_EQ(result, "VA 9 f415\r\nmemcached\r\n");
+  result = ParseMetaGetCmd("mg tutorialspoint s k Oabc\r\n", cache.get());
+  ASSERT_EQ(result, "HD s9 ktutorialspoint Oabc\r\n");
+}
+
+// meta get reports the ttl, and whether the entry was fetched before
+TEST(memcache, metaGetTtlAndHit) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string cmd_str = "ms key1 5\r\nvalue\r\n";
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "HD\r\n");
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 t h\r\n", cache.get()), "HD t-1 h0\r\n");
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 h\r\n", cache.get()), "HD h1\r\n");
+  // update the ttl with the T flag
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 T100\r\n", cache.get()), "HD\r\n");
+  std::string result = ParseMetaGetCmd("mg key1 t\r\n", cache.get());
+  ASSERT_TRUE(result == "HD t100\r\n" || result == "HD t99\r\n");
+}
+
+// quiet mode hides misses for mg and successes for ms and md
+TEST(memcache, metaQuietMode) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  ASSERT_EQ(ParseMetaGetCmd("mg missing v\r\n", cache.get()), "EN\r\n");
+  ASSERT_EQ(ParseMetaGetCmd("mg missing v q\r\n", cache.get()), "");
+  std::string cmd_str = "ms key1 5 q\r\nvalue\r\n";
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "");
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 v q\r\n", cache.get()), "VA 5\r\nvalue\r\n");
+  ASSERT_EQ(ParseMetaDeleteCmd("md key1 q\r\n", cache.get()), "");
+  ASSERT_EQ(cache->NumEntries(), 0);
+  ASSERT_EQ(ParseMetaDeleteCmd("md key1 Oxyz\r\n", cache.get()), "NF Oxyz\r\n");
+}
+
+// a pipelined batch of quiet commands only returns the hits and the no-op
+TEST(memcache, metaPipelinedQuietBatch) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string batch = "ms key1 5 q\r\nvalue\r\nms key2 6 q O2\r\nvalue2\r\n";
+  batch += "mg key1 v q O1\r\nmg key3 v q O3\r\nmg key2 v q k\r\nmn\r\n";
+  std::string result = ProcessCommands(batch, cache.get(), batch.length());
+  ASSERT_EQ(result, "VA 5 O1\r\nvalue\r\nVA 6 kkey2\r\nvalue2\r\nMN\r\n");
+}
+
+// a meta delete with the I flag leaves a stale entry that a single client
+// is asked to recache
+TEST(memcache, metaInvalidateStaleWhileRevalidate) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string cmd_str = "ms key1 5\r\nvalue\r\n";
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "HD\r\n");
+  ASSERT_EQ(ParseMetaDeleteCmd("md key1 I\r\n", cache.get()), "HD\r\n");
+  ASSERT_EQ(cache->NumEntries(), 1);
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 v\r\n", cache.get()), "VA 5 W X\r\nvalue\r\n");
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 v\r\n", cache.get()), "VA 5 Z X\r\nvalue\r\n");
+  // recaching the entry clears the stale state
+  cmd_str = "ms key1 6\r\nvalue2\r\n";
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "HD\r\n");
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 v\r\n", cache.get()), "VA 6\r\nvalue2\r\n");
+}
+
+// entries whose ttl has passed are not returned
+TEST(memcache, metaExpiredEntry) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string cmd_str = "ms key1 5 T-1\r\nvalue\r\n";
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "HD\r\n");
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 v\r\n", cache.get()), "EN\r\n");
+  ASSERT_EQ(cache->NumEntries(), 0);
+}
+
+// malformed meta commands
+TEST(memcache, metaBadCommands) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 v\r\n\r\n", cache.get()), "CLIENT_ERROR wrong command format\r\n");
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 x\r\n", cache.get()), "CLIENT_ERROR invalid flag\r\n");
+  std::string cmd_str = "ms key1 9\r\nvalue\r\n";
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "CLIENT_ERROR wrong command format\r\n");
+  ASSERT_EQ(ParseMetaNoopCmd("mn\r\n"), "MN\r\n");
+  ASSERT_EQ(ProcessCommands("mx\r\n", cache.get(), 4), "ERROR\r\n");
+}
+
+// meta set modes and cas compare
+TEST(memcache, metaSetModesAndCas) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(3);
+  ASSERT_NE(cache, nullptr);
+  std::string cmd_str = "ms key1 1 MA\r\nb\r\n";
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "NS\r\n");
+  cmd_str = "ms key1 1 ME\r\nb\r\n";
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "HD\r\n");
+  cmd_str = "ms key1 1 MA\r\nc\r\n";
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "HD\r\n");
+  cmd_str = "ms key1 1 MP\r\na\r\n";
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "HD\r\n");
+
+  std::string result = ParseMetaGetCmd("mg key1 v c\r\n", cache.get());
+  ASSERT_EQ(result.substr(0, 6), "VA 3 c");
+  std::string cas = result.substr(6, result.find("\r\n") - 6);
+  cmd_str = "ms key1 1 C" + cas + " c\r\nd\r\n";
+  result = ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length());
+  ASSERT_EQ(result.substr(0, 4), "HD c");
+  ASSERT_NE(result, "HD c" + cas + "\r\n");
+  ASSERT_EQ(ParseMetaSetCmd(cmd_str, cache.get(), cmd_str.length()), "EX\r\n");
+  ASSERT_EQ(ParseMetaDeleteCmd("md key1 C" + cas + "\r\n", cache.get()), "EX\r\n");
+  ASSERT_EQ(ParseMetaGetCmd("mg key1 v\r\n", cache.get()), "VA 1\r\nd\r\n");
+}
@@ -0,0 +1,87 @@
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "MpmcQueue.h"
+#include "Threadpool.h"
+
+/*
+ * The unit tests in this file verify the lock-free queue of the
+ * threadpool: the order of the items, a full and an empty queue, and
+ * many producers and consumers sharing it without losing or repeating
+ * an item
+ */
+
+TEST(memcache, mpmcQueueFullAndEmpty) {
+  MpmcQueue<int> queue(4);
+  int item;
+  EXPECT_FALSE(queue.dequeue(item));
+  EXPECT_TRUE(queue.empty());
+  for (int i = 0; i < 4; i++) {
+    item = i;
+    EXPECT_TRUE(queue.enqueue(item));
+  }
+  item = 4;
+  EXPECT_FALSE(queue.enqueue(item));
+  EXPECT_EQ(queue.size(), 4);
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(queue.dequeue(item));
+    EXPECT_EQ(item, i);
+  }
+  EXPECT_FALSE(queue.dequeue(item));
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(memcache, mpmcQueueManyThreads) {
+  const int threads = 4;
+  const int items = 50000;
+  MpmcQueue<int> queue(1024);
+  std::atomic<long> sum(0);
+  std::atomic<int> consumed(0);
+  std::vector<std::thread> workers;
+  for (int p = 0; p < threads; p++) {
+    workers.push_back(std::thread([&queue, p]() {
+      for (int i = 1; i <= items; i++) {
+        int item = i;
+        while (!queue.enqueue(item)) {
+          std::this_thread::yield();
+        }
+      }
+    }));
+  }
+  for (int c = 0; c < threads; c++) {
+    workers.push_back(std::thread([&]() {
+      int item;
+      while (consumed < threads * items) {
+        if (queue.dequeue(item)) {
+          sum += item;
+          consumed++;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    }));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  EXPECT_EQ(consumed, threads * items);
+  EXPECT_EQ(sum, (long) threads * items * (items + 1) / 2);
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(memcache, threadpoolRunsEveryTask) {
+  ThreadPool pool(4);
+  pool.init();
+  std::atomic<int> count(0);
+  std::vector<std::future<void>> futures;
+  for (int i = 0; i < 100000; i++) {
+    futures.push_back(pool.submit([&count]() { count++; }));
+  }
+  for (auto& future : futures) {
+    future.wait();
+  }
+  EXPECT_EQ(count, 100000);
+  pool.shutdown();
+}
@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <future>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "options.h"
+#include "threads.h"
+#include "Threadpool.h"
+
+/*
+ * The unit tests in this file verify the options of the server: the
+ * command line, the config file and the command line overriding it,
+ * values that are not valid, and the stack size and the cpus of the
+ * threads they configure
+ */
+
+static int Parse(Options *options, std::vector<std::string> args) {
+  std::vector<char *> argv;
+  for (auto& arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+  return ParseOptions(options, (int) args.size(), argv.data());
+}
+
+TEST(memcache, optionsCommandLine) {
+  Options options;
+  EXPECT_EQ(options.port, PORT);
+  EXPECT_EQ(options.workers, WORKERS);
+  EXPECT_EQ(options.stack_size, 0);
+  EXPECT_EQ(options.pinning, PinNone);
+  EXPECT_EQ(Parse(&options, {"main", "-p", "11311", "-t", "4", "-r", "2", "-k", "256k",
+                             "--pin", "node", "-l", "select", "-s", "-b", "4096",
+                             "--bulk-workers", "3"}), 0);
+  EXPECT_EQ(options.port, "11311");
+  EXPECT_EQ(options.workers, 4);
+  EXPECT_EQ(options.reactors, 2);
+  EXPECT_EQ(options.stack_size, 256 * 1024);
+  EXPECT_EQ(options.pinning, PinNode);
+  EXPECT_EQ(options.loop, LoopSelect);
+  EXPECT_TRUE(options.shards);
+  EXPECT_EQ(options.bulk_threshold, 4096);
+  EXPECT_EQ(options.bulk_workers, 3);
+  EXPECT_EQ(Parse(&options, {"main", "-h"}), 1);
+}
+
+TEST(memcache, optionsNotValid) {
+  Options options;
+  EXPECT_EQ(Parse(&options, {"main", "-t", "0"}), -1);
+  EXPECT_EQ(Parse(&options, {"main", "-p", "70000"}), -1);
+  EXPECT_EQ(Parse(&options, {"main", "-k", "1"}), -1);
+  EXPECT_EQ(Parse(&options, {"main", "-k", "12x"}), -1);
+  EXPECT_EQ(Parse(&options, {"main", "-P", "numa"}), -1);
+  EXPECT_EQ(Parse(&options, {"main", "-x"}), -1);
+  EXPECT_EQ(Parse(&options, {"main", "extra"}), -1);
+  EXPECT_EQ(SetOption(&options, "threads", "4"), -1);
+  EXPECT_EQ(Parse(&options, {"main", "-f", "/nonexistent/memcache.conf"}), -1);
+}
+
+TEST(memcache, optionsStackSizeTooSmall) {
+  // the reactors and the shards need more than PTHREAD_STACK_MIN
+  Options options;
+  EXPECT_EQ(Parse(&options, {"main", "-k", "128k"}), -1);
+  EXPECT_EQ(SetOption(&options, "stack-size", std::to_string(MIN_STACK_SIZE - 1)), -1);
+  EXPECT_EQ(SetOption(&options, "stack-size", std::to_string(MIN_STACK_SIZE)), 0);
+  EXPECT_EQ(options.stack_size, MIN_STACK_SIZE);
+  EXPECT_EQ(SetOption(&options, "stack-size", "0"), 0);
+  EXPECT_EQ(options.stack_size, 0);
+}
+
+TEST(memcache, optionsSizeOverflow) {
+  // 2^54k and 2^44m are 2^64 bytes, one more than a size_t holds
+  Options options;
+  EXPECT_EQ(SetOption(&options, "stack-size", "18014398509481984k"), -1);
+  EXPECT_EQ(SetOption(&options, "stack-size", "17592186044416m"), -1);
+  EXPECT_EQ(SetOption(&options, "stack-size", "18014398509481983k"), 0);
+  EXPECT_EQ(options.stack_size, (size_t) 18014398509481983ULL * 1024);
+}
+
+TEST(memcache, optionsConfigFile) {
+  char path[] = "/tmp/memcache_optionsXXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  std::string config = "# a node with 8 cores\n"
+                       "port = 11411\n"
+                       "workers=6   # two per reactor\n"
+                       "\n"
+                       "  reactors = 3\n"
+                       "stack-size = 1m\n"
+                       "pin = core\n"
+                       "unix-socket = /tmp/memcache.sock\n"
+                       "unix-mode = 0770\n";
+  ASSERT_EQ(write(fd, config.data(), config.length()), (ssize_t) config.length());
+  close(fd);
+
+  Options options;
+  // the command line wins, wherever the file is given
+  EXPECT_EQ(Parse(&options, {"main", "-t", "9", "-f", path}), 0);
+  EXPECT_EQ(options.port, "11411");
+  EXPECT_EQ(options.workers, 9);
+  EXPECT_EQ(options.reactors, 3);
+  EXPECT_EQ(options.stack_size, 1024 * 1024);
+  EXPECT_EQ(options.pinning, PinCore);
+  EXPECT_EQ(options.unix_path, "/tmp/memcache.sock");
+  EXPECT_EQ(options.unix_mode, 0770);
+
+  FILE *f = fopen(path, "a");
+  fprintf(f, "workers\n");
+  fclose(f);
+  EXPECT_EQ(LoadConfig(&options, path), -1);
+  unlink(path);
+}
+
+TEST(memcache, cpuList) {
+  EXPECT_EQ(ParseCpuList("0-3,8,10-11\n"), std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_EQ(ParseCpuList("5"), std::vector<int>({5}));
+  EXPECT_TRUE(ParseCpuList("3-1").empty());
+  EXPECT_TRUE(ParseCpuList("a").empty());
+  std::vector<int> allowed = AllowedCpus();
+  ASSERT_FALSE(allowed.empty());
+  std::vector<int> node = NodeCpus(allowed[0]);
+  EXPECT_NE(std::find(node.begin(), node.end(), allowed[0]), node.end());
+}
+
+TEST(memcache, threadpoolStackAndAffinity) {
+  const size_t stack_size = 512 * 1024;
+  int cpu = AllowedCpus()[0];
+  ThreadPool pool(2);
+  pool.setStackSize(stack_size);
+  pool.setAffinity({{cpu}});
+  ASSERT_EQ(pool.init(), 0);
+  std::future<size_t> size = pool.submit([]() {
+    pthread_attr_t attr;
+    size_t size = 0;
+    pthread_getattr_np(pthread_self(), &attr);
+    pthread_attr_getstacksize(&attr, &size);
+    pthread_attr_destroy(&attr);
+    return size;
+  });
+  std::future<int> running_on = pool.submit([]() { return sched_getcpu(); });
+  EXPECT_EQ(size.get(), stack_size);
+  EXPECT_EQ(running_on.get(), cpu);
+  pool.shutdown();
+}
@@ -0,0 +1,70 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include <thread>
+#include "gtest/gtest.h"
+#include "memcache.h"
+
+/*
+ * The unit tests in this file verify that replies are assembled from
+ * copied and referenced segments, and that they are sent completely
+ * even when the socket only accepts part of them per write
+ */
+
+// copied segments are merged, referenced ones keep their entry alive
+TEST(memcache, responseSegments) {
+  std::shared_ptr<CacheNode> item = std::make_shared<CacheNode>();
+  item->bytes = 4;
+  item->data = new char[4];
+  memcpy(item->data, "data", 4);
+
+  Response response;
+  response.append("VALUE ");
+  response.append("key\r\n");
+  response.appendRef(item->data, item->bytes, item);
+  response.append("\r\n", 2);
+  item.reset();
+  ASSERT_EQ(response.length(), 17);
+  ASSERT_EQ(response.str(), "VALUE key\r\ndata\r\n");
+
+  Response other;
+  other.append(response);
+  other.append("END\r\n");
+  ASSERT_EQ(other.str(), "VALUE key\r\ndata\r\nEND\r\n");
+}
+
+// a multi-get reply larger than the socket buffer is sent completely
+TEST(memcache, responseSendLargeMultiGet) {
+  std::unique_ptr<Cache> cache;
+  cache = std::make_unique<Cache>(100);
+  std::string cmd_get_str = "get";
+  std::string expected_str;
+  for (int i = 0; i < 20; i++) {
+    std::string data(MAX_DATA_LEN, 'a' + i);
+    std::string cmd_set_str = "set " + std::to_string(i) + " 0 0 ";
+    cmd_set_str.append(std::to_string(MAX_DATA_LEN)).append("\r\n").append(data).append("\r\n");
+    ASSERT_EQ(ParseSetCmd(cmd_set_str, cache.get(), cmd_set_str.length()), "STORED\r\n");
+    cmd_get_str.append(" ").append(std::to_string(i));
+    expected_str.append("VALUE " + std::to_string(i) + " 0 " + std::to_string(MAX_DATA_LEN) + "\r\n");
+    expected_str.append(data).append("\r\n");
+  }
+  cmd_get_str.append("\r\n");
+
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  int sndbuf = 4096;
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+  std::string received;
+  std::thread reader([&received, &expected_str, fd = fds[1]]() {
+    char buffer[8192];
+    ssize_t n;
+    while (received.length() < expected_str.length() &&
+           (n = recv(fd, buffer, sizeof buffer, 0)) > 0) {
+      received.append(buffer, n);
+    }
+  });
+  ParseDataFromClient(cmd_get_str, fds[0], cache.get(), cmd_get_str.length());
+  reader.join();
+  close(fds[0]);
+  close(fds[1]);
+  ASSERT_EQ(received, expected_str);
+}
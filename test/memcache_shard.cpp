@@ -0,0 +1,139 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include "gtest/gtest.h"
+#include "shard.h"
+
+/*
+ * The unit tests in this file verify the pieces of the thread-per-core
+ * mode: the ring that carries messages between two shards, the spreading
+ * of the keys over the shards, and a shard that stops reading from a
+ * client that does not read its replies
+ */
+
+TEST(memcache, spscRingFullAndEmpty) {
+  SpscRing<int> ring(4);
+  int item;
+  EXPECT_FALSE(ring.pop(&item));
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(ring.push(i));
+  }
+  EXPECT_FALSE(ring.push(4));
+  EXPECT_TRUE(ring.pop(&item));
+  EXPECT_EQ(item, 0);
+  EXPECT_TRUE(ring.push(4));
+  for (int i = 1; i <= 4; i++) {
+    EXPECT_TRUE(ring.pop(&item));
+    EXPECT_EQ(item, i);
+  }
+  EXPECT_FALSE(ring.pop(&item));
+}
+
+TEST(memcache, spscRingAcrossThreads) {
+  const int count = 100000;
+  SpscRing<int> ring(64);
+  std::thread producer([&ring]() {
+    for (int i = 0; i < count; i++) {
+      while (!ring.push(i)) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  int item;
+  for (int i = 0; i < count; i++) {
+    while (!ring.pop(&item)) {
+      std::this_thread::yield();
+    }
+    ASSERT_EQ(item, i);
+  }
+  producer.join();
+}
+
+TEST(memcache, shardOwner) {
+  int owned[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 1000; i++) {
+    string key = "key" + to_string(i);
+    int owner = Shard::Owner(key, 4);
+    ASSERT_GE(owner, 0);
+    ASSERT_LT(owner, 4);
+    EXPECT_EQ(owner, Shard::Owner(key, 4));
+    EXPECT_EQ(Shard::Owner(key, 1), 0);
+    owned[owner]++;
+  }
+  for (int i = 0; i < 4; i++) {
+    EXPECT_GT(owned[i], 150);
+  }
+}
+
+TEST(memcache, shardPausesReading) {
+  Shard *shard = new Shard(0, 1, "0", CAPACITY);
+  ASSERT_EQ(shard->init(), 0);
+  shard->connect({shard});
+  std::thread([shard]() { shard->run(); }).detach();
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(shard->LocalPort());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(connect(fd, (struct sockaddr *) &addr, sizeof addr), 0);
+  std::string value(10000, 'v');
+  std::string set = "set big 0 0 10000\r\n" + value + "\r\n";
+  ASSERT_EQ(send(fd, set.data(), set.length(), 0), (ssize_t) set.length());
+  char stored[8];
+  ASSERT_EQ(recv(fd, stored, sizeof stored, MSG_WAITALL), 8);
+
+  // every request takes 1KB on the socket and asks for a 10KB reply
+  std::string padding(1000, 'p');
+  std::string request = "set pad 0 0 1000 noreply\r\n" + padding + "\r\nget big\r\n";
+  std::string requests;
+  for (int i = 0; i < 16; i++) {
+    requests += request;
+  }
+  int sndbuf = 64 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  const size_t most = 16 * 1024 * 1024;
+  size_t sent = 0;
+  for (int idle = 0; idle < 20 && sent < most;) {
+    size_t offset = sent % requests.length();
+    ssize_t n = send(fd, requests.data() + offset, requests.length() - offset, MSG_NOSIGNAL);
+    if (n < 0) {
+      idle++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    idle = 0;
+    sent += n;
+  }
+  // the shard held about SHARD_OUTPUT_LIMIT of replies, the rest of the
+  // requests waits in the socket buffers
+  EXPECT_LT(sent, 2 * SHARD_OUTPUT_LIMIT);
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  // the rest of the requests only fit once the replies are read
+  std::string rest = requests.substr(sent % requests.length());
+  std::thread sender([fd, &rest]() { send(fd, rest.data(), rest.length(), 0); });
+  size_t gets = (sent + rest.length()) / request.length();
+  std::string reply = "VALUE big 0 10000\r\n" + value + "\r\n";
+  std::string received;
+  char buffer[64 * 1024];
+  while (received.length() < gets * reply.length()) {
+    ssize_t n = recv(fd, buffer, sizeof buffer, 0);
+    if (n <= 0) {
+      break;
+    }
+    received.append(buffer, n);
+  }
+  sender.join();
+  close(fd);
+  ASSERT_EQ(received.length(), gets * reply.length());
+  for (size_t i = 0; i < gets; i++) {
+    ASSERT_EQ(received.compare(i * reply.length(), reply.length(), reply), 0);
+  }
+}
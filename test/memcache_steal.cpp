@@ -0,0 +1,139 @@
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "WorkStealingDeque.h"
+#include "Threadpool.h"
+
+/*
+ * The unit tests in this file verify the work-stealing deques of the
+ * threadpool: the owner takes its newest item and the thieves the
+ * oldest, a full deque, every item taken once while the owner and the
+ * thieves race, tasks spawned by tasks spreading over the workers, and
+ * a pool destroyed without a shutdown joining its workers first
+ */
+
+TEST(memcache, dequeTakeAndSteal) {
+  WorkStealingDeque<int> deque(4);
+  int items[5] = {0, 1, 2, 3, 4};
+  EXPECT_EQ(deque.take(), nullptr);
+  EXPECT_EQ(deque.steal(), nullptr);
+  EXPECT_TRUE(deque.empty());
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(deque.push(&items[i]));
+  }
+  EXPECT_FALSE(deque.push(&items[4]));
+  EXPECT_EQ(deque.take(), &items[3]);
+  EXPECT_EQ(deque.steal(), &items[0]);
+  EXPECT_EQ(deque.take(), &items[2]);
+  EXPECT_EQ(deque.steal(), &items[1]);
+  EXPECT_EQ(deque.take(), nullptr);
+  EXPECT_EQ(deque.steal(), nullptr);
+  EXPECT_TRUE(deque.empty());
+}
+
+TEST(memcache, dequeOwnerAndThieves) {
+  const int thieves = 3;
+  const int items = 200000;
+  WorkStealingDeque<int> deque(256);
+  std::vector<int> values(items);
+  std::vector<std::atomic<int>> taken(items);
+  for (int i = 0; i < items; i++) {
+    values[i] = i;
+    taken[i] = 0;
+  }
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thieves; t++) {
+    threads.push_back(std::thread([&]() {
+      while (!done || !deque.empty()) {
+        int * item = deque.steal();
+        if (item != nullptr) {
+          taken[*item]++;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    }));
+  }
+  // the owner pushes, and takes one item back for every other push
+  for (int i = 0; i < items; i++) {
+    while (!deque.push(&values[i])) {
+      std::this_thread::yield();
+    }
+    if (i % 2 == 1) {
+      int * item = deque.take();
+      if (item != nullptr) {
+        taken[*item]++;
+      }
+    }
+  }
+  done = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (int i = 0; i < items; i++) {
+    ASSERT_EQ(taken[i], 1) << "item " << i;
+  }
+}
+
+// Each task submits two more until the tree is deep enough
+static void Spawn(ThreadPool * pool, int depth, std::atomic<int> * count,
+                  std::mutex * mutex, std::set<std::thread::id> * threads) {
+  (*count)++;
+  {
+    std::lock_guard<std::mutex> lock(*mutex);
+    threads->insert(std::this_thread::get_id());
+  }
+  if (depth > 0) {
+    pool->submit(Spawn, pool, depth - 1, count, mutex, threads);
+    pool->submit(Spawn, pool, depth - 1, count, mutex, threads);
+  }
+}
+
+TEST(memcache, threadpoolRunsSpawnedTasks) {
+  const int depth = 14;
+  ThreadPool pool(4);
+  pool.init();
+  std::atomic<int> count(0);
+  std::mutex mutex;
+  std::set<std::thread::id> threads;
+  pool.submit(Spawn, &pool, depth, &count, &mutex, &threads);
+  for (int i = 0; i < 1000 && count < (2 << depth) - 1; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(count, (2 << depth) - 1);
+  pool.shutdown();
+  // on a single core the first worker may run the tree alone
+  if (std::thread::hardware_concurrency() > 1) {
+    EXPECT_GT(threads.size(), 1);
+  }
+}
+
+TEST(memcache, threadpoolDestroyedWhileRunning) {
+  std::atomic<bool> started(false);
+  std::atomic<bool> finished(false);
+  {
+    ThreadPool pool(2);
+    pool.init();
+    // the running task queues more on its deque, which the destructor frees
+    pool.post([&pool, &started, &finished]() {
+      for (int i = 0; i < 100; i++) {
+        pool.post([]() { std::this_thread::sleep_for(std::chrono::milliseconds(1)); });
+      }
+      started = true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      finished = true;
+    });
+    while (!started) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  // the destructor waited for the running task
+  EXPECT_TRUE(finished);
+}
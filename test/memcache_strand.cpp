@@ -0,0 +1,60 @@
+#include <chrono>
+#include <future>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Threadpool.h"
+
+/*
+ * The unit tests in this file verify the strands of the threadpool: the
+ * tasks of one strand run one at a time in the order they were submitted,
+ * while different strands run in parallel
+ */
+
+TEST(memcache, strandRunsInOrder) {
+  ThreadPool pool(4);
+  pool.init();
+  ThreadPool::Strand strand(&pool);
+  std::vector<int> order;
+  std::future<void> last;
+  for (int i = 0; i < 10000; i++) {
+    last = strand.submit([&order](int n) { order.push_back(n); }, i);
+  }
+  last.wait();
+  ASSERT_EQ(order.size(), 10000);
+  for (int i = 0; i < 10000; i++) {
+    EXPECT_EQ(order[i], i);
+  }
+  pool.shutdown();
+}
+
+TEST(memcache, strandsRunInParallel) {
+  ThreadPool pool(2);
+  pool.init();
+  ThreadPool::Strand first(&pool);
+  ThreadPool::Strand second(&pool);
+  std::promise<void> started;
+  std::future<void> started_future = started.get_future();
+  // the task of the first strand waits for the task of the second one,
+  // which only works if the second strand is not queued behind it
+  auto waiting = first.submit([&started_future]() {
+    return started_future.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+  });
+  second.submit([&started]() { started.set_value(); });
+  EXPECT_TRUE(waiting.get());
+  pool.shutdown();
+}
+
+TEST(memcache, strandOutlivesOwner) {
+  ThreadPool pool(2);
+  pool.init();
+  std::future<int> result;
+  {
+    ThreadPool::Strand strand(&pool);
+    for (int i = 0; i < 100; i++) {
+      strand.submit([]() {});
+    }
+    result = strand.submit([]() { return 42; });
+  }
+  EXPECT_EQ(result.get(), 42);
+  pool.shutdown();
+}
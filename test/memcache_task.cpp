@@ -0,0 +1,173 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Task.h"
+#include "Threadpool.h"
+
+/*
+ * The unit tests in this file verify the tasks of the threadpool and the
+ * post API: a task keeps its captures inline, moves them with itself and
+ * destroys them once, tasks posted to the pool and to a strand all run,
+ * the strand's in order, and once warmed up posting allocates nothing,
+ * which a count of the calls to operator new on every thread checks
+ */
+
+static thread_local uint64_t allocations = 0;
+
+void * operator new(size_t size) {
+  allocations++;
+  void * p = malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void * p) noexcept {
+  free(p);
+}
+
+void operator delete(void * p, size_t) noexcept {
+  free(p);
+}
+
+static void WaitFor(const std::atomic<bool>& flag) {
+  for (int i = 0; i < 1000 && !flag; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+// Posts n tasks from the worker of a pool of one, to the worker's deque,
+// and returns what the worker allocated until the last one ran
+static uint64_t PostFromWorker(ThreadPool& pool, int n) {
+  std::atomic<int> done(0);
+  std::atomic<uint64_t> before(0);
+  std::atomic<uint64_t> after(0);
+  std::atomic<bool> finished(false);
+  pool.post([&]() {
+    before = allocations;
+    for (int i = 0; i < n; i++) {
+      pool.post([&]() {
+        if (++done == n) {
+          after = allocations;
+          finished = true;
+        }
+      });
+    }
+  });
+  WaitFor(finished);
+  EXPECT_TRUE(finished);
+  return after - before;
+}
+
+// Posts n tasks to a strand, while the only worker is held if hold is
+// set, and returns what this thread and the worker allocated
+static uint64_t PostToStrand(ThreadPool& pool, ThreadPool::Strand& strand, int n, bool hold) {
+  std::atomic<bool> held(!hold);
+  pool.post([&held]() {
+    while (!held) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  std::atomic<int> done(0);
+  std::atomic<uint64_t> worker_before(0);
+  std::atomic<uint64_t> worker_after(0);
+  std::atomic<bool> finished(false);
+  uint64_t before = allocations;
+  for (int i = 0; i < n; i++) {
+    strand.post([&]() {
+      int count = ++done;
+      if (count == 1) {
+        worker_before = allocations;
+      }
+      if (count == n) {
+        worker_after = allocations;
+        finished = true;
+      }
+    });
+  }
+  uint64_t posted = allocations - before;
+  held = true;
+  WaitFor(finished);
+  EXPECT_TRUE(finished);
+  return posted + worker_after - worker_before;
+}
+
+TEST(memcache, taskMovesCaptures) {
+  std::shared_ptr<int> counter = std::make_shared<int>(0);
+  std::string text(100, 'x');
+  Task task([counter, text]() { (*counter) += text.length(); });
+  EXPECT_TRUE((bool) task);
+  EXPECT_EQ(counter.use_count(), 2);
+
+  Task moved(std::move(task));
+  EXPECT_FALSE((bool) task);
+  EXPECT_EQ(counter.use_count(), 2);
+  moved();
+  EXPECT_EQ(*counter, 100);
+
+  Task assigned;
+  assigned = std::move(moved);
+  assigned();
+  EXPECT_EQ(*counter, 200);
+  EXPECT_EQ(counter.use_count(), 2);
+  assigned.reset();
+  EXPECT_FALSE((bool) assigned);
+  EXPECT_EQ(counter.use_count(), 1);
+}
+
+TEST(memcache, threadpoolPostRunsEveryTask) {
+  ThreadPool pool(4);
+  pool.init();
+  std::atomic<int> count(0);
+  for (int i = 0; i < 100000; i++) {
+    pool.post([&count]() { count++; });
+  }
+  for (int i = 0; i < 1000 && count < 100000; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(count, 100000);
+  pool.shutdown();
+}
+
+TEST(memcache, strandPostRunsInOrder) {
+  ThreadPool pool(4);
+  pool.init();
+  ThreadPool::Strand strand(&pool);
+  std::vector<int> order;
+  std::atomic<bool> done(false);
+  for (int i = 0; i < 1000; i++) {
+    strand.post([&order, i]() { order.push_back(i); });
+  }
+  strand.post([&done]() { done = true; });
+  for (int i = 0; i < 1000 && !done; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_TRUE(done);
+  ASSERT_EQ(order.size(), 1000);
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(order[i], i);
+  }
+  pool.shutdown();
+}
+
+TEST(memcache, postAllocatesNothing) {
+  ThreadPool pool(1);
+  pool.init();
+  // the first round fills the worker's free list
+  PostFromWorker(pool, 1000);
+  EXPECT_EQ(PostFromWorker(pool, 1000), 0);
+
+  ThreadPool::Strand strand(&pool);
+  // the first round grows the ring of the strand while the worker is held
+  PostToStrand(pool, strand, 1000, true);
+  EXPECT_EQ(PostToStrand(pool, strand, 1000, false), 0);
+  pool.shutdown();
+}
@@ -0,0 +1,92 @@
+#include <arpa/inet.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "udpserver.h"
+
+/*
+ * The unit tests in this file verify the requests served over UDP: the
+ * frame header of the replies, the split of a large reply over several
+ * datagrams, and the requests that are refused
+ */
+
+static std::string Datagram(uint16_t request_id, uint16_t sequence, uint16_t count,
+                            const std::string& body) {
+  std::string datagram(UDP_HEADER_SIZE, '\0');
+  uint16_t fields[3] = {htons(request_id), htons(sequence), htons(count)};
+  memcpy(&datagram[0], fields, sizeof fields);
+  return datagram + body;
+}
+
+static uint16_t Field(const std::string& datagram, int index) {
+  uint16_t value;
+  memcpy(&value, datagram.data() + 2 * index, sizeof value);
+  return ntohs(value);
+}
+
+TEST(memcache, udpGet) {
+  std::unique_ptr<Cache> cache(new Cache());
+  ProcessCommands("set k 0 0 5\r\nhello\r\n", cache.get(), 20);
+  std::string request = Datagram(7, 0, 1, "get k missing\r\n");
+  std::vector<std::string> replies;
+  UdpServer::HandleDatagram(request.data(), request.length(), cache.get(), &replies);
+  ASSERT_EQ(replies.size(), 1);
+  EXPECT_EQ(Field(replies[0], 0), 7);
+  EXPECT_EQ(Field(replies[0], 1), 0);
+  EXPECT_EQ(Field(replies[0], 2), 1);
+  EXPECT_EQ(replies[0].substr(UDP_HEADER_SIZE), "VALUE k 0 5\r\nhello\r\n");
+
+  // a miss is one datagram without data
+  request = Datagram(8, 0, 1, "get missing\r\n");
+  replies.clear();
+  UdpServer::HandleDatagram(request.data(), request.length(), cache.get(), &replies);
+  ASSERT_EQ(replies.size(), 1);
+  EXPECT_EQ(replies[0].length(), UDP_HEADER_SIZE);
+}
+
+TEST(memcache, udpLargeReply) {
+  std::unique_ptr<Cache> cache(new Cache());
+  std::string value(5000, 'v');
+  std::string set = "set big 0 0 5000\r\n" + value + "\r\n";
+  ProcessCommands(set, cache.get(), set.length());
+  std::string request = Datagram(9, 0, 1, "get big\r\n");
+  std::vector<std::string> replies;
+  UdpServer::HandleDatagram(request.data(), request.length(), cache.get(), &replies);
+  std::string expected = "VALUE big 0 5000\r\n" + value + "\r\n";
+  size_t payload = UDP_MAX_DATAGRAM - UDP_HEADER_SIZE;
+  ASSERT_EQ(replies.size(), (expected.length() + payload - 1) / payload);
+  std::string reply;
+  for (size_t i = 0; i < replies.size(); i++) {
+    EXPECT_LE(replies[i].length(), UDP_MAX_DATAGRAM);
+    EXPECT_EQ(Field(replies[i], 0), 9);
+    EXPECT_EQ(Field(replies[i], 1), i);
+    EXPECT_EQ(Field(replies[i], 2), replies.size());
+    reply += replies[i].substr(UDP_HEADER_SIZE);
+  }
+  EXPECT_EQ(reply, expected);
+}
+
+TEST(memcache, udpRefusedRequests) {
+  std::unique_ptr<Cache> cache(new Cache());
+  std::vector<std::string> replies;
+  UdpServer::HandleDatagram("abc", 3, cache.get(), &replies);
+  EXPECT_TRUE(replies.empty());
+
+  std::string request = Datagram(1, 0, 1, "set k 0 0 1\r\nv\r\n");
+  UdpServer::HandleDatagram(request.data(), request.length(), cache.get(), &replies);
+  ASSERT_EQ(replies.size(), 1);
+  EXPECT_EQ(replies[0].substr(UDP_HEADER_SIZE), "CLIENT_ERROR only get and gets are served over UDP\r\n");
+
+  request = Datagram(2, 0, 2, "get k\r\n");
+  replies.clear();
+  UdpServer::HandleDatagram(request.data(), request.length(), cache.get(), &replies);
+  ASSERT_EQ(replies.size(), 1);
+  EXPECT_EQ(replies[0].substr(UDP_HEADER_SIZE), "SERVER_ERROR a request must fit in one datagram\r\n");
+
+  request = Datagram(3, 0, 1, "get k");
+  replies.clear();
+  UdpServer::HandleDatagram(request.data(), request.length(), cache.get(), &replies);
+  ASSERT_EQ(replies.size(), 1);
+  EXPECT_EQ(replies[0].substr(UDP_HEADER_SIZE), "CLIENT_ERROR wrong command format\r\n");
+}
@@ -0,0 +1,55 @@
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Threadpool.h"
+
+/*
+ * The unit tests in this file verify how the workers of the threadpool
+ * wait for tasks: a batch submitted at once runs completely, and tasks
+ * submitted one at a time while the workers go to sleep, with and
+ * without spinning first, are never left in the queue
+ */
+
+TEST(memcache, threadpoolSubmitBatch) {
+  ThreadPool pool(4);
+  pool.init();
+  std::vector<std::function<int()>> funcs;
+  for (int i = 0; i < 1000; i++) {
+    funcs.push_back([i]() { return i * 2; });
+  }
+  std::vector<std::future<int>> futures = pool.submit_batch(funcs.begin(), funcs.end());
+  ASSERT_EQ(futures.size(), 1000);
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(futures[i].get(), i * 2);
+  }
+  pool.shutdown();
+}
+
+static void SubmitWhileWorkersSleep(int spin_rounds) {
+  ThreadPool pool(4);
+  pool.setSpinRounds(spin_rounds);
+  pool.init();
+  // the gaps let the workers run out of tasks, spin and go to sleep
+  // between the submits, which a lost wakeup would leave waiting
+  for (int i = 0; i < 2000; i++) {
+    std::future<int> future = pool.submit([i]() { return i; });
+    ASSERT_EQ(future.wait_for(std::chrono::seconds(5)), std::future_status::ready) << "task " << i;
+    EXPECT_EQ(future.get(), i);
+    if (i % 100 == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  }
+  pool.shutdown();
+}
+
+TEST(memcache, threadpoolWakesSleepers) {
+  SubmitWhileWorkersSleep(0);
+}
+
+TEST(memcache, threadpoolWakesAfterSpinning) {
+  SubmitWhileWorkersSleep(100);
+}